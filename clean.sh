@@ -1,6 +1,6 @@
 #!/usr/bin/bash
 
-clean_dirs=(build build_debug tests/build)
+clean_dirs=(build build_debug tests/build tests/build_bench)
 for dir in ${clean_dirs[@]}; do
   if [ -d $dir ]; then
     printf "[ninja] %-11s: $(ninja -C $dir -t clean)\n" $dir
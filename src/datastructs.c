@@ -1,6 +1,8 @@
 #include "datastructs.h"
 
 #include "stdio.h"
+#include "string.h"
+#include "stdint.h"
 #include "stdbool.h"
 #include "math.h"
 #include "assert.h"
@@ -71,13 +73,68 @@ PList PList_new(size_t points_cap) {
   };
 }
 
+PList PList_view(V2* points, size_t count) {
+  return (PList) {
+    .points = points,
+    .count = count,
+    .cap = count,
+    .view = true,
+  };
+}
+
 void PList_free(PList* list) {
-  free(list->points);
+  if (!list->view) free(list->points);
+  list->points = NULL;
   list->count = 0;
+  list->cap = 0;
+  list->view = false;
+}
+
+// capacity of a full list after growing it
+static size_t grown_cap(size_t cap) {
+  return cap > 0 ? 2 * cap : LIST_MIN_CAP;
+}
+
+// realloc to n items, keeps items as they are if that fails
+static void* list_resize(void* items, size_t n, size_t item_size, bool* ok) {
+  if (n == 0) {
+    free(items);
+    *ok = true;
+    return NULL;
+  }
+  void* moved = realloc(items, item_size * n);
+  *ok = moved != NULL;
+  return *ok ? moved : items;
+}
+
+bool PList_reserve(PList* list, size_t cap) {
+  if (cap <= list->cap) {
+    return true;
+  }
+  if (list->view) {
+    V2* points = malloc(sizeof(V2) * cap);
+    if (points == NULL) return false;
+    memcpy(points, list->points, sizeof(V2) * list->count);
+    *list = (PList) {.points = points, .count = list->count, .cap = cap};
+    return true;
+  }
+  bool ok;
+  list->points = list_resize(list->points, cap, sizeof(V2), &ok);
+  if (ok) list->cap = cap;
+  return ok;
+}
+
+bool PList_shrink(PList* list) {
+  // borrowed points are not ours to give back
+  if (list->view) return true;
+  bool ok;
+  list->points = list_resize(list->points, list->count, sizeof(V2), &ok);
+  if (ok) list->cap = list->count;
+  return ok;
 }
 
 bool PList_push(PList* list, float x, float y) {
-  if (list->count >= list->cap) {
+  if (list->count >= list->cap && !PList_reserve(list, grown_cap(list->cap))) {
     return false;
   }
   list->points[list->count] = (V2) {x, y};
@@ -95,7 +152,7 @@ bool PList_pop(PList* list) {
 
 EList EList_new(size_t edges_cap) {
   return (EList) {
-    .edges = malloc(sizeof(V2*) * edges_cap),
+    .edges = malloc(sizeof(Edge) * edges_cap),
     .count = 0,
     .cap = edges_cap,
   };
@@ -103,11 +160,30 @@ EList EList_new(size_t edges_cap) {
 
 void EList_free(EList* list) {
   free(list->edges);
+  list->edges = NULL;
+  list->count = 0;
   list->cap = 0;
 }
 
+bool EList_reserve(EList* list, size_t cap) {
+  if (cap <= list->cap) {
+    return true;
+  }
+  bool ok;
+  list->edges = list_resize(list->edges, cap, sizeof(Edge), &ok);
+  if (ok) list->cap = cap;
+  return ok;
+}
+
+bool EList_shrink(EList* list) {
+  bool ok;
+  list->edges = list_resize(list->edges, list->count, sizeof(Edge), &ok);
+  if (ok) list->cap = list->count;
+  return ok;
+}
+
 bool EList_push(EList* list, V2* p0, V2* p1) {
-  if (list->count >= list->cap) {
+  if (list->count >= list->cap && !EList_reserve(list, grown_cap(list->cap))) {
     return false;
   }
   list->edges[list->count] = (Edge) {p0, p1};
@@ -115,10 +191,25 @@ bool EList_push(EList* list, V2* p0, V2* p1) {
   return true;
 }
 
-bool EList_pop(PList* list) {
+bool EList_pop(EList* list) {
   if (list->count == 0) {
     return false;
   }
   list->count--;
   return true;
 }
+
+V2* rebase_point(V2* p, const V2* old, size_t count, V2* new) {
+  const uintptr_t addr = (uintptr_t)p, begin = (uintptr_t)old;
+  if (addr < begin || addr >= begin + count * sizeof(V2)) {
+    return p;
+  }
+  return new + (addr - begin) / sizeof(V2);
+}
+
+void EList_rebase(EList* list, const V2* old, size_t count, V2* new) {
+  for (size_t i = 0; i < list->count; i++) {
+    list->edges[i].p0 = rebase_point(list->edges[i].p0, old, count, new);
+    list->edges[i].p1 = rebase_point(list->edges[i].p1, old, count, new);
+  }
+}
@@ -30,27 +30,43 @@ bool v2_eq(const V2 a, const V2 b);
 
 RelPos relative_pos(const V2* pos, const V2* rel);
 
+// capacity of a list that grows from 0
+#define LIST_MIN_CAP 16
+
 /****************************************************
- * PList is a list of points with fixed capacity.
- * Pushing and Popping is possible.
- * Size does not need to be known at compile time
+ * PList is a list of points. Pushing grows it by
+ * doubling its capacity, which may move the points,
+ * so pointers into it have to be rebased afterwards.
+ * A view borrows its points (e.g. from a mapped file)
+ * and copies them to memory of its own once it grows.
  */
 typedef struct {
   V2 *points;
   size_t count;
   size_t cap;
+  bool view; // points are borrowed and not freed
 } PList;
 
 
 PList PList_new(size_t points_cap);
+// list of the count points at points, which have to outlive it
+PList PList_view(V2* points, size_t count);
 void PList_free(PList* list);
+// false only if memory runs out
 bool PList_push(PList* list, float x, float y);
 bool PList_pop(PList* list);
+// make room for cap points, false if memory runs out
+bool PList_reserve(PList* list, size_t cap);
+// drop the capacity that is not used
+bool PList_shrink(PList* list);
+
+// pointer p into the count points at old, moved to new
+// pointers outside of old are returned as they are
+V2* rebase_point(V2* p, const V2* old, size_t count, V2* new);
 
 /****************************************************
- * EList is a list of edges with fixed capacity.
- * Pushing and Popping is possible.
- * Size does not need to be known at compile time
+ * EList is a list of edges between points of PLists,
+ * growing like a PList.
  */
 typedef struct {
   V2 *p0;
@@ -66,5 +82,9 @@ typedef struct {
 EList EList_new(size_t edges_cap);
 void EList_free(EList* list);
 bool EList_push(EList* list, V2* p0, V2* p1);
-bool EList_pop(PList* list);
+bool EList_pop(EList* list);
+bool EList_reserve(EList* list, size_t cap);
+bool EList_shrink(EList* list);
+// repoint edges into the count points at old (a PList that moved) to new
+void EList_rebase(EList* list, const V2* old, size_t count, V2* new);
 #endif // DATASTRUCTS_H
@@ -0,0 +1,1299 @@
+#include "stdint.h"
+#include "string.h"
+#include "math.h"
+#include "assert.h"
+
+#include "delaunay.h"
+#include "qtree.h"
+#include "v2batch.h"
+#include "predicates.h"
+#include "logging.h"
+#include "instrument.h"
+
+// vertices 0, 1 and 2 span the super triangle
+#define N_SUPER 3
+// distance of the super vertices in multiples of the input extent
+#define SUPER_SCALE 1024.0
+
+#define NEXT(i) ((i) == 2 ? 0 : (i) + 1)
+#define PREV(i) ((i) == 0 ? 2 : (i) - 1)
+
+typedef struct {
+  uint32_t v[3]; // counter clockwise
+  int32_t n[3];  // triangle across the edge opposite of v[i], -1 for none
+  uint8_t fixed; // bit i is set if the edge opposite of v[i] is a constraint
+  bool inside;   // enclosed by the constraints, kept by dt_to_mesh
+} Tri;
+
+#define FIXED(tri, i) (((tri)->fixed >> (i)) & 1)
+#define FIXED_BIT(tri, i, k) (FIXED(tri, i) << (k))
+
+// edge opposite of tris[t].v[i], left to be checked for the delaunay criterion
+typedef struct {
+  int32_t t;
+  int32_t i;
+} FlipEdge;
+
+// edge between two vertices, survives flips of its triangles
+typedef struct {
+  uint32_t a;
+  uint32_t b;
+} VEdge;
+
+// fifo ring buffer of edges
+typedef struct {
+  VEdge* edges;
+  size_t head;
+  size_t count;
+  size_t cap; // power of two
+} EdgeQueue;
+
+typedef struct {
+  V2* pts;    // coordinates, the super vertices first
+  V2** src;   // input point of every vertex, NULL for super vertices
+  uint32_t* alias; // vertex a duplicate point was merged into, itself otherwise
+  int32_t* vt;     // some triangle incident to every inserted vertex
+  size_t n_verts;
+  size_t cap_verts;
+
+  Tri* tris;
+  size_t n_tris;
+  size_t cap_tris;
+
+  FlipEdge* stack;
+  size_t n_stack;
+  size_t cap_stack;
+
+  EdgeQueue cross; // edges crossing the constraint being recovered
+  EdgeQueue fresh; // edges created while recovering it
+
+  V2 min; // bounding box of the input points
+  V2 max;
+  int32_t last; // start of the next point location walk
+  uint32_t rng;
+  bool oom; // an allocation failed, the triangulation is valid but incomplete
+} Triangulation;
+
+typedef enum {
+  LOC_INSIDE = 0,
+  LOC_EDGE,
+  LOC_VERTEX,
+} Location;
+
+static inline bool is_super(uint32_t v) {
+  return v < N_SUPER;
+}
+
+// room for n more triangles, the triangles stay as they are if that fails
+static bool dt_reserve_tris(Triangulation* dt, size_t n) {
+  if (dt->n_tris + n <= dt->cap_tris) return true;
+  const size_t cap = 2 * dt->cap_tris + n;
+  Tri* tris = realloc(dt->tris, sizeof(Tri) * cap);
+  if (tris == NULL) {
+    dt->oom = true;
+    return false;
+  }
+  dt->tris = tris;
+  dt->cap_tris = cap;
+  return true;
+}
+
+// after dt_reserve_tris
+static int32_t dt_new_tri(Triangulation* dt) {
+  assert(dt->n_tris < dt->cap_tris && "triangles were not reserved");
+  return dt->n_tris++;
+}
+
+// without memory the edge is not checked, the triangulation stays valid
+static void dt_push_edge(Triangulation* dt, int32_t t, int32_t i) {
+  if (dt->n_stack == dt->cap_stack) {
+    FlipEdge* stack = realloc(dt->stack, sizeof(FlipEdge) * 2 * dt->cap_stack);
+    if (stack == NULL) {
+      dt->oom = true;
+      return;
+    }
+    dt->stack = stack;
+    dt->cap_stack *= 2;
+  }
+  dt->stack[dt->n_stack++] = (FlipEdge) { .t = t, .i = i };
+}
+
+// point the neighbor t of triangle nb to t_new
+static void dt_replace_neighbor(Triangulation* dt, int32_t nb, int32_t t, int32_t t_new) {
+  if (nb < 0) return;
+  Tri* tri = &dt->tris[nb];
+  for (int k = 0; k < 3; k++) {
+    if (tri->n[k] == t) {
+      tri->n[k] = t_new;
+      return;
+    }
+  }
+  assert(false && "triangles are not neighbors");
+}
+
+static int dt_neighbor_index(const Triangulation* dt, int32_t t, int32_t nb) {
+  const Tri* tri = &dt->tris[t];
+  for (int k = 0; k < 3; k++) {
+    if (tri->n[k] == nb) return k;
+  }
+  // callers only ask for neighbors, release builds may rely on that
+  assert(false && "triangles are not neighbors");
+  __builtin_unreachable();
+}
+
+/*
+ * The edge a-b between the triangles p, a, b and b, a, q needs a flip.
+ * Super vertices are treated as if they were infinitely far away, otherwise
+ * their circles would eat into the convex hull of the input points.
+ */
+static bool dt_illegal(const Triangulation* dt, uint32_t p, uint32_t a, uint32_t b, uint32_t q) {
+  const V2* pts = dt->pts;
+  // a flip needs a convex quad
+  if (orient2d(pts[p], pts[a], pts[q]) <= 0 || orient2d(pts[p], pts[q], pts[b]) <= 0) {
+    return false;
+  }
+
+  const int n_super = is_super(p) + is_super(a) + is_super(b) + is_super(q);
+  if (n_super == 0) {
+    return incircle(pts[p], pts[a], pts[b], pts[q]) > 0;
+  }
+  if (!is_super(a) && !is_super(b)) {
+    // the circle of a triangle with a vertex at infinity is a half plane
+    // which never contains the vertex on the other side of the edge
+    return false;
+  }
+  if (n_super == 1) {
+    // an edge to infinity only stays on the convex hull
+    return true;
+  }
+  return incircle(pts[p], pts[a], pts[b], pts[q]) > 0;
+}
+
+// replace edge opposite of tris[t].v[i] by the other diagonal of its quad
+static void dt_flip(Triangulation* dt, int32_t t, int i, int32_t o, int j) {
+  Tri* tt = &dt->tris[t];
+  Tri* to = &dt->tris[o];
+  const uint32_t p = tt->v[i], a = tt->v[NEXT(i)], b = tt->v[PREV(i)];
+  const uint32_t q = to->v[j];
+  const int32_t n_ta = tt->n[NEXT(i)], n_tb = tt->n[PREV(i)];
+  const int32_t n_ob = to->n[NEXT(j)], n_oa = to->n[PREV(j)];
+  const uint8_t f_t = FIXED_BIT(tt, PREV(i), 2), f_o = FIXED_BIT(tt, NEXT(i), 1);
+  const uint8_t f_ob = FIXED_BIT(to, NEXT(j), 0), f_oa = FIXED_BIT(to, PREV(j), 0);
+
+  // constraints are never flipped, so both triangles are on the same side
+  *tt = (Tri) { .v = {p, a, q}, .n = {n_ob, o, n_tb}, .fixed = f_ob | f_t, .inside = tt->inside };
+  *to = (Tri) { .v = {p, q, b}, .n = {n_oa, n_ta, t}, .fixed = f_oa | f_o, .inside = to->inside };
+  dt_replace_neighbor(dt, n_ob, o, t);
+  dt_replace_neighbor(dt, n_ta, t, o);
+  dt->vt[a] = t;
+  dt->vt[b] = o;
+  dt->vt[p] = t;
+  dt->vt[q] = o;
+}
+
+static void dt_legalize(Triangulation* dt) {
+  while (dt->n_stack > 0) {
+    const FlipEdge e = dt->stack[--dt->n_stack];
+    const Tri* tt = &dt->tris[e.t];
+    const int32_t o = tt->n[e.i];
+    if (o < 0 || FIXED(tt, e.i)) continue;
+
+    const int j = dt_neighbor_index(dt, o, e.t);
+    if (dt_illegal(dt, tt->v[e.i], tt->v[NEXT(e.i)], tt->v[PREV(e.i)], dt->tris[o].v[j])) {
+      dt_flip(dt, e.t, e.i, o, j);
+      // the new point is at index 0 of both triangles
+      dt_push_edge(dt, e.t, 0);
+      dt_push_edge(dt, o, 0);
+    }
+  }
+}
+
+// like dt_legalize, but checks all outer edges of a flipped quad
+static void dt_legalize_quads(Triangulation* dt) {
+  while (dt->n_stack > 0) {
+    const FlipEdge e = dt->stack[--dt->n_stack];
+    const Tri* tt = &dt->tris[e.t];
+    const int32_t o = tt->n[e.i];
+    if (o < 0 || FIXED(tt, e.i)) continue;
+
+    const int j = dt_neighbor_index(dt, o, e.t);
+    if (dt_illegal(dt, tt->v[e.i], tt->v[NEXT(e.i)], tt->v[PREV(e.i)], dt->tris[o].v[j])) {
+      dt_flip(dt, e.t, e.i, o, j);
+      dt_push_edge(dt, e.t, 0);
+      dt_push_edge(dt, e.t, 2);
+      dt_push_edge(dt, o, 0);
+      dt_push_edge(dt, o, 1);
+    }
+  }
+}
+
+static uint32_t dt_rand(Triangulation* dt) {
+  uint32_t x = dt->rng;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return dt->rng = x;
+}
+
+/*
+ * Walk from the last triangle towards p. Edges are tested starting at a
+ * random one, which keeps the walk from cycling on degenerate input.
+ */
+static int32_t dt_locate(Triangulation* dt, V2 p, Location* loc, int* idx) {
+  int32_t t = dt->last;
+  for (;;) {
+    const Tri* tri = &dt->tris[t];
+    const int start = dt_rand(dt) % 3;
+    int n_zero = 0;
+    int zero = 0;
+    bool moved = false;
+    for (int k = 0; k < 3; k++) {
+      const int e = (start + k) % 3;
+      const double o = orient2d(dt->pts[tri->v[NEXT(e)]], dt->pts[tri->v[PREV(e)]], p);
+      if (o < 0) {
+        assert(tri->n[e] >= 0 && "point outside of the super triangle");
+        t = tri->n[e];
+        moved = true;
+        break;
+      }
+      if (o == 0) {
+        n_zero++;
+        zero = e;
+      }
+    }
+    if (moved) continue;
+
+    if (n_zero == 0) {
+      *loc = LOC_INSIDE;
+    } else if (n_zero == 1) {
+      *loc = LOC_EDGE;
+      *idx = zero;
+    } else {
+      *loc = LOC_VERTEX;
+    }
+    return t;
+  }
+}
+
+// false if there is no memory for the new triangles
+static bool dt_insert_inside(Triangulation* dt, int32_t t, uint32_t p) {
+  if (!dt_reserve_tris(dt, 2)) return false;
+  const int32_t t1 = dt_new_tri(dt);
+  const int32_t t2 = dt_new_tri(dt);
+  const Tri old = dt->tris[t];
+  const uint32_t a = old.v[0], b = old.v[1], c = old.v[2];
+
+  dt->tris[t]  = (Tri) { .v = {a, b, p}, .n = {t1, t2, old.n[2]},
+                         .fixed = FIXED_BIT(&old, 2, 2), .inside = old.inside };
+  dt->tris[t1] = (Tri) { .v = {b, c, p}, .n = {t2, t, old.n[0]},
+                         .fixed = FIXED_BIT(&old, 0, 2), .inside = old.inside };
+  dt->tris[t2] = (Tri) { .v = {c, a, p}, .n = {t, t1, old.n[1]},
+                         .fixed = FIXED_BIT(&old, 1, 2), .inside = old.inside };
+  dt_replace_neighbor(dt, old.n[0], t, t1);
+  dt_replace_neighbor(dt, old.n[1], t, t2);
+  dt->vt[c] = t1;
+  dt->vt[p] = t;
+
+  dt_push_edge(dt, t, 2);
+  dt_push_edge(dt, t1, 2);
+  dt_push_edge(dt, t2, 2);
+  return true;
+}
+
+// p lies on the edge opposite of tris[t].v[i]
+// false if there is no memory for the new triangles
+static bool dt_insert_edge(Triangulation* dt, int32_t t, int i, uint32_t p) {
+  if (!dt_reserve_tris(dt, 2)) return false;
+  const int32_t t1 = dt_new_tri(dt);
+  const Tri old = dt->tris[t];
+  const uint32_t c = old.v[i], a = old.v[NEXT(i)], b = old.v[PREV(i)];
+  const int32_t n_ta = old.n[NEXT(i)], n_tb = old.n[PREV(i)];
+  const int32_t o = old.n[i];
+  // both halves of a split constraint stay constraints
+  const uint8_t f = FIXED(&old, i);
+  const uint8_t f_ta = FIXED_BIT(&old, NEXT(i), 1), f_tb = FIXED_BIT(&old, PREV(i), 2);
+  dt->vt[a] = t;
+  dt->vt[b] = t1;
+  dt->vt[p] = t;
+
+  if (o < 0) {
+    dt->tris[t]  = (Tri) { .v = {c, a, p}, .n = {-1, t1, n_tb}, .fixed = f | f_tb, .inside = old.inside };
+    dt->tris[t1] = (Tri) { .v = {c, p, b}, .n = {-1, n_ta, t}, .fixed = f | f_ta, .inside = old.inside };
+    dt_replace_neighbor(dt, n_ta, t, t1);
+    dt_push_edge(dt, t, 2);
+    dt_push_edge(dt, t1, 1);
+    return true;
+  }
+
+  const int32_t t3 = dt_new_tri(dt);
+  const int j = dt_neighbor_index(dt, o, t);
+  const Tri old_o = dt->tris[o];
+  const uint32_t d = old_o.v[j];
+  const int32_t n_ob = old_o.n[NEXT(j)], n_oa = old_o.n[PREV(j)];
+  const uint8_t f_ob = FIXED_BIT(&old_o, NEXT(j), 1), f_oa = FIXED_BIT(&old_o, PREV(j), 2);
+
+  dt->tris[t]  = (Tri) { .v = {c, a, p}, .n = {t3, t1, n_tb}, .fixed = f | f_tb, .inside = old.inside };
+  dt->tris[t1] = (Tri) { .v = {c, p, b}, .n = {o, n_ta, t}, .fixed = f | f_ta, .inside = old.inside };
+  dt->tris[o]  = (Tri) { .v = {d, b, p}, .n = {t1, t3, n_oa}, .fixed = f | f_oa, .inside = old_o.inside };
+  dt->tris[t3] = (Tri) { .v = {d, p, a}, .n = {t, n_ob, o}, .fixed = f | f_ob, .inside = old_o.inside };
+  dt_replace_neighbor(dt, n_ta, t, t1);
+  dt_replace_neighbor(dt, n_ob, o, t3);
+
+  dt_push_edge(dt, t, 2);
+  dt_push_edge(dt, t1, 1);
+  dt_push_edge(dt, o, 2);
+  dt_push_edge(dt, t3, 1);
+  return true;
+}
+
+// insert p into the triangle t found by dt_locate
+// false for duplicates and if there is no memory (dt->oom)
+static bool dt_insert_located(Triangulation* dt, uint32_t p, int32_t t, Location loc, int idx) {
+  switch (loc) {
+    case LOC_INSIDE:
+      if (!dt_insert_inside(dt, t, p)) return false;
+      break;
+    case LOC_EDGE:
+      if (!dt_insert_edge(dt, t, idx, p)) return false;
+      break;
+    case LOC_VERTEX:
+      log_wrn("IGNORING DUPLICATE POINT AT (%.2f, %.2f)", P_COORDS(dt->pts[p]));
+      for (int k = 0; k < 3; k++) {
+        if (v2_eq(dt->pts[dt->tris[t].v[k]], dt->pts[p])) dt->alias[p] = dt->tris[t].v[k];
+      }
+      return false;
+  }
+  dt_legalize(dt);
+  dt->last = t;
+  return true;
+}
+
+static bool dt_insert(Triangulation* dt, uint32_t p) {
+  Location loc;
+  int idx = 0;
+  const int32_t t = dt_locate(dt, dt->pts[p], &loc, &idx);
+  return dt_insert_located(dt, p, t, loc, idx);
+}
+
+typedef struct {
+  uint64_t key;
+  uint32_t vert;
+} SortEntry;
+
+static int sort_entry_cmp(const void* a, const void* b) {
+  const SortEntry* ea = a;
+  const SortEntry* eb = b;
+  if (ea->key != eb->key) return ea->key < eb->key ? -1 : 1;
+  return (ea->vert > eb->vert) - (ea->vert < eb->vert);
+}
+
+static void dt_free(Triangulation* dt);
+
+// false if there is no memory, then nothing is left to free
+static bool dt_init(Triangulation* dt, size_t n_lists, const PList* lists[], size_t n) {
+  const size_t n_verts = n + N_SUPER;
+  *dt = (Triangulation) {
+    .pts = malloc(sizeof(V2) * n_verts),
+    .src = malloc(sizeof(V2*) * n_verts),
+    .alias = malloc(sizeof(uint32_t) * n_verts),
+    .vt = malloc(sizeof(int32_t) * n_verts),
+    .n_verts = n_verts,
+    .cap_verts = n_verts,
+    .cap_tris = 2 * n_verts + 1,
+    .cap_stack = 64,
+    .last = 0,
+    .rng = 0x2545F491,
+  };
+  dt->tris = malloc(sizeof(Tri) * dt->cap_tris);
+  dt->stack = malloc(sizeof(FlipEdge) * dt->cap_stack);
+  dt->cross = (EdgeQueue) { .edges = malloc(sizeof(VEdge) * 16), .cap = 16 };
+  dt->fresh = (EdgeQueue) { .edges = malloc(sizeof(VEdge) * 16), .cap = 16 };
+  if (dt->pts == NULL || dt->src == NULL || dt->alias == NULL || dt->vt == NULL || dt->tris == NULL
+      || dt->stack == NULL || dt->cross.edges == NULL || dt->fresh.edges == NULL) {
+    dt_free(dt);
+    return false;
+  }
+
+  V2 min = v2(0, 0), max = v2(0, 0);
+  bool any = false;
+  size_t v = N_SUPER;
+  for (size_t l = 0; l < n_lists; l++) {
+    V2 lmin, lmax;
+    if (v2_bounds(lists[l]->points, lists[l]->count, &lmin, &lmax)) {
+      min = any ? v2(fminf(min.x, lmin.x), fminf(min.y, lmin.y)) : lmin;
+      max = any ? v2(fmaxf(max.x, lmax.x), fmaxf(max.y, lmax.y)) : lmax;
+      any = true;
+    }
+    for (size_t i = 0; i < lists[l]->count; i++) {
+      dt->pts[v] = lists[l]->points[i];
+      dt->src[v] = &lists[l]->points[i];
+      dt->alias[v] = v;
+      v++;
+    }
+  }
+
+  const double cx = ((double)min.x + max.x) / 2, cy = ((double)min.y + max.y) / 2;
+  double d = (double)max.x - min.x > (double)max.y - min.y
+    ? (double)max.x - min.x : (double)max.y - min.y;
+  if (d == 0) d = 1;
+  d *= SUPER_SCALE;
+  dt->pts[0] = v2(cx - 2 * d, cy - d);
+  dt->pts[1] = v2(cx + 2 * d, cy - d);
+  dt->pts[2] = v2(cx, cy + 2 * d);
+  dt->src[0] = dt->src[1] = dt->src[2] = NULL;
+  dt->alias[0] = 0;
+  dt->alias[1] = 1;
+  dt->alias[2] = 2;
+  dt->vt[0] = dt->vt[1] = dt->vt[2] = 0;
+  dt->min = min;
+  dt->max = max;
+  dt->tris[0] = (Tri) { .v = {0, 1, 2}, .n = {-1, -1, -1} };
+  dt->n_tris = 1;
+  return true;
+}
+
+static void dt_free(Triangulation* dt) {
+  free(dt->pts);
+  free(dt->src);
+  free(dt->alias);
+  free(dt->vt);
+  free(dt->tris);
+  free(dt->stack);
+  free(dt->cross.edges);
+  free(dt->fresh.edges);
+}
+
+// insert all input points in morton order, so consecutive points are close
+// stops early if there is no memory (dt->oom)
+static void dt_insert_all(Triangulation* dt) {
+  const size_t n = dt->n_verts - N_SUPER;
+  const V2 min = dt->min, max = dt->max;
+  const V2 center = v2((min.x + max.x) / 2, (min.y + max.y) / 2);
+  const float w = max.x - min.x > 0 ? max.x - min.x : 1;
+  const float h = max.y - min.y > 0 ? max.y - min.y : 1;
+
+  SortEntry* order = malloc(sizeof(SortEntry) * n);
+  if (order == NULL) {
+    // without memory for sorting, they are inserted as they are
+    for (size_t i = 0; i < n && !dt->oom; i++) {
+      dt_insert(dt, N_SUPER + i);
+    }
+    return;
+  }
+  for (size_t i = 0; i < n; i++) {
+    order[i] = (SortEntry) {
+      .key = morton_key(dt->pts[N_SUPER + i], center, w, h),
+      .vert = N_SUPER + i,
+    };
+  }
+  qsort(order, n, sizeof(SortEntry), sort_entry_cmp);
+
+  for (size_t i = 0; i < n && !dt->oom; i++) {
+    dt_insert(dt, order[i].vert);
+  }
+  free(order);
+}
+
+/****************************************************
+ * Constraint recovery (Sloan 1993). The edges crossing
+ * a constraint are collected by walking along it and
+ * flipped until the constraint is an edge itself. The
+ * flipped edges are legalized afterwards, constraints
+ * are never flipped.
+ */
+
+// false if there is no memory, the queue stays as it is
+static bool eq_push(EdgeQueue* q, uint32_t a, uint32_t b) {
+  if (q->count == q->cap) {
+    const size_t cap = q->cap * 2;
+    VEdge* edges = malloc(sizeof(VEdge) * cap);
+    if (edges == NULL) return false;
+    for (size_t i = 0; i < q->count; i++) {
+      edges[i] = q->edges[(q->head + i) & (q->cap - 1)];
+    }
+    free(q->edges);
+    *q = (EdgeQueue) { .edges = edges, .head = 0, .count = q->count, .cap = cap };
+  }
+  q->edges[(q->head + q->count) & (q->cap - 1)] = (VEdge) { .a = a, .b = b };
+  q->count++;
+  return true;
+}
+
+static VEdge eq_pop(EdgeQueue* q) {
+  const VEdge e = q->edges[q->head];
+  q->head = (q->head + 1) & (q->cap - 1);
+  q->count--;
+  return e;
+}
+
+static void eq_clear(EdgeQueue* q) {
+  q->head = 0;
+  q->count = 0;
+}
+
+static int dt_vertex_index(const Triangulation* dt, int32_t t, uint32_t v) {
+  const Tri* tri = &dt->tris[t];
+  for (int k = 0; k < 3; k++) {
+    if (tri->v[k] == v) return k;
+  }
+  assert(false && "vertex is not in triangle");
+  return -1;
+}
+
+// triangle with the edge a-b opposite of its vertex *i, -1 if there is no such edge
+static int32_t dt_find_edge(const Triangulation* dt, uint32_t a, uint32_t b, int* i) {
+  const int32_t start = dt->vt[a];
+  int32_t t = start;
+  do {
+    const Tri* tri = &dt->tris[t];
+    const int k = dt_vertex_index(dt, t, a);
+    if (tri->v[NEXT(k)] == b) {
+      *i = PREV(k);
+      return t;
+    }
+    if (tri->v[PREV(k)] == b) {
+      *i = NEXT(k);
+      return t;
+    }
+    t = tri->n[PREV(k)];
+  } while (t >= 0 && t != start);
+  return -1;
+}
+
+// p lies on the line through a and b, true if it is on the side of b
+static inline bool same_direction(V2 a, V2 b, V2 p) {
+  return ((double)p.x - a.x) * ((double)b.x - a.x) + ((double)p.y - a.y) * ((double)b.y - a.y) > 0;
+}
+
+// the segments a-b and p-q cross in a point which is not an end point
+static inline bool crosses(V2 a, V2 b, V2 p, V2 q) {
+  const double op = orient2d(a, b, p), oq = orient2d(a, b, q);
+  const double oa = orient2d(p, q, a), ob = orient2d(p, q, b);
+  return ((op < 0 && oq > 0) || (op > 0 && oq < 0))
+      && ((oa < 0 && ob > 0) || (oa > 0 && ob < 0));
+}
+
+/*
+ * Walk from a towards b and queue the edges crossing a-b. The walk stops early
+ * at a vertex on the segment, which is returned instead of b. *blocked is set
+ * if one of the crossed edges is a constraint itself. Without memory for the
+ * queue dt->oom is set and the walk stops.
+ */
+static uint32_t dt_collect_crossing(Triangulation* dt, uint32_t a, uint32_t b, bool* blocked) {
+  const V2* pts = dt->pts;
+  // turn around a until the segment leaves through the edge r-l opposite of a
+  int32_t t = dt->vt[a];
+  int e;
+  uint32_t r, l;
+  for (size_t n = 0;; n++) {
+    assert(n < dt->n_tris && "vertex is not surrounded by triangles");
+    const Tri* tri = &dt->tris[t];
+    const int k = dt_vertex_index(dt, t, a);
+    r = tri->v[NEXT(k)];
+    l = tri->v[PREV(k)];
+    if (r == b || l == b) return b;
+
+    const double o_r = orient2d(pts[a], pts[b], pts[r]);
+    const double o_l = orient2d(pts[a], pts[b], pts[l]);
+    if (o_r == 0 && same_direction(pts[a], pts[b], pts[r])) return r;
+    if (o_l == 0 && same_direction(pts[a], pts[b], pts[l])) return l;
+    if (o_r < 0 && o_l > 0) {
+      e = k;
+      break;
+    }
+    t = tri->n[PREV(k)];
+  }
+
+  // cross triangles until b or a vertex on the segment is reached
+  for (;;) {
+    const Tri* tri = &dt->tris[t];
+    *blocked |= FIXED(tri, e);
+    if (!eq_push(&dt->cross, r, l)) {
+      dt->oom = true;
+      return b;
+    }
+
+    const int32_t o = tri->n[e];
+    assert(o >= 0 && "constraint leaves the triangulation");
+    const uint32_t q = dt->tris[o].v[dt_neighbor_index(dt, o, t)];
+    if (q == b) return b;
+
+    const double o_q = orient2d(pts[a], pts[b], pts[q]);
+    if (o_q == 0) return q;
+    if (o_q > 0) {
+      e = dt_vertex_index(dt, o, l);
+      l = q;
+    } else {
+      e = dt_vertex_index(dt, o, r);
+      r = q;
+    }
+    t = o;
+  }
+}
+
+// flip the queued edges crossing a-b until a-b is an edge and mark it as a constraint
+static void dt_recover(Triangulation* dt, uint32_t a, uint32_t b) {
+  const V2* pts = dt->pts;
+  eq_clear(&dt->fresh);
+  while (dt->cross.count > 0) {
+    const VEdge e = eq_pop(&dt->cross);
+    int i;
+    const int32_t t = dt_find_edge(dt, e.a, e.b, &i);
+    assert(t >= 0 && "crossing edge vanished");
+    const Tri* tt = &dt->tris[t];
+    const int32_t o = tt->n[i];
+    const int j = dt_neighbor_index(dt, o, t);
+    const uint32_t p = tt->v[i], x = tt->v[NEXT(i)], y = tt->v[PREV(i)];
+    const uint32_t q = dt->tris[o].v[j];
+
+    // only the diagonal of a convex quad can be flipped, retry later
+    if (orient2d(pts[p], pts[x], pts[q]) <= 0 || orient2d(pts[p], pts[q], pts[y]) <= 0) {
+      // popped just before, so there is room
+      eq_push(&dt->cross, e.a, e.b);
+      continue;
+    }
+    dt_flip(dt, t, i, o, j);
+    if (!eq_push(crosses(pts[a], pts[b], pts[p], pts[q]) ? &dt->cross : &dt->fresh, p, q)) {
+      // the flips so far leave a valid triangulation without the constraint
+      dt->oom = true;
+      return;
+    }
+  }
+
+  int i;
+  const int32_t t = dt_find_edge(dt, a, b, &i);
+  assert(t >= 0 && "constraint was not recovered");
+  dt->tris[t].fixed |= 1 << i;
+  const int32_t o = dt->tris[t].n[i];
+  if (o >= 0) {
+    dt->tris[o].fixed |= 1 << dt_neighbor_index(dt, o, t);
+  }
+
+  while (dt->fresh.count > 0) {
+    const VEdge e = eq_pop(&dt->fresh);
+    const int32_t tf = dt_find_edge(dt, e.a, e.b, &i);
+    if (tf >= 0 && !FIXED(&dt->tris[tf], i)) dt_push_edge(dt, tf, i);
+  }
+  dt_legalize_quads(dt);
+}
+
+// false if the constraint crosses another one and was skipped, or there is no memory
+static bool dt_insert_constraint(Triangulation* dt, uint32_t a, uint32_t b) {
+  while (a != b) {
+    bool blocked = false;
+    eq_clear(&dt->cross);
+    const uint32_t v = dt_collect_crossing(dt, a, b, &blocked);
+    if (dt->oom) return false;
+    if (blocked) {
+      log_wrn("Skipping constraint (%.2f, %.2f) - (%.2f, %.2f), it crosses another one",
+              P_COORDS(dt->pts[a]), P_COORDS(dt->pts[b]));
+      return false;
+    }
+    dt_recover(dt, a, v);
+    if (dt->oom) return false;
+    a = v;
+  }
+  return true;
+}
+
+// vertex of a point inside of one of the lists, -1 if it is in none of them
+static int64_t dt_vertex_of(const Triangulation* dt, size_t n_lists, const PList* lists[], const V2* p) {
+  size_t base = N_SUPER;
+  for (size_t l = 0; l < n_lists; l++) {
+    if (p >= lists[l]->points && p < lists[l]->points + lists[l]->count) {
+      return dt->alias[base + (p - lists[l]->points)];
+    }
+    base += lists[l]->count;
+  }
+  return -1;
+}
+
+static void dt_insert_constraints(Triangulation* dt, size_t n_lists, const PList* lists[],
+                                  const EList* constraints) {
+  for (size_t i = 0; i < constraints->count && !dt->oom; i++) {
+    const Edge* e = &constraints->edges[i];
+    const int64_t a = dt_vertex_of(dt, n_lists, lists, e->p0);
+    const int64_t b = dt_vertex_of(dt, n_lists, lists, e->p1);
+    if (a < 0 || b < 0) {
+      log_wrn("Skipping constraint %ld, its points are not in the input lists", i);
+      continue;
+    }
+    dt_insert_constraint(dt, a, b);
+  }
+}
+
+/*
+ * Flood fill from the super triangle, crossing a constraint moves one level
+ * deeper. Triangles on odd levels are inside (even-odd rule), so closed loops
+ * of constraints inside of the outline become holes. Sets dt->oom without
+ * memory for the fill.
+ */
+static void dt_mark_inside(Triangulation* dt) {
+  int32_t* depth = malloc(sizeof(int32_t) * dt->n_tris);
+  int32_t* cur = malloc(sizeof(int32_t) * dt->n_tris);
+  // a triangle can be reached over each of its edges
+  int32_t* next = malloc(sizeof(int32_t) * 3 * dt->n_tris);
+  if (depth == NULL || cur == NULL || next == NULL) {
+    dt->oom = true;
+    free(depth);
+    free(cur);
+    free(next);
+    return;
+  }
+  for (size_t t = 0; t < dt->n_tris; t++) {
+    depth[t] = -1;
+  }
+
+  size_t n_cur = 0, n_next = 0;
+  int32_t d = 0;
+  depth[dt->vt[0]] = 0;
+  cur[n_cur++] = dt->vt[0];
+  while (n_cur > 0) {
+    while (n_cur > 0) {
+      const Tri* tri = &dt->tris[cur[--n_cur]];
+      for (int k = 0; k < 3; k++) {
+        const int32_t nb = tri->n[k];
+        if (nb < 0 || depth[nb] >= 0) continue;
+        if (FIXED(tri, k)) {
+          next[n_next++] = nb;
+        } else {
+          depth[nb] = d;
+          cur[n_cur++] = nb;
+        }
+      }
+    }
+    d++;
+    for (size_t i = 0; i < n_next; i++) {
+      if (depth[next[i]] >= 0) continue;
+      depth[next[i]] = d;
+      cur[n_cur++] = next[i];
+    }
+    n_next = 0;
+  }
+
+  for (size_t t = 0; t < dt->n_tris; t++) {
+    dt->tris[t].inside = depth[t] % 2 == 1;
+  }
+  free(depth);
+  free(cur);
+  free(next);
+}
+
+// copy all triangles without a super vertex into msh, only those inside if constrained
+static bool dt_to_mesh(const Triangulation* dt, Mesh* msh, bool constrained) {
+  int64_t* map = malloc(sizeof(int64_t) * dt->n_tris);
+  msh->count = 0;
+  if (map == NULL) {
+    log_wrn("Could not allocate the cell map of %ld triangles", dt->n_tris);
+    return false;
+  }
+  size_t n_cells = 0;
+  for (size_t t = 0; t < dt->n_tris; t++) {
+    const Tri* tri = &dt->tris[t];
+    const bool finite = !is_super(tri->v[0]) && !is_super(tri->v[1]) && !is_super(tri->v[2]);
+    map[t] = finite && (!constrained || tri->inside) ? (int64_t)n_cells++ : -1;
+  }
+
+  if (!Mesh_reserve(msh, n_cells)) {
+    log_wrn("Could not allocate %ld mesh cells", n_cells);
+    free(map);
+    return false;
+  }
+
+  for (size_t t = 0; t < dt->n_tris; t++) {
+    if (map[t] < 0) continue;
+    const Tri* tri = &dt->tris[t];
+    int64_t neighbors[3];
+    for (int k = 0; k < 3; k++) {
+      neighbors[k] = tri->n[k] < 0 ? -1 : map[tri->n[k]];
+    }
+    Mesh_push(msh, dt->src[tri->v[0]], dt->src[tri->v[1]], dt->src[tri->v[2]], neighbors);
+  }
+  free(map);
+  return true;
+}
+
+// without constraints the convex hull bounds the domain
+static void dt_fix_hull(Triangulation* dt) {
+  for (size_t t = 0; t < dt->n_tris; t++) {
+    Tri* tri = &dt->tris[t];
+    tri->inside = !is_super(tri->v[0]) && !is_super(tri->v[1]) && !is_super(tri->v[2]);
+  }
+  for (size_t t = 0; t < dt->n_tris; t++) {
+    Tri* tri = &dt->tris[t];
+    for (int k = 0; k < 3 && tri->inside; k++) {
+      const int32_t nb = tri->n[k];
+      if (nb >= 0 && dt->tris[nb].inside) continue;
+      tri->fixed |= 1 << k;
+      if (nb >= 0) dt->tris[nb].fixed |= 1 << dt_neighbor_index(dt, nb, t);
+    }
+  }
+}
+
+/****************************************************
+ * Quality refinement (Ruppert, with the concentric
+ * shells of Shewchuk's Triangle). Encroached constraints
+ * are split first, then the worst cell gets a vertex at
+ * its circumcenter, unless that encroaches a constraint,
+ * which is split instead. New points are appended to a
+ * PList, MeshQuality.max_points bounds work and memory.
+ */
+
+// cells with a shorter edge (relative to the input extent) are left alone
+#define REFINE_MIN_EDGE 1e-5
+// marks triangles of the current cavity in Tri.fixed
+#define VISITED 0x80
+
+// cell violating the quality bounds, v tells if it is still the same cell
+typedef struct {
+  double prio; // > 1 is bad, larger is worse
+  int32_t t;
+  uint32_t v[3];
+} BadTri;
+
+typedef struct {
+  Triangulation* dt;
+  const MeshQuality* quality;
+  PList* steiner;
+  size_t n_input;   // vertices below are super vertices or input points
+  double ratio2;    // bound for (circumradius / shortest edge)^2, 0 for none
+  double min_edge2;
+
+  BadTri* heap;     // max heap on prio
+  size_t n_heap;
+  size_t cap_heap;
+
+  EdgeQueue segs;   // constraints encroached by a vertex
+  EdgeQueue hits;   // constraints encroached by the current circumcenter
+  int32_t* cavity;
+  size_t n_cavity;
+  size_t cap_cavity;
+} Refiner;
+
+// without memory the cell is left as it is and dt->oom is set
+static void rf_heap_push(Refiner* rf, BadTri bad) {
+  if (rf->n_heap == rf->cap_heap) {
+    BadTri* heap = realloc(rf->heap, sizeof(BadTri) * 2 * rf->cap_heap);
+    if (heap == NULL) {
+      rf->dt->oom = true;
+      return;
+    }
+    rf->heap = heap;
+    rf->cap_heap *= 2;
+  }
+  size_t idx = rf->n_heap++;
+  while (idx > 0 && rf->heap[(idx - 1) / 2].prio < bad.prio) {
+    rf->heap[idx] = rf->heap[(idx - 1) / 2];
+    idx = (idx - 1) / 2;
+  }
+  rf->heap[idx] = bad;
+}
+
+static BadTri rf_heap_pop(Refiner* rf) {
+  const BadTri top = rf->heap[0];
+  const BadTri last = rf->heap[--rf->n_heap];
+  size_t idx = 0;
+  for (;;) {
+    size_t child = 2 * idx + 1;
+    if (child >= rf->n_heap) break;
+    if (child + 1 < rf->n_heap && rf->heap[child + 1].prio > rf->heap[child].prio) child++;
+    if (rf->heap[child].prio <= last.prio) break;
+    rf->heap[idx] = rf->heap[child];
+    idx = child;
+  }
+  if (rf->n_heap > 0) rf->heap[idx] = last;
+  return top;
+}
+
+static inline double dist2(V2 a, V2 b) {
+  const double dx = (double)b.x - a.x, dy = (double)b.y - a.y;
+  return dx * dx + dy * dy;
+}
+
+// p is inside of the diametral circle of a-b
+static inline bool encroaches(V2 a, V2 b, V2 p) {
+  return ((double)a.x - p.x) * ((double)b.x - p.x) + ((double)a.y - p.y) * ((double)b.y - p.y) < 0;
+}
+
+/*
+ * Constraints are split in their middle, unless exactly one end is an input
+ * point. Then the split is at a power of two distance from it, so the splits
+ * of constraints meeting at a small angle line up on concentric circles
+ * instead of chasing each other. False if the constraint is too short.
+ */
+static bool rf_split_point(const Refiner* rf, uint32_t a, uint32_t b, V2* m) {
+  const V2 pa = rf->dt->pts[a], pb = rf->dt->pts[b];
+  if ((a < rf->n_input) == (b < rf->n_input)) {
+    *m = v2(((double)pa.x + pb.x) / 2, ((double)pa.y + pb.y) / 2);
+  } else {
+    const V2 from = a < rf->n_input ? pa : pb, to = a < rf->n_input ? pb : pa;
+    const double len = sqrt(dist2(from, to));
+    const double s = exp2(round(log2(len / 2))) / len;
+    *m = v2(from.x + s * ((double)to.x - from.x), from.y + s * ((double)to.y - from.y));
+  }
+  return !v2_eq(*m, pa) && !v2_eq(*m, pb);
+}
+
+// how much the cell violates the bounds, > 1 if it is bad
+static double rf_priority(const Refiner* rf, const Tri* tri) {
+  const V2 a = rf->dt->pts[tri->v[0]], b = rf->dt->pts[tri->v[1]], c = rf->dt->pts[tri->v[2]];
+  const double la = dist2(b, c), lb = dist2(c, a), lc = dist2(a, b);
+  const double l_min = la < lb ? (la < lc ? la : lc) : (lb < lc ? lb : lc);
+  const double l_max = la > lb ? (la > lc ? la : lc) : (lb > lc ? lb : lc);
+  if (l_min < rf->min_edge2) return 0;
+
+  double prio = 0;
+  const double area2 = orient2d(a, b, c);
+  if (rf->ratio2 > 0 && area2 > 0) {
+    const double r2 = la * lb * lc / (4 * area2 * area2);
+    prio = r2 / l_min / rf->ratio2;
+  }
+  const MeshQuality* q = rf->quality;
+  const V2 centroid = v2(((double)a.x + b.x + c.x) / 3, ((double)a.y + b.y + c.y) / 3);
+  const float h = q->size != NULL ? q->size(centroid, q->size_user) : q->max_size;
+  if (h > 0 && l_max / ((double)h * h) > prio) {
+    prio = l_max / ((double)h * h);
+  }
+  return prio;
+}
+
+// queue the cell if it is bad and its constraints if its apex encroaches them
+static void rf_check_tri(Refiner* rf, int32_t t) {
+  const Tri* tri = &rf->dt->tris[t];
+  if (!tri->inside) return;
+  const V2* pts = rf->dt->pts;
+  for (int k = 0; k < 3; k++) {
+    const uint32_t a = tri->v[NEXT(k)], b = tri->v[PREV(k)];
+    V2 m;
+    if (FIXED(tri, k) && encroaches(pts[a], pts[b], pts[tri->v[k]]) && rf_split_point(rf, a, b, &m)
+        && !eq_push(&rf->segs, a, b)) {
+      rf->dt->oom = true;
+    }
+  }
+  const double prio = rf_priority(rf, tri);
+  if (prio > 1) {
+    rf_heap_push(rf, (BadTri) {
+      .prio = prio, .t = t, .v = {tri->v[0], tri->v[1], tri->v[2]},
+    });
+  }
+}
+
+// check all cells around the new vertex p
+static void rf_check_fan(Refiner* rf, uint32_t p) {
+  const int32_t start = rf->dt->vt[p];
+  int32_t t = start;
+  do {
+    rf_check_tri(rf, t);
+    t = rf->dt->tris[t].n[PREV(dt_vertex_index(rf->dt, t, p))];
+  } while (t >= 0 && t != start);
+}
+
+// grow the arrays of the vertices, each keeps its items if that fails
+static bool dt_grow_verts(Triangulation* dt) {
+  const size_t cap = 2 * dt->cap_verts;
+  V2* pts = realloc(dt->pts, sizeof(V2) * cap);
+  if (pts != NULL) dt->pts = pts;
+  V2** src = realloc(dt->src, sizeof(V2*) * cap);
+  if (src != NULL) dt->src = src;
+  uint32_t* alias = realloc(dt->alias, sizeof(uint32_t) * cap);
+  if (alias != NULL) dt->alias = alias;
+  int32_t* vt = realloc(dt->vt, sizeof(int32_t) * cap);
+  if (vt != NULL) dt->vt = vt;
+  if (pts == NULL || src == NULL || alias == NULL || vt == NULL) {
+    dt->oom = true;
+    return false;
+  }
+  dt->cap_verts = cap;
+  return true;
+}
+
+// new vertex at pt, -1 if the point limit is reached or there is no memory
+static int64_t rf_add_vertex(Refiner* rf, V2 pt) {
+  Triangulation* dt = rf->dt;
+  if (rf->quality->max_points > 0 && rf->steiner->count >= rf->quality->max_points) return -1;
+  if (dt->n_verts == dt->cap_verts && !dt_grow_verts(dt)) return -1;
+  if (!PList_push(rf->steiner, P_COORDS(pt))) {
+    log_wrn("Could not allocate more than %ld new points", rf->steiner->count);
+    return -1;
+  }
+  const uint32_t v = dt->n_verts++;
+  dt->pts[v] = pt;
+  // steiner moves while it grows, src is set once refinement is done
+  dt->src[v] = NULL;
+  dt->alias[v] = v;
+  return v;
+}
+
+// split the constraint a-b if it still exists and is encroached (or force is set)
+// false if the point limit is reached
+static bool rf_split_segment(Refiner* rf, uint32_t a, uint32_t b, bool force) {
+  Triangulation* dt = rf->dt;
+  int i;
+  const int32_t t = dt_find_edge(dt, a, b, &i);
+  if (t < 0 || !FIXED(&dt->tris[t], i)) return true;
+
+  if (!force) {
+    const int32_t o = dt->tris[t].n[i];
+    bool encroached = dt->tris[t].inside
+      && encroaches(dt->pts[a], dt->pts[b], dt->pts[dt->tris[t].v[i]]);
+    if (o >= 0 && dt->tris[o].inside) {
+      const uint32_t apex = dt->tris[o].v[dt_neighbor_index(dt, o, t)];
+      encroached = encroached || encroaches(dt->pts[a], dt->pts[b], dt->pts[apex]);
+    }
+    if (!encroached) return true;
+  }
+
+  V2 m;
+  if (!rf_split_point(rf, a, b, &m)) return true;
+  const int64_t v = rf_add_vertex(rf, m);
+  if (v < 0 || !dt_insert_edge(dt, t, i, v)) return false;
+  dt_legalize(dt);
+  rf_check_fan(rf, v);
+  return true;
+}
+
+// without memory t is left out and dt->oom is set
+static void rf_push_cavity(Refiner* rf, int32_t t) {
+  if (rf->n_cavity == rf->cap_cavity) {
+    int32_t* cavity = realloc(rf->cavity, sizeof(int32_t) * 2 * rf->cap_cavity);
+    if (cavity == NULL) {
+      rf->dt->oom = true;
+      return;
+    }
+    rf->cavity = cavity;
+    rf->cap_cavity *= 2;
+  }
+  rf->dt->tris[t].fixed |= VISITED;
+  rf->cavity[rf->n_cavity++] = t;
+}
+
+/*
+ * Collect the cells reachable from t without crossing a constraint whose
+ * circumcircle holds p, those are replaced when p is inserted. The
+ * constraints on them that p encroaches are queued in rf->hits.
+ */
+static void rf_cavity(Refiner* rf, int32_t t, V2 p) {
+  Triangulation* dt = rf->dt;
+  eq_clear(&rf->hits);
+  rf->n_cavity = 0;
+  rf_push_cavity(rf, t);
+  for (size_t c = 0; c < rf->n_cavity; c++) {
+    const Tri* tri = &dt->tris[rf->cavity[c]];
+    for (int k = 0; k < 3; k++) {
+      const uint32_t a = tri->v[NEXT(k)], b = tri->v[PREV(k)];
+      if (FIXED(tri, k)) {
+        V2 m;
+        if (encroaches(dt->pts[a], dt->pts[b], p) && rf_split_point(rf, a, b, &m)
+            && !eq_push(&rf->hits, a, b)) {
+          dt->oom = true;
+        }
+        continue;
+      }
+      const int32_t nb = tri->n[k];
+      if (nb < 0 || (dt->tris[nb].fixed & VISITED) || !dt->tris[nb].inside) continue;
+      const Tri* other = &dt->tris[nb];
+      if (incircle(dt->pts[other->v[0]], dt->pts[other->v[1]], dt->pts[other->v[2]], p) > 0) {
+        rf_push_cavity(rf, nb);
+      }
+    }
+  }
+}
+
+static bool rf_in_cavity(const Refiner* rf, int32_t t) {
+  return rf->dt->tris[t].fixed & VISITED;
+}
+
+static void rf_clear_cavity(Refiner* rf) {
+  for (size_t c = 0; c < rf->n_cavity; c++) {
+    rf->dt->tris[rf->cavity[c]].fixed &= ~VISITED;
+  }
+}
+
+// insert the circumcenter of a bad cell, false if the point limit is reached
+// or there is no memory
+static bool rf_split_tri(Refiner* rf, BadTri bad) {
+  Triangulation* dt = rf->dt;
+  const Tri* tri = &dt->tris[bad.t];
+  if (tri->v[0] != bad.v[0] || tri->v[1] != bad.v[1] || tri->v[2] != bad.v[2]) return true;
+
+  const V2 a = dt->pts[tri->v[0]], b = dt->pts[tri->v[1]], c = dt->pts[tri->v[2]];
+  const double bx = (double)b.x - a.x, by = (double)b.y - a.y;
+  const double cx = (double)c.x - a.x, cy = (double)c.y - a.y;
+  const double d = 2 * (bx * cy - by * cx);
+  if (d <= 0) return true;
+  const double lb = bx * bx + by * by, lc = cx * cx + cy * cy;
+  const V2 center = v2(a.x + (cy * lb - by * lc) / d, a.y + (bx * lc - cx * lb) / d);
+
+  rf_cavity(rf, bad.t, center);
+  if (dt->oom) {
+    rf_clear_cavity(rf);
+    return false;
+  }
+  if (rf->hits.count > 0) {
+    // split what the circumcenter encroaches and try the cell again
+    rf_clear_cavity(rf);
+    const size_t n_steiner = rf->steiner->count;
+    while (rf->hits.count > 0) {
+      const VEdge e = eq_pop(&rf->hits);
+      if (!rf_split_segment(rf, e.a, e.b, true)) return false;
+    }
+    if (rf->steiner->count > n_steiner) rf_check_tri(rf, bad.t);
+    return true;
+  }
+
+  if (center.x < dt->min.x || center.y < dt->min.y || center.x > dt->max.x || center.y > dt->max.y) {
+    rf_clear_cavity(rf);
+    return true;
+  }
+  Location loc;
+  int idx = 0;
+  dt->last = bad.t;
+  const int32_t t = dt_locate(dt, center, &loc, &idx);
+  // behind a constraint or on a vertex, rounding got in the way
+  const bool usable = rf_in_cavity(rf, t) && loc != LOC_VERTEX;
+  rf_clear_cavity(rf);
+  if (!usable) return true;
+
+  const int64_t v = rf_add_vertex(rf, center);
+  // not on a vertex, so only a lack of memory stops the insert
+  if (v < 0 || !dt_insert_located(dt, v, t, loc, idx)) return false;
+  rf_check_fan(rf, v);
+  return true;
+}
+
+// false if the point limit was reached before the bounds were met or there is
+// no memory (dt->oom)
+static bool dt_refine(Triangulation* dt, const MeshQuality* quality, PList* steiner) {
+  const double extent = sqrt(dist2(dt->min, dt->max));
+  const double sin_min = sin(quality->min_angle * M_PI / 180);
+  Refiner rf = {
+    .dt = dt,
+    .quality = quality,
+    .steiner = steiner,
+    .n_input = dt->n_verts,
+    .ratio2 = quality->min_angle > 0 ? 1 / (4 * sin_min * sin_min) : 0,
+    .min_edge2 = extent * REFINE_MIN_EDGE * extent * REFINE_MIN_EDGE,
+    .heap = malloc(sizeof(BadTri) * 64),
+    .cap_heap = 64,
+    .segs = { .edges = malloc(sizeof(VEdge) * 16), .cap = 16 },
+    .hits = { .edges = malloc(sizeof(VEdge) * 16), .cap = 16 },
+    .cavity = malloc(sizeof(int32_t) * 64),
+    .cap_cavity = 64,
+  };
+  dt->oom |= rf.heap == NULL || rf.segs.edges == NULL || rf.hits.edges == NULL || rf.cavity == NULL;
+
+  for (size_t t = 0; t < dt->n_tris && !dt->oom; t++) {
+    rf_check_tri(&rf, t);
+  }
+
+  bool met = true;
+  while (met && !dt->oom) {
+    if (rf.segs.count > 0) {
+      const VEdge e = eq_pop(&rf.segs);
+      met = rf_split_segment(&rf, e.a, e.b, false);
+    } else if (rf.n_heap > 0) {
+      met = rf_split_tri(&rf, rf_heap_pop(&rf));
+    } else {
+      break;
+    }
+  }
+  met = met && !dt->oom;
+  if (!met && !dt->oom) {
+    log_wrn("Refinement stopped after %ld new points, quality bounds are not met", steiner->count);
+  }
+
+  for (size_t v = rf.n_input; v < dt->n_verts; v++) {
+    dt->src[v] = &steiner->points[v - rf.n_input];
+  }
+
+  free(rf.heap);
+  free(rf.segs.edges);
+  free(rf.hits.edges);
+  free(rf.cavity);
+  return met;
+}
+
+float mesh_size_qtree(V2 point, void* tree) {
+  const Node* cell = qtree_locate(&((QTree*)tree)->root, point);
+  return cell->w < cell->h ? cell->w : cell->h;
+}
+
+// number of points in all lists, 0 if they are too few to triangulate
+static size_t count_points(size_t n_lists, const PList* lists[]) {
+  size_t n = 0;
+  for (size_t l = 0; l < n_lists; l++) {
+    n += lists[l]->count;
+  }
+  if (n < 3) {
+    log_wrn("Need at least 3 points to triangulate, got %ld", n);
+    return 0;
+  }
+  assert(n + N_SUPER < INT32_MAX / 2 && "too many points for 32 bit triangle indices");
+  return n;
+}
+
+bool mesh_triangulate(Mesh* msh, size_t n_lists, const PList* lists[]) {
+  INSTR_SCOPE("mesh_triangulate");
+  msh->count = 0;
+  const size_t n = count_points(n_lists, lists);
+  if (n == 0) return false;
+
+  Triangulation dt;
+  if (!dt_init(&dt, n_lists, lists, n)) {
+    log_wrn("Could not allocate the triangulation of %ld points", n);
+    return false;
+  }
+  dt_insert_all(&dt);
+  if (dt.oom) log_wrn("Ran out of memory while triangulating %ld points", n);
+  const bool ok = !dt.oom && dt_to_mesh(&dt, msh, false);
+  dt_free(&dt);
+  return ok;
+}
+
+bool mesh_triangulate_constrained(Mesh* msh, size_t n_lists, const PList* lists[],
+                                  const EList* constraints) {
+  INSTR_SCOPE("mesh_triangulate_constrained");
+  msh->count = 0;
+  const size_t n = count_points(n_lists, lists);
+  if (n == 0) return false;
+
+  Triangulation dt;
+  if (!dt_init(&dt, n_lists, lists, n)) {
+    log_wrn("Could not allocate the triangulation of %ld points", n);
+    return false;
+  }
+  dt_insert_all(&dt);
+  dt_insert_constraints(&dt, n_lists, lists, constraints);
+  dt_mark_inside(&dt);
+  if (dt.oom) log_wrn("Ran out of memory while triangulating %ld points", n);
+  const bool ok = !dt.oom && dt_to_mesh(&dt, msh, true);
+  dt_free(&dt);
+  return ok;
+}
+
+bool mesh_refine(Mesh* msh, size_t n_lists, const PList* lists[], const EList* constraints,
+                 const MeshQuality* quality, PList* steiner) {
+  INSTR_SCOPE("mesh_refine");
+  msh->count = 0;
+  steiner->count = 0;
+  const size_t n = count_points(n_lists, lists);
+  if (n == 0) return false;
+
+  Triangulation dt;
+  if (!dt_init(&dt, n_lists, lists, n)) {
+    log_wrn("Could not allocate the triangulation of %ld points", n);
+    return false;
+  }
+  dt_insert_all(&dt);
+  if (constraints != NULL) {
+    dt_insert_constraints(&dt, n_lists, lists, constraints);
+    dt_mark_inside(&dt);
+  } else {
+    dt_fix_hull(&dt);
+  }
+  const bool met = dt_refine(&dt, quality, steiner);
+  if (dt.oom) log_wrn("Ran out of memory while triangulating %ld points", n);
+  const bool ok = !dt.oom && dt_to_mesh(&dt, msh, true);
+  dt_free(&dt);
+  return ok && met;
+}
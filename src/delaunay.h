@@ -0,0 +1,55 @@
+#ifndef DELAUNAY_H
+#define DELAUNAY_H
+#include "datastructs.h"
+#include "mesh.h"
+
+/****************************************************
+ * Incremental Delaunay triangulation (Lawson flips).
+ * Points are inserted in morton order and located by
+ * walking from the previously inserted point.
+ *
+ * The points of each cell are counter clockwise in x/y
+ * and point into the PLists, neighbors[i] is the cell
+ * across the edge opposite of points[i] (-1 for none).
+ */
+
+// triangulate the points of n_lists PLists into msh, replacing its cells
+// duplicate points are ignored, false if there are less than 3 points
+bool mesh_triangulate(Mesh* msh, size_t n_lists, const PList* lists[]);
+
+// like mesh_triangulate, but every edge in constraints (pointing into the lists)
+// is an edge of the mesh and only cells inside of them are kept (even-odd rule,
+// so a closed loop inside of the outline is a hole). constraints crossing an
+// earlier one are skipped
+bool mesh_triangulate_constrained(Mesh* msh, size_t n_lists, const PList* lists[],
+                                  const EList* constraints);
+
+/****************************************************
+ * Quality refinement inserts points until every cell
+ * meets the bounds. Bounds that cannot be met (small
+ * angles between constraints, float precision) are
+ * left alone, the new points end up in a PList.
+ */
+
+// bound for the longest edge of the cells around point, <= 0 for none
+typedef float (MeshSize)(V2 point, void* user);
+
+typedef struct {
+  float min_angle;  // degrees, up to ~30 work well, 0 for no bound
+  float max_size;   // longest edge of any cell, <= 0 for no bound
+  MeshSize* size;   // replaces max_size if set
+  void* size_user;
+  size_t max_points; // new points at most, 0 for no limit
+} MeshQuality;
+
+// MeshSize of the cells of a QTree* around point, the mesh is as fine as the input points
+float mesh_size_qtree(V2 point, void* tree);
+
+// mesh_triangulate_constrained (or mesh_triangulate for NULL constraints) with
+// quality bounds, steiner is cleared and receives the new points, cells point into
+// the lists and steiner. false if max_points was reached before the bounds were met,
+// msh still holds the mesh refined so far
+bool mesh_refine(Mesh* msh, size_t n_lists, const PList* lists[], const EList* constraints,
+                 const MeshQuality* quality, PList* steiner);
+
+#endif // DELAUNAY_H
@@ -0,0 +1,334 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "stdbool.h"
+#include "time.h"
+#include "unistd.h"
+
+#include "datastructs.h"
+#include "qtree.h"
+#include "mesh.h"
+#include "delaunay.h"
+#include "predicates.h"
+#include "v2batch.h"
+#include "mesh_io.h"
+#include "point_stream.h"
+#include "logging.h"
+#include "instrument.h"
+
+/****************************************************
+ * Headless meshing: reads points from files, meshes
+ * them like the viewer does and writes the mesh,
+ * printing the time every stage took.
+ */
+
+#define MESH_MAX_POINTS (1024 * 1024) // points added by refinement at most
+#define MESH_MIN_ANGLE 25 // degrees
+#define QTREE_MARGIN 1.01f // root cell size in multiples of the input extent
+
+typedef struct {
+  const char* boundary;
+  const char* interior;
+  const char* output;
+  MeshFormat format; // MESH_FMT_NUM to go by the extension of output
+  bool stream; // only stream the points into a qtree
+  bool refine;
+  float min_angle;
+  float max_size; // <= 0 for the qtree size field
+  size_t threads;
+  const char* trace; // instrument and write a trace here
+} Options;
+
+typedef struct {
+  const char* name;
+  double ms;
+} Stage;
+
+#define MAX_STAGES 8
+static Stage stages[MAX_STAGES];
+static size_t n_stages = 0;
+
+static double now_ms(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e3 + t.tv_nsec * 1e-6;
+}
+
+static void stage_done(const char* name, double start) {
+  stages[n_stages++] = (Stage) {name, now_ms() - start};
+}
+
+static void usage(const char* prog) {
+  fprintf(stderr,
+          "usage: %s [-b boundary] [-i interior] [-o out] [-f format] [-r] [-a angle] [-s size] [-t threads] [-q] [-p trace]\n"
+          "  -b  closed outline, one 'x y' point per line, or the outline of a .gmb file\n"
+          "  -i  points inside of the outline, one 'x y' point per line, or the points of a .gmb file\n"
+          "  -o  write the mesh to out\n"
+          "  -f  text, vtk-ascii, vtk, vtu, stl or native (default from the extension of out)\n"
+          "  -r  refine to the point density of the input\n"
+          "  -a  minimum angle in degrees for -r (default %d)\n"
+          "  -s  longest edge for -r instead of the point density\n"
+          "  -t  qtree build threads (default one per cpu)\n"
+          "  -q  only stream the points into a qtree, memory is bounded by the tree\n"
+          "  -p  time the stages and count qtree and predicate work, write a chrome trace to trace\n"
+          "input files with the extension .bin, .f32 or .raw hold raw pairs of floats\n",
+          prog, MESH_MIN_ANGLE);
+}
+
+// append the points of a text or raw file to list
+static bool read_points(const char* path, PList* list) {
+  PointStream stream;
+  if (!PointStream_open(&stream, path, point_format_from_path(path))) return false;
+  PointStream_read(&stream, list, 0);
+  const bool ok = stream.ok;
+  PointStream_close(&stream);
+  return ok;
+}
+
+// outline or interior points of a native file, list views the mapping of file
+static bool map_points(const char* path, bool outline, PList* list, MeshFile* file) {
+  if (!MeshFile_map(file, path, false)) return false;
+  PList_free(list);
+  *list = outline ? file->outline : file->points;
+  return true;
+}
+
+static bool load_points(const char* path, bool outline, PList* list, MeshFile* file) {
+  return mesh_format_from_path(path) == MESH_FMT_NATIVE
+    ? map_points(path, outline, list, file)
+    : read_points(path, list);
+}
+
+// native files also hold the input points and a linear qtree of them
+static bool write_native(const char* path, const PList* outline, const PList* points,
+                         const QTree* qtree, const IMesh* msh) {
+  LQTree lqtree = lqtree_new(qtree->root.pos, qtree->root.w, qtree->root.h,
+                             outline->count + points->count);
+  lqtree_insert_batch(&lqtree, outline->points, outline->count);
+  lqtree_insert_batch(&lqtree, points->points, points->count);
+  const bool ok = MeshFile_write(path, outline, points, &lqtree, msh, true);
+  lqtree_free(&lqtree);
+  return ok;
+}
+
+static void bounds_merge(V2* min, V2* max, bool* any, V2 lmin, V2 lmax) {
+  *min = *any ? v2(lmin.x < min->x ? lmin.x : min->x, lmin.y < min->y ? lmin.y : min->y) : lmin;
+  *max = *any ? v2(lmax.x > max->x ? lmax.x : max->x, lmax.y > max->y ? lmax.y : max->y) : lmax;
+  *any = true;
+}
+
+// square root cell around the box from min to max
+static QTree qtree_square(V2 min, V2 max) {
+  float size = max.x - min.x > max.y - min.y ? max.x - min.x : max.y - min.y;
+  size = size > 0 ? size * QTREE_MARGIN : 1;
+  return qtree_new(v2((min.x + max.x) / 2, (min.y + max.y) / 2), size, size);
+}
+
+// square root cell around the points of all lists
+static QTree qtree_around(size_t n_lists, const PList* lists[]) {
+  V2 min = v2(0, 0), max = v2(0, 0);
+  bool any = false;
+  for (size_t i = 0; i < n_lists; i++) {
+    V2 lmin, lmax;
+    if (v2_bounds(lists[i]->points, lists[i]->count, &lmin, &lmax)) {
+      bounds_merge(&min, &max, &any, lmin, lmax);
+    }
+  }
+  return qtree_square(min, max);
+}
+
+static void print_stages(double start) {
+  for (size_t i = 0; i < n_stages; i++) {
+    printf("%-11s %10.3f ms\n", stages[i].name, stages[i].ms);
+  }
+  printf("%-11s %10.3f ms\n", "total", now_ms() - start);
+}
+
+// -p: the summary after the stages, the trace for chrome://tracing or ui.perfetto.dev
+static bool write_instrumentation(const char* trace) {
+  if (trace == NULL) return true;
+  instr_enable(false);
+  printf("\n");
+  instr_write_summary(stdout);
+  if (!instr_write_trace(trace)) {
+    log_err("Could not write the trace to %s", trace);
+    return false;
+  }
+  return true;
+}
+
+// -q: the points go from the files into the qtree one batch at a time,
+// without a list of all of them. The files are read twice, first for the root cell
+static bool stream_qtree(const Options* opts) {
+  const double start = now_ms();
+  const char* paths[] = {opts->boundary, opts->interior};
+  PointStream streams[2];
+  size_t n_streams = 0;
+  V2 min = v2(0, 0), max = v2(0, 0);
+  bool any = false;
+  bool ok = true;
+
+  double t = now_ms();
+  for (size_t i = 0; i < 2 && ok; i++) {
+    if (paths[i] == NULL) continue;
+    ok = PointStream_open(&streams[n_streams], paths[i], point_format_from_path(paths[i]));
+    if (!ok) break;
+    PointStream* stream = &streams[n_streams++];
+    V2 smin, smax;
+    if (PointStream_bounds(stream, &smin, &smax)) bounds_merge(&min, &max, &any, smin, smax);
+    ok = stream->ok;
+  }
+  stage_done("bounds", t);
+
+  QTree qtree = qtree_square(min, max);
+  size_t n_points = 0, n_bytes = 0, inserted = 0;
+  t = now_ms();
+  for (size_t i = 0; i < n_streams && ok; i++) {
+    inserted += PointStream_insert(&streams[i], &qtree, POINT_STREAM_BATCH);
+    ok = streams[i].ok;
+    n_points += streams[i].points;
+    n_bytes += streams[i].bytes;
+  }
+  const double ms = now_ms() - t;
+  stage_done("stream", t);
+
+  printf("points      %ld (%ld in the qtree)\n", n_points, inserted);
+  printf("leaves      %ld\n", qtree_count_leaves(&qtree.root));
+  printf("throughput  %.0f points/s, %.1f MB/s\n",
+         n_points / (ms * 1e-3), n_bytes / (ms * 1e3));
+  print_stages(start);
+
+  for (size_t i = 0; i < n_streams; i++) {
+    PointStream_close(&streams[i]);
+  }
+  qtree_free(&qtree);
+  return ok;
+}
+
+static bool parse_options(int argc, char** argv, Options* opts) {
+  *opts = (Options) {.format = MESH_FMT_NUM, .min_angle = MESH_MIN_ANGLE};
+  int c;
+  while ((c = getopt(argc, argv, "b:i:o:f:ra:s:t:qp:h")) != -1) {
+    switch (c) {
+      case 'b': opts->boundary = optarg; break;
+      case 'i': opts->interior = optarg; break;
+      case 'o': opts->output = optarg; break;
+      case 'f':
+        opts->format = mesh_format_from_cstr(optarg);
+        if (opts->format == MESH_FMT_NUM) return false;
+        break;
+      case 'r': opts->refine = true; break;
+      case 'a': opts->min_angle = strtof(optarg, NULL); opts->refine = true; break;
+      case 's': opts->max_size = strtof(optarg, NULL); opts->refine = true; break;
+      case 't': opts->threads = strtoul(optarg, NULL, 10); break;
+      case 'q': opts->stream = true; break;
+      case 'p': opts->trace = optarg; break;
+      default: return false;
+    }
+  }
+  return optind == argc && (opts->boundary != NULL || opts->interior != NULL)
+    && !(opts->stream && (opts->output != NULL || opts->refine));
+}
+
+int main(int argc, char** argv) {
+  Options opts;
+  if (!parse_options(argc, argv, &opts)) {
+    usage(argv[0]);
+    return 2;
+  }
+  // written at exit at the latest, no message is lost
+  log_async_start(NULL, LOG_BLOCK);
+  if (opts.trace != NULL) instr_enable(true);
+  if (opts.stream) {
+    const bool streamed = stream_qtree(&opts);
+    return write_instrumentation(opts.trace) && streamed ? 0 : 1;
+  }
+
+  PList outline = PList_new(0);
+  PList points = PList_new(0);
+  PList steiner = PList_new(0);
+  EList edges = EList_new(0);
+  Mesh mesh = Mesh_new(0);
+  IMesh imesh = IMesh_new(0, 0);
+  MeshFile files[2] = {0}; // mapped inputs
+  const PList* lists[] = {&outline, &points};
+  const double start = now_ms();
+  bool ok = true;
+
+  double t = now_ms();
+  ok = (opts.boundary == NULL || load_points(opts.boundary, true, &outline, &files[0]))
+    && (opts.interior == NULL || load_points(opts.interior, false, &points, &files[1]));
+  const double read_ms = now_ms() - t;
+  stage_done("read", t);
+
+  QTree qtree = qtree_around(2, lists);
+  if (ok) {
+    t = now_ms();
+    qtree_build_parallel(&qtree, 2, lists, opts.threads);
+    stage_done("qtree", t);
+
+    // only mesh inside of the outline once it is a polygon
+    if (outline.count >= 3) {
+      for (size_t i = 0; i < outline.count; i++) {
+        EList_push(&edges, &outline.points[i], &outline.points[(i + 1) % outline.count]);
+      }
+    }
+    const EList* constraints = outline.count >= 3 ? &edges : NULL;
+
+    t = now_ms();
+    ok = constraints != NULL
+      ? mesh_triangulate_constrained(&mesh, 2, lists, constraints)
+      : mesh_triangulate(&mesh, 2, lists);
+    stage_done("triangulate", t);
+  }
+
+  if (ok && opts.refine) {
+    const MeshQuality quality = {
+      .min_angle = opts.min_angle,
+      .max_size = opts.max_size,
+      .size = opts.max_size > 0 ? NULL : mesh_size_qtree,
+      .size_user = &qtree,
+      .max_points = MESH_MAX_POINTS,
+    };
+    t = now_ms();
+    // meeting the bounds is not required, the mesh refined so far is kept
+    mesh_refine(&mesh, 2, lists, outline.count >= 3 ? &edges : NULL, &quality, &steiner);
+    stage_done("refine", t);
+  }
+
+  if (ok && opts.output != NULL) {
+    t = now_ms();
+    ok = IMesh_from_mesh(&imesh, &mesh);
+    stage_done("index", t);
+  }
+  if (ok && opts.output != NULL) {
+    t = now_ms();
+    const MeshFormat format = opts.format == MESH_FMT_NUM
+      ? mesh_format_from_path(opts.output)
+      : opts.format;
+    ok = format == MESH_FMT_NATIVE
+      ? write_native(opts.output, &outline, &points, &qtree, &imesh)
+      : IMesh_write(&imesh, opts.output, format);
+    stage_done("write", t);
+  }
+
+  const PredicateStats st = predicate_stats();
+  printf("points      %ld (%ld boundary, %ld new)\n",
+         outline.count + points.count + steiner.count, outline.count, steiner.count);
+  printf("cells       %ld\n", mesh.count);
+  printf("exact       %lu orient2d, %lu incircle\n", st.orient2d_exact, st.incircle_exact);
+  printf("input       %.0f points/s\n", (outline.count + points.count) / (read_ms * 1e-3));
+  print_stages(start);
+  ok = write_instrumentation(opts.trace) && ok;
+
+  IMesh_free(&imesh);
+  Mesh_free(&mesh);
+  EList_free(&edges);
+  PList_free(&steiner);
+  PList_free(&points);
+  PList_free(&outline);
+  MeshFile_unmap(&files[0]);
+  MeshFile_unmap(&files[1]);
+  qtree_free(&qtree);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,271 @@
+#include "stdlib.h"
+#include "string.h"
+#include "pthread.h"
+
+#include "instrument.h"
+
+#define INSTR_FIRST_EVENTS 1024
+
+typedef struct {
+  const char* name;
+  uint64_t start; // ns since the epoch
+  uint64_t dur;
+} InstrEvent;
+
+typedef struct {
+  const char* name; // NULL for free slots
+  InstrScopeStats stats;
+} InstrScopeSlot;
+
+typedef struct InstrThread {
+  uint64_t counters[CTR_NUM];
+  InstrScopeSlot scopes[INSTR_MAX_SCOPES];
+  size_t scopes_lost; // calls of names that did not fit
+  InstrEvent* events;
+  size_t n_events;
+  size_t cap;
+  size_t events_lost;
+  unsigned tid;
+  atomic_bool retired; // the thread has exited
+  struct InstrThread* next;
+} InstrThread;
+
+atomic_bool instr_on;
+_Thread_local uint64_t* instr_counters;
+
+static _Thread_local InstrThread* thread_data;
+static _Atomic(InstrThread*) threads;
+static atomic_uint n_threads;
+static _Atomic uint64_t epoch; // read by every thread that ends a scope
+static pthread_key_t thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+
+const char* instr_counter_to_cstr(InstrCounter ctr) {
+  switch (ctr) {
+    case CTR_NODES:
+      return "nodes";
+    case CTR_SPLITS:
+      return "splits";
+    case CTR_MAX_DEPTH:
+      return "max_depth";
+    case CTR_NN_VISITED:
+      return "nn_visited";
+    case CTR_ORIENT2D_EXACT:
+      return "orient2d_exact";
+    case CTR_INCIRCLE_EXACT:
+      return "incircle_exact";
+    case CTR_NUM:
+      return "NUM OF COUNTERS";
+  }
+  return NULL;
+}
+
+static void thread_retire(void* data) {
+  atomic_store(&((InstrThread*)data)->retired, true);
+}
+
+static void thread_key_create(void) {
+  pthread_key_create(&thread_key, thread_retire);
+}
+
+static InstrThread* thread_get(void) {
+  if (thread_data != NULL) return thread_data;
+  pthread_once(&thread_key_once, thread_key_create);
+  InstrThread* t = calloc(1, sizeof(InstrThread));
+  if (t == NULL) return NULL;
+  t->tid = atomic_fetch_add(&n_threads, 1);
+  t->next = atomic_load(&threads);
+  while (!atomic_compare_exchange_weak(&threads, &t->next, t)) {}
+  pthread_setspecific(thread_key, t);
+  instr_counters = t->counters;
+  return thread_data = t;
+}
+
+uint64_t* _instr_thread_counters(void) {
+  InstrThread* t = thread_get();
+  return t != NULL ? t->counters : NULL;
+}
+
+void instr_enable(bool on) {
+  if (on && atomic_load_explicit(&epoch, memory_order_relaxed) == 0) {
+    atomic_store_explicit(&epoch, instr_now(), memory_order_relaxed);
+  }
+  atomic_store(&instr_on, on);
+}
+
+void instr_reset(void) {
+  InstrThread* prev = NULL;
+  InstrThread* t = atomic_load(&threads);
+  while (t != NULL) {
+    InstrThread* next = t->next;
+    // the data of exited threads goes, only this thread may push new ones
+    InstrThread* expected = t;
+    if (atomic_load(&t->retired)
+        && (prev != NULL ? (prev->next = next, true)
+                         : atomic_compare_exchange_strong(&threads, &expected, next))) {
+      free(t->events);
+      free(t);
+      t = next;
+      continue;
+    }
+    memset(t->counters, 0, sizeof(t->counters));
+    memset(t->scopes, 0, sizeof(t->scopes));
+    t->scopes_lost = t->n_events = t->events_lost = 0;
+    prev = t;
+    t = next;
+  }
+  atomic_store_explicit(&epoch, instr_now(), memory_order_relaxed);
+}
+
+/****************************************************
+ * Scopes
+ */
+static InstrScopeSlot* scope_slot(InstrThread* t, const char* name) {
+  // names are literals, so the pointer is the key
+  size_t i = ((uintptr_t)name >> 3) % INSTR_MAX_SCOPES;
+  for (size_t probe = 0; probe < INSTR_MAX_SCOPES; probe++, i = (i + 1) % INSTR_MAX_SCOPES) {
+    InstrScopeSlot* slot = &t->scopes[i];
+    if (slot->name == name) return slot;
+    if (slot->name == NULL) {
+      slot->name = name;
+      slot->stats.min = UINT64_MAX;
+      return slot;
+    }
+  }
+  return NULL;
+}
+
+static void push_event(InstrThread* t, const char* name, uint64_t start, uint64_t dur) {
+  if (t->n_events == t->cap) {
+    const size_t cap = t->cap == 0 ? INSTR_FIRST_EVENTS : 2 * t->cap;
+    InstrEvent* events = cap <= INSTR_MAX_EVENTS ? realloc(t->events, sizeof(InstrEvent) * cap) : NULL;
+    if (events == NULL) {
+      t->events_lost++;
+      return;
+    }
+    t->events = events;
+    t->cap = cap;
+  }
+  t->events[t->n_events++] = (InstrEvent) {name, start, dur};
+}
+
+void instr_scope_end(InstrScope* scope) {
+  if (scope->start == 0) return;
+  const uint64_t end = instr_now();
+  InstrThread* t = thread_get();
+  if (t == NULL) return;
+
+  const uint64_t dur = end - scope->start;
+  InstrScopeSlot* slot = scope_slot(t, scope->name);
+  if (slot != NULL) {
+    InstrScopeStats* st = &slot->stats;
+    st->calls++;
+    st->total += dur;
+    st->min = dur < st->min ? dur : st->min;
+    st->max = dur > st->max ? dur : st->max;
+  } else {
+    t->scopes_lost++;
+  }
+  // scopes begun before instr_reset are not in the trace
+  const uint64_t since = atomic_load_explicit(&epoch, memory_order_relaxed);
+  if (scope->start >= since) push_event(t, scope->name, scope->start - since, dur);
+}
+
+/****************************************************
+ * Reading
+ */
+uint64_t instr_counter(InstrCounter ctr) {
+  uint64_t value = 0;
+  for (InstrThread* t = atomic_load(&threads); t != NULL; t = t->next) {
+    if (ctr == CTR_MAX_DEPTH) {
+      value = t->counters[ctr] > value ? t->counters[ctr] : value;
+    } else {
+      value += t->counters[ctr];
+    }
+  }
+  return value;
+}
+
+static void stats_merge(InstrScopeStats* dst, const InstrScopeStats* src) {
+  dst->calls += src->calls;
+  dst->total += src->total;
+  dst->min = src->min < dst->min ? src->min : dst->min;
+  dst->max = src->max > dst->max ? src->max : dst->max;
+}
+
+bool instr_scope_stats(const char* name, InstrScopeStats* stats) {
+  *stats = (InstrScopeStats) {.min = UINT64_MAX};
+  for (InstrThread* t = atomic_load(&threads); t != NULL; t = t->next) {
+    for (size_t i = 0; i < INSTR_MAX_SCOPES; i++) {
+      const InstrScopeSlot* slot = &t->scopes[i];
+      // the same literal may have another address in another file
+      if (slot->name != NULL && strcmp(slot->name, name) == 0) stats_merge(stats, &slot->stats);
+    }
+  }
+  return stats->calls > 0;
+}
+
+bool instr_write_trace(const char* path) {
+  FILE* f = fopen(path, "w");
+  if (f == NULL) return false;
+  fprintf(f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+  bool first = true;
+  for (InstrThread* t = atomic_load(&threads); t != NULL; t = t->next) {
+    fprintf(f, "%s  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, "
+            "\"args\": {\"name\": \"thread %u\"}}", first ? "" : ",\n", t->tid, t->tid);
+    first = false;
+    uint64_t last = 0;
+    for (size_t i = 0; i < t->n_events; i++) {
+      const InstrEvent* e = &t->events[i];
+      fprintf(f, ",\n  {\"name\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %u}",
+              e->name, e->start * 1e-3, e->dur * 1e-3, t->tid);
+      last = e->start + e->dur > last ? e->start + e->dur : last;
+    }
+    // the counters of the thread at its last event
+    fprintf(f, ",\n  {\"name\": \"counters\", \"ph\": \"C\", \"ts\": %.3f, \"pid\": 1, \"tid\": %u, \"args\": {",
+            last * 1e-3, t->tid);
+    for (int c = 0; c < CTR_NUM; c++) {
+      fprintf(f, "%s\"%s\": %lu", c > 0 ? ", " : "", instr_counter_to_cstr(c), t->counters[c]);
+    }
+    fprintf(f, "}}");
+  }
+  fprintf(f, "\n]}\n");
+  return fclose(f) == 0;
+}
+
+void instr_write_summary(FILE* f) {
+  // merge the scopes of all threads by name
+  InstrScopeSlot merged[INSTR_MAX_SCOPES] = {0};
+  size_t n_merged = 0;
+  size_t events = 0, events_lost = 0, scopes_lost = 0;
+  for (InstrThread* t = atomic_load(&threads); t != NULL; t = t->next) {
+    events += t->n_events;
+    events_lost += t->events_lost;
+    scopes_lost += t->scopes_lost;
+    for (size_t i = 0; i < INSTR_MAX_SCOPES; i++) {
+      const InstrScopeSlot* slot = &t->scopes[i];
+      if (slot->name == NULL) continue;
+      size_t m = 0;
+      while (m < n_merged && strcmp(merged[m].name, slot->name) != 0) m++;
+      if (m == n_merged) {
+        if (n_merged == INSTR_MAX_SCOPES) continue;
+        merged[n_merged++] = (InstrScopeSlot) {slot->name, {.min = UINT64_MAX}};
+      }
+      stats_merge(&merged[m].stats, &slot->stats);
+    }
+  }
+
+  fprintf(f, "%-24s %10s %12s %12s %12s %12s\n", "scope", "calls", "total ms", "mean us", "min us", "max us");
+  for (size_t m = 0; m < n_merged; m++) {
+    const InstrScopeStats* st = &merged[m].stats;
+    fprintf(f, "%-24s %10lu %12.3f %12.3f %12.3f %12.3f\n", merged[m].name, st->calls,
+            st->total * 1e-6, (double)st->total / st->calls * 1e-3, st->min * 1e-3, st->max * 1e-3);
+  }
+  for (int c = 0; c < CTR_NUM; c++) {
+    fprintf(f, "%-24s %10lu\n", instr_counter_to_cstr(c), instr_counter(c));
+  }
+  fprintf(f, "%zu events in the trace", events);
+  if (events_lost > 0) fprintf(f, ", %zu more did not fit", events_lost);
+  if (scopes_lost > 0) fprintf(f, ", %zu calls of scopes beyond %d names", scopes_lost, INSTR_MAX_SCOPES);
+  fprintf(f, "\n");
+}
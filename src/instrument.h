@@ -0,0 +1,115 @@
+#ifndef INSTRUMENT_H
+#define INSTRUMENT_H
+#include "stdio.h"
+#include "stdint.h"
+#include "stdbool.h"
+#include "stdatomic.h"
+#include "time.h"
+
+/****************************************************
+ * Instrumentation: scoped timers and counters, kept per
+ * thread and merged when they are read. Nothing is
+ * recorded until instr_enable, which leaves one relaxed
+ * load per use. Building with -DINSTRUMENT=0 (CMake
+ * option INSTRUMENT) compiles every use out.
+ *
+ * Reading, exporting and resetting expect the threads
+ * that recorded to be done (joined, or this thread).
+ */
+#ifndef INSTRUMENT
+#define INSTRUMENT 1
+#endif
+
+// events per thread kept for the trace, later ones only count in the summary
+#define INSTR_MAX_EVENTS (1 << 20)
+// distinct scope names per thread
+#define INSTR_MAX_SCOPES 64
+
+typedef enum {
+  CTR_NODES = 0,      // qtree nodes allocated
+  CTR_SPLITS,         // qtree nodes given children
+  CTR_MAX_DEPTH,      // deepest qtree leaf, merged by maximum
+  CTR_NN_VISITED,     // qtree nodes visited by nearest neighbour queries
+  CTR_ORIENT2D_EXACT, // exact paths of orient2d
+  CTR_INCIRCLE_EXACT, // exact paths of incircle
+  CTR_NUM
+} InstrCounter;
+
+const char* instr_counter_to_cstr(InstrCounter ctr);
+
+typedef struct {
+  uint64_t calls;
+  uint64_t total; // ns
+  uint64_t min;
+  uint64_t max;
+} InstrScopeStats;
+
+extern atomic_bool instr_on;
+// counters of the calling thread, NULL until it first counts
+extern _Thread_local uint64_t* instr_counters;
+
+void instr_enable(bool on);
+// forget everything recorded so far
+void instr_reset(void);
+// merged over all threads
+uint64_t instr_counter(InstrCounter ctr);
+// false if no scope of that name was recorded
+bool instr_scope_stats(const char* name, InstrScopeStats* stats);
+// Chrome trace event JSON (chrome://tracing, ui.perfetto.dev)
+bool instr_write_trace(const char* path);
+// table of the scopes and the counters
+void instr_write_summary(FILE* f);
+
+static inline bool instr_enabled(void) {
+  return atomic_load_explicit(&instr_on, memory_order_relaxed);
+}
+
+static inline uint64_t instr_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// registers the calling thread
+uint64_t* _instr_thread_counters(void);
+
+static inline void instr_count(InstrCounter ctr, uint64_t n) {
+  if (!instr_enabled()) return;
+  uint64_t* c = instr_counters != NULL ? instr_counters : _instr_thread_counters();
+  if (c != NULL) c[ctr] += n;
+}
+
+static inline void instr_max(InstrCounter ctr, uint64_t v) {
+  if (!instr_enabled()) return;
+  uint64_t* c = instr_counters != NULL ? instr_counters : _instr_thread_counters();
+  if (c != NULL && v > c[ctr]) c[ctr] = v;
+}
+
+typedef struct {
+  const char* name; // a string literal
+  uint64_t start;   // 0 if disabled at the start
+} InstrScope;
+
+static inline InstrScope instr_scope_begin(const char* name) {
+  return (InstrScope) {name, instr_enabled() ? instr_now() : 0};
+}
+
+void instr_scope_end(InstrScope* scope);
+
+#define INSTR_CONCAT_(a, b) a##b
+#define INSTR_CONCAT(a, b) INSTR_CONCAT_(a, b)
+
+#if INSTRUMENT
+#define INSTR_COUNT(ctr, n) instr_count(ctr, n)
+#define INSTR_MAX(ctr, v) instr_max(ctr, v)
+// times the rest of the enclosing block
+#define INSTR_SCOPE(name) \
+  InstrScope INSTR_CONCAT(instr_scope_, __LINE__) __attribute__((cleanup(instr_scope_end))) \
+    = instr_scope_begin(name)
+#else
+#define INSTR_COUNT(ctr, n) ((void)0)
+#define INSTR_MAX(ctr, v) ((void)0)
+#define INSTR_SCOPE(name) ((void)0)
+#endif
+
+#endif // INSTRUMENT_H
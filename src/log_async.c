@@ -0,0 +1,519 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "stdint.h"
+#include "stddef.h"
+#include "string.h"
+#include "time.h"
+#include "sched.h"
+#include "stdatomic.h"
+#include "pthread.h"
+#include "unistd.h"
+#include "sys/types.h"
+
+#include "logging.h"
+
+// the background thread sleeps this long once all rings are empty
+#define LOG_POLL_NS 1000000
+#define LOG_SPEC_CAP 64
+// output buffer of the background thread, flushed once the rings are empty
+#define LOG_OUT_BUFFER (1 << 16)
+
+/****************************************************
+ * Records. Arguments are kept as the widest type of
+ * their kind, strings are copied behind them.
+ */
+typedef union {
+  long long i;
+  unsigned long long u;
+  double d;
+  const void* p;
+} LogArg;
+
+typedef struct {
+  uint64_t time;     // ns since log_async_start
+  const char* fmt;   // NULL: text holds the formatted message
+  const char* func;
+  const char* file;
+  int line;
+  uint8_t n_args;
+  LogArg args[LOG_MAX_ARGS];
+} LogHeader;
+
+#define LOG_TEXT_CAP (LOG_RECORD_SIZE - sizeof(LogHeader))
+
+typedef struct {
+  LogHeader h;
+  char text[LOG_TEXT_CAP]; // strings of %s, each NUL terminated
+} LogRecord;
+
+_Static_assert(sizeof(LogRecord) == LOG_RECORD_SIZE, "LogRecord must fill LOG_RECORD_SIZE");
+
+/****************************************************
+ * Rings, one per thread. The thread is the only one to
+ * move head, the background thread the only one to move
+ * tail, so neither needs a lock.
+ */
+typedef struct LogRing {
+  _Alignas(64) atomic_size_t head; // next slot to write
+  atomic_bool busy;                // the thread is writing a message
+  atomic_bool retired;             // the thread has exited
+  atomic_size_t dropped;
+  _Alignas(64) atomic_size_t tail; // next slot to read
+  size_t reported;                 // drops already logged
+  unsigned thread;
+  struct LogRing* next;
+  _Alignas(64) LogRecord slots[LOG_RING_SLOTS];
+} LogRing;
+
+static struct {
+  _Atomic(LogRing*) rings;
+  atomic_uint n_threads;
+  atomic_bool running;      // producers may queue
+  atomic_bool quit;         // the background thread drains and exits
+  atomic_size_t flush_req;  // flushes requested
+  atomic_size_t flush_done; // and done by the background thread
+  atomic_size_t dropped;
+  LogOverflow overflow;
+  FILE* out; // fully buffered copy of the FILE given to log_async_start
+  uint64_t start;
+  pthread_t thread;
+  bool at_exit;
+  // held by the main thread while it walks the rings, the background
+  // thread only frees rings if it can take it right away
+  pthread_mutex_t walk;
+} logger = {.walk = PTHREAD_MUTEX_INITIALIZER};
+
+static _Thread_local LogRing* thread_ring;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+const char* log_overflow_to_cstr(LogOverflow overflow) {
+  switch (overflow) {
+    case LOG_DROP:
+      return "drop";
+    case LOG_BLOCK:
+      return "block";
+    case LOG_OVERFLOW_NUM:
+      return "NUM OF OVERFLOW POLICIES";
+  }
+  return NULL;
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void ring_retire(void* ring) {
+  atomic_store(&((LogRing*)ring)->retired, true);
+}
+
+static void ring_key_create(void) {
+  pthread_key_create(&ring_key, ring_retire);
+}
+
+// the ring of the calling thread, NULL if it cannot be allocated
+static LogRing* ring_get(void) {
+  if (thread_ring != NULL) return thread_ring;
+  pthread_once(&ring_key_once, ring_key_create);
+  LogRing* ring = aligned_alloc(_Alignof(LogRing), sizeof(LogRing));
+  if (ring == NULL) return NULL;
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->busy, false);
+  atomic_init(&ring->retired, false);
+  atomic_init(&ring->dropped, 0);
+  atomic_init(&ring->tail, 0);
+  ring->reported = 0;
+  ring->thread = atomic_fetch_add(&logger.n_threads, 1);
+  ring->next = atomic_load(&logger.rings);
+  while (!atomic_compare_exchange_weak(&logger.rings, &ring->next, ring)) {}
+  pthread_setspecific(ring_key, ring);
+  return thread_ring = ring;
+}
+
+/****************************************************
+ * Conversions of printf formats. The format is walked
+ * twice, when the arguments are stored and when they
+ * are written.
+ */
+typedef enum {
+  LEN_NONE = 0, LEN_HH, LEN_H, LEN_L, LEN_LL, LEN_Z, LEN_J, LEN_T,
+} LogLength;
+
+typedef struct {
+  int stars; // '*' widths and precisions, each takes an int argument
+  LogLength len;
+  char conv;
+} LogSpec;
+
+static const char* skip_digits(const char* c) {
+  while (*c >= '0' && *c <= '9') c++;
+  return c;
+}
+
+// parse the conversion after a '%', returns its end
+// NULL for conversions that are not stored (%n, long doubles, wide chars)
+static const char* parse_spec(const char* c, LogSpec* spec) {
+  *spec = (LogSpec) {0};
+  c += strspn(c, "-+ #0'");
+  if (*c == '*') {
+    spec->stars++;
+    c++;
+  } else {
+    c = skip_digits(c);
+  }
+  if (*c == '.') {
+    c++;
+    if (*c == '*') {
+      spec->stars++;
+      c++;
+    } else {
+      c = skip_digits(c);
+    }
+  }
+  switch (*c) {
+    case 'h': spec->len = c[1] == 'h' ? LEN_HH : LEN_H; c += spec->len == LEN_HH ? 2 : 1; break;
+    case 'l': spec->len = c[1] == 'l' ? LEN_LL : LEN_L; c += spec->len == LEN_LL ? 2 : 1; break;
+    case 'z': spec->len = LEN_Z; c++; break;
+    case 'j': spec->len = LEN_J; c++; break;
+    case 't': spec->len = LEN_T; c++; break;
+    default: break;
+  }
+  spec->conv = *c;
+  if (spec->conv == '\0' || strchr("diuoxXcsfFeEgGaAp", spec->conv) == NULL) return NULL;
+  if ((spec->conv == 'c' || spec->conv == 's' || spec->conv == 'p') && spec->len != LEN_NONE) return NULL;
+  return c + 1;
+}
+
+static bool is_signed(char conv) {
+  return conv == 'd' || conv == 'i';
+}
+
+static bool is_float(char conv) {
+  return strchr("fFeEgGaA", conv) != NULL;
+}
+
+// store the arguments of fmt, false if rec cannot hold them
+static bool capture(LogRecord* rec, const char* fmt, va_list args) {
+  size_t n = 0;
+  size_t text = 0;
+  for (const char* c = strchr(fmt, '%'); c != NULL; c = strchr(c, '%')) {
+    if (c[1] == '%') {
+      c += 2;
+      continue;
+    }
+    LogSpec spec;
+    c = parse_spec(c + 1, &spec);
+    if (c == NULL || n + spec.stars + 1 > LOG_MAX_ARGS) return false;
+    for (int s = 0; s < spec.stars; s++) {
+      rec->h.args[n++].i = va_arg(args, int);
+    }
+
+    LogArg* arg = &rec->h.args[n++];
+    if (spec.conv == 's') {
+      const char* str = va_arg(args, const char*);
+      if (str == NULL) str = "(null)";
+      if (text == LOG_TEXT_CAP) return false;
+      // long strings are cut
+      const size_t len = strnlen(str, LOG_TEXT_CAP - text - 1);
+      memcpy(&rec->text[text], str, len);
+      rec->text[text + len] = '\0';
+      arg->u = text;
+      text += len + 1;
+    } else if (spec.conv == 'p') {
+      arg->p = va_arg(args, const void*);
+    } else if (is_float(spec.conv)) {
+      arg->d = va_arg(args, double);
+    } else if (is_signed(spec.conv) || spec.conv == 'c') {
+      switch (spec.len) {
+        case LEN_L: arg->i = va_arg(args, long); break;
+        case LEN_LL: arg->i = va_arg(args, long long); break;
+        case LEN_Z: arg->i = va_arg(args, ssize_t); break;
+        case LEN_J: arg->i = va_arg(args, intmax_t); break;
+        case LEN_T: arg->i = va_arg(args, ptrdiff_t); break;
+        default: arg->i = va_arg(args, int); break;
+      }
+    } else {
+      switch (spec.len) {
+        case LEN_L: arg->u = va_arg(args, unsigned long); break;
+        case LEN_LL: arg->u = va_arg(args, unsigned long long); break;
+        case LEN_Z: arg->u = va_arg(args, size_t); break;
+        case LEN_J: arg->u = va_arg(args, uintmax_t); break;
+        case LEN_T: arg->u = va_arg(args, ptrdiff_t); break;
+        default: arg->u = va_arg(args, unsigned int); break;
+      }
+    }
+  }
+  rec->h.n_args = n;
+  return true;
+}
+
+// the conversion from '%' to end with its stars replaced by their values
+static void spec_cstr(char* out, const char* start, const char* end, const LogArg** arg) {
+  size_t n = 0;
+  for (const char* c = start; c < end && n < LOG_SPEC_CAP - 16; c++) {
+    if (*c == '*') {
+      n += snprintf(&out[n], LOG_SPEC_CAP - n, "%d", (int)(*arg)++->i);
+    } else {
+      out[n++] = *c;
+    }
+  }
+  out[n] = '\0';
+}
+
+// format rec like printf would have
+static void write_message(FILE* out, const LogRecord* rec) {
+  if (rec->h.fmt == NULL) {
+    fputs(rec->text, out);
+    return;
+  }
+  const char* c = rec->h.fmt;
+  const LogArg* arg = rec->h.args;
+  char spec_buf[LOG_SPEC_CAP];
+  while (*c != '\0') {
+    const char* pct = strchr(c, '%');
+    if (pct == NULL) {
+      fputs(c, out);
+      break;
+    }
+    fwrite(c, 1, pct - c, out);
+    if (pct[1] == '%') {
+      fputc('%', out);
+      c = pct + 2;
+      continue;
+    }
+    LogSpec spec;
+    c = parse_spec(pct + 1, &spec); // checked by capture
+    spec_cstr(spec_buf, pct, c, &arg);
+    const LogArg a = *arg++;
+    if (spec.conv == 's') {
+      fprintf(out, spec_buf, &rec->text[a.u]);
+    } else if (spec.conv == 'p') {
+      fprintf(out, spec_buf, a.p);
+    } else if (is_float(spec.conv)) {
+      fprintf(out, spec_buf, a.d);
+    } else if (is_signed(spec.conv) || spec.conv == 'c') {
+      switch (spec.len) {
+        case LEN_L: fprintf(out, spec_buf, (long)a.i); break;
+        case LEN_LL: fprintf(out, spec_buf, (long long)a.i); break;
+        case LEN_Z: fprintf(out, spec_buf, (ssize_t)a.i); break;
+        case LEN_J: fprintf(out, spec_buf, (intmax_t)a.i); break;
+        case LEN_T: fprintf(out, spec_buf, (ptrdiff_t)a.i); break;
+        default: fprintf(out, spec_buf, (int)a.i); break;
+      }
+    } else {
+      switch (spec.len) {
+        case LEN_L: fprintf(out, spec_buf, (unsigned long)a.u); break;
+        case LEN_LL: fprintf(out, spec_buf, (unsigned long long)a.u); break;
+        case LEN_Z: fprintf(out, spec_buf, (size_t)a.u); break;
+        case LEN_J: fprintf(out, spec_buf, (uintmax_t)a.u); break;
+        case LEN_T: fprintf(out, spec_buf, (ptrdiff_t)a.u); break;
+        default: fprintf(out, spec_buf, (unsigned int)a.u); break;
+      }
+    }
+  }
+}
+
+static void write_record(FILE* out, const LogRing* ring, const LogRecord* rec) {
+  fprintf(out, "%s:%i (%s) [thread %u, %.6f s]: ", rec->h.file, rec->h.line, rec->h.func,
+          ring->thread, rec->h.time * 1e-9);
+  write_message(out, rec);
+  fputc('\n', out);
+}
+
+/****************************************************
+ * Producers
+ */
+bool _log_async(PrintVerbosity level, const char* func, const char *file, int line,
+                const char *fmt, va_list args) {
+  (void)level;
+  if (!atomic_load_explicit(&logger.running, memory_order_relaxed)) return false;
+  LogRing* ring = ring_get();
+  if (ring == NULL) return false;
+
+  // log_async_stop waits for busy rings after it stopped accepting
+  atomic_store(&ring->busy, true);
+  bool queued = false;
+  if (atomic_load(&logger.running)) {
+    const size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    bool full = head - atomic_load_explicit(&ring->tail, memory_order_acquire) == LOG_RING_SLOTS;
+    while (full && logger.overflow == LOG_BLOCK && atomic_load_explicit(&logger.running, memory_order_relaxed)) {
+      sched_yield();
+      full = head - atomic_load_explicit(&ring->tail, memory_order_acquire) == LOG_RING_SLOTS;
+    }
+
+    if (full) {
+      // dropped messages count as handled
+      queued = logger.overflow == LOG_DROP;
+      if (queued) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&logger.dropped, 1, memory_order_relaxed);
+      }
+    } else {
+      LogRecord* rec = &ring->slots[head % LOG_RING_SLOTS];
+      rec->h.time = now_ns() - logger.start;
+      rec->h.fmt = fmt;
+      rec->h.func = func;
+      rec->h.file = file;
+      rec->h.line = line;
+      va_list copy;
+      va_copy(copy, args);
+      const bool captured = capture(rec, fmt, copy);
+      va_end(copy);
+      if (!captured) {
+        rec->h.fmt = NULL;
+        vsnprintf(rec->text, LOG_TEXT_CAP, fmt, args);
+      }
+      atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+      queued = true;
+    }
+  }
+  atomic_store_explicit(&ring->busy, false, memory_order_release);
+  return queued;
+}
+
+/****************************************************
+ * Background thread
+ */
+// write the queued records of all rings, oldest first
+// returns the number written
+static size_t drain(FILE* out) {
+  size_t written = 0;
+  while (true) {
+    LogRing* oldest = NULL;
+    const LogRecord* rec = NULL;
+    for (LogRing* ring = atomic_load(&logger.rings); ring != NULL; ring = ring->next) {
+      const size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+      if (tail == atomic_load_explicit(&ring->head, memory_order_acquire)) continue;
+      const LogRecord* r = &ring->slots[tail % LOG_RING_SLOTS];
+      if (rec == NULL || r->h.time < rec->h.time) {
+        oldest = ring;
+        rec = r;
+      }
+    }
+    if (oldest == NULL) return written;
+    write_record(out, oldest, rec);
+    atomic_store_explicit(&oldest->tail, atomic_load(&oldest->tail) + 1, memory_order_release);
+    written++;
+  }
+}
+
+static void report_drops(FILE* out) {
+  for (LogRing* ring = atomic_load(&logger.rings); ring != NULL; ring = ring->next) {
+    const size_t dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    if (dropped == ring->reported) continue;
+    fprintf(out, "log: dropped %zu messages of thread %u, its ring of %d was full\n",
+            dropped - ring->reported, ring->thread, LOG_RING_SLOTS);
+    ring->reported = dropped;
+  }
+}
+
+// free the rings of exited threads once they are empty
+static void reap_rings(void) {
+  LogRing* prev = NULL;
+  LogRing* ring = atomic_load(&logger.rings);
+  while (ring != NULL) {
+    LogRing* next = ring->next;
+    const bool empty = atomic_load(&ring->tail) == atomic_load(&ring->head);
+    if (atomic_load(&ring->retired) && empty && ring->dropped == ring->reported) {
+      // threads only ever push new rings in front of the first one
+      LogRing* expected = ring;
+      const bool unlinked = prev != NULL
+        ? (prev->next = next, true)
+        : atomic_compare_exchange_strong(&logger.rings, &expected, next);
+      if (unlinked) {
+        free(ring);
+        ring = next;
+        continue;
+      }
+    }
+    prev = ring;
+    ring = next;
+  }
+}
+
+static void* log_thread(void* user) {
+  (void)user;
+  const struct timespec poll = {.tv_sec = 0, .tv_nsec = LOG_POLL_NS};
+  while (true) {
+    const bool quit = atomic_load(&logger.quit);
+    const size_t written = drain(logger.out);
+    report_drops(logger.out);
+    const size_t req = atomic_load(&logger.flush_req);
+    if (written == 0 || req != atomic_load(&logger.flush_done)) {
+      fflush(logger.out);
+      atomic_store(&logger.flush_done, req);
+    }
+    if (pthread_mutex_trylock(&logger.walk) == 0) {
+      reap_rings();
+      pthread_mutex_unlock(&logger.walk);
+    }
+    if (quit) break;
+    if (written == 0) nanosleep(&poll, NULL);
+  }
+  return NULL;
+}
+
+/****************************************************
+ * Control
+ */
+static void log_at_exit(void) {
+  log_async_stop();
+}
+
+bool log_async_start(FILE* out, LogOverflow overflow) {
+  if (atomic_load(&logger.running)) return true;
+  // stderr is unbuffered, which would cost a write per conversion
+  if (out == NULL) out = stderr;
+  fflush(out);
+  const int fd = dup(fileno(out));
+  logger.out = fd >= 0 ? fdopen(fd, "w") : NULL;
+  if (logger.out == NULL) {
+    if (fd >= 0) close(fd);
+    return false;
+  }
+  setvbuf(logger.out, NULL, _IOFBF, LOG_OUT_BUFFER);
+  logger.overflow = overflow;
+  logger.start = now_ns();
+  atomic_store(&logger.quit, false);
+  atomic_store(&logger.dropped, 0);
+  if (pthread_create(&logger.thread, NULL, log_thread, NULL) != 0) {
+    fclose(logger.out);
+    return false;
+  }
+  if (!logger.at_exit) logger.at_exit = atexit(log_at_exit) == 0;
+  atomic_store(&logger.running, true);
+  return true;
+}
+
+void log_flush(void) {
+  if (!atomic_load(&logger.running)) return;
+  // everything queued so far is written before the requested flush
+  pthread_mutex_lock(&logger.walk);
+  for (LogRing* ring = atomic_load(&logger.rings); ring != NULL; ring = ring->next) {
+    const size_t head = atomic_load(&ring->head);
+    while (atomic_load(&ring->tail) < head) sched_yield();
+  }
+  pthread_mutex_unlock(&logger.walk);
+  const size_t req = atomic_fetch_add(&logger.flush_req, 1) + 1;
+  while (atomic_load(&logger.flush_done) < req) sched_yield();
+}
+
+void log_async_stop(void) {
+  if (!atomic_load(&logger.running)) return;
+  atomic_store(&logger.running, false);
+  // messages that passed the check of running are still written
+  pthread_mutex_lock(&logger.walk);
+  for (LogRing* ring = atomic_load(&logger.rings); ring != NULL; ring = ring->next) {
+    while (atomic_load(&ring->busy)) sched_yield();
+  }
+  pthread_mutex_unlock(&logger.walk);
+  atomic_store(&logger.quit, true);
+  pthread_join(logger.thread, NULL);
+  fclose(logger.out);
+}
+
+size_t log_dropped(void) {
+  return atomic_load(&logger.dropped);
+}
@@ -3,15 +3,25 @@
 
 #include "logging.h"
 
+PrintVerbosity log_level = VERB_LEVEL;
+
+void log_set_level(PrintVerbosity level) {
+  log_level = level;
+}
+
+// the level is checked at the call site, see _log_at
 void _log(PrintVerbosity level, const char* func, const char *file, int line, const char *fmt, ...) {
-  if (level <= VERB_LEVEL) {
-    va_list args;
-    fprintf(stderr, "%s:%i (%s): ", file, line, func);
-    va_start(args, fmt);
+  va_list args;
+  va_start(args, fmt);
+  const bool queued = _log_async(level, func, file, line, fmt, args);
+  va_end(args);
+  if (queued) return;
+
+  fprintf(stderr, "%s:%i (%s): ", file, line, func);
+  va_start(args, fmt);
 
-    vfprintf(stderr, fmt, args);
-    fprintf(stderr, "\n");
+  vfprintf(stderr, fmt, args);
+  fprintf(stderr, "\n");
 
-    va_end(args);
-  }
+  va_end(args);
 }
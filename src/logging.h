@@ -1,5 +1,8 @@
 #ifndef LOGGING_H
 #define LOGGING_H
+#include "stdio.h"
+#include "stdarg.h"
+#include "stdbool.h"
 
 typedef enum {
   VERB_ERR = 0,
@@ -7,13 +10,60 @@ typedef enum {
   VERB_DBG,
 } PrintVerbosity;
 
-// TODO: Fix Verbosity thing
+// most verbose level that is compiled in, set for every target by
+// CMake. Messages above it are dead code, their arguments are never
+// evaluated and optimized builds contain no trace of them
 #ifndef VERB_LEVEL
-#define VERB_LEVEL VERB_DBG
+#define VERB_LEVEL VERB_WRN
 #endif
 
-#define log_msg(...) _log(VERB_DBG, __FUNCTION__, __FILE__, __LINE__, __VA_ARGS__)
-#define log_wrn(...) _log(VERB_WRN, __FUNCTION__, __FILE__, __LINE__, __VA_ARGS__)
+// runtime level, starts at VERB_LEVEL and can only hide messages
+extern PrintVerbosity log_level;
+void log_set_level(PrintVerbosity level);
+
+#define _log_at(level, ...) do { \
+    if ((level) <= VERB_LEVEL && (level) <= log_level) { \
+      _log(level, __FUNCTION__, __FILE__, __LINE__, __VA_ARGS__); \
+    } \
+  } while (0)
+
+#define log_msg(...) _log_at(VERB_DBG, __VA_ARGS__)
+#define log_wrn(...) _log_at(VERB_WRN, __VA_ARGS__)
+#define log_err(...) _log_at(VERB_ERR, __VA_ARGS__)
 void _log(PrintVerbosity level, const char* func, const char *file, int line, const char *fmt, ...);
 
+/****************************************************
+ * Asynchronous logging. Every thread writes its messages
+ * as binary records (format, arguments, strings copied)
+ * into its own lock-free ring of LOG_RING_SLOTS, a
+ * background thread formats and writes them in order of
+ * time. Formats need to be string literals, they are
+ * only read later. Start and stop from the main thread.
+ */
+#define LOG_RING_SLOTS 2048
+#define LOG_RECORD_SIZE 512 // arguments and strings of one message
+#define LOG_MAX_ARGS 16     // messages with more are formatted right away
+
+// what a thread does when its ring is full
+typedef enum {
+  LOG_DROP = 0, // drop the message, the number dropped is logged later
+  LOG_BLOCK,    // wait for the background thread
+  LOG_OVERFLOW_NUM
+} LogOverflow;
+
+const char* log_overflow_to_cstr(LogOverflow overflow);
+// write all messages to out (stderr for NULL, needs a file descriptor) in the
+// background from now on
+// flushes at exit, false if the thread could not be started
+bool log_async_start(FILE* out, LogOverflow overflow);
+// wait until every message logged so far has been written
+void log_flush(void);
+// flush, stop the background thread and log synchronously again
+void log_async_stop(void);
+// messages dropped since log_async_start
+size_t log_dropped(void);
+// hand a message to the background thread, false if it is not running
+bool _log_async(PrintVerbosity level, const char* func, const char *file, int line,
+                const char *fmt, va_list args);
+
 #endif // LOGGING_H
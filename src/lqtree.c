@@ -0,0 +1,343 @@
+#include "stdio.h"
+#include "string.h"
+#include "math.h"
+#include "assert.h"
+
+#include "qtree.h"
+#include "logging.h"
+
+#define MORTON_LEVELS 32
+// ranges this small are scanned instead of split further
+#define LQTREE_SCAN_SIZE 8
+
+// morton quadrant (bit 0: right, bit 1: lower) to child position
+static const RelPos quad_to_relpos[4] = {RELPOS_UL, RELPOS_UR, RELPOS_LL, RELPOS_LR};
+// child positions in traversal order of the pointer based tree
+static const int relpos_to_quad[RELPOS_NUM] = {
+  [RELPOS_UR] = 1,
+  [RELPOS_UL] = 0,
+  [RELPOS_LL] = 2,
+  [RELPOS_LR] = 3,
+};
+
+static uint32_t morton_quantize(double u) {
+  // ceil - 1 keeps points on a cell boundary in the lower cell
+  double q = ceil(u * 4294967296.0) - 1.0;
+  if (q < 0.0) return 0;
+  if (q > 4294967295.0) return UINT32_MAX;
+  return (uint32_t) q;
+}
+
+static uint64_t morton_spread(uint32_t v) {
+  uint64_t x = v;
+  x = (x | (x << 16)) & 0x0000FFFF0000FFFFull;
+  x = (x | (x <<  8)) & 0x00FF00FF00FF00FFull;
+  x = (x | (x <<  4)) & 0x0F0F0F0F0F0F0F0Full;
+  x = (x | (x <<  2)) & 0x3333333333333333ull;
+  x = (x | (x <<  1)) & 0x5555555555555555ull;
+  return x;
+}
+
+uint64_t morton_key(V2 point, V2 pos, float w, float h) {
+  const double ux = ((double)point.x - ((double)pos.x - (double)w / 2)) / w;
+  const double uy = ((double)point.y - ((double)pos.y - (double)h / 2)) / h;
+  return morton_spread(morton_quantize(ux)) | (morton_spread(morton_quantize(uy)) << 1);
+}
+
+LQTree lqtree_new(V2 pos, float w, float h, size_t cap) {
+  if (cap == 0) cap = 1;
+  return (LQTree) {
+    .pos = pos,
+    .w = w, .h = h,
+    .keys = malloc(sizeof(uint64_t) * cap),
+    .points = malloc(sizeof(V2) * cap),
+    .count = 0,
+    .cap = cap,
+  };
+}
+
+void lqtree_free(LQTree* tree) {
+  if (!tree->view) {
+    free(tree->keys);
+    free(tree->points);
+  }
+  tree->keys = NULL;
+  tree->points = NULL;
+  tree->count = 0;
+  tree->cap = 0;
+  tree->view = false;
+}
+
+// copy the borrowed arrays of a view to new_cap entries of its own
+static bool lqtree_own(LQTree* tree, size_t new_cap) {
+  uint64_t* keys = malloc(sizeof(uint64_t) * new_cap);
+  V2* points = malloc(sizeof(V2) * new_cap);
+  if (keys == NULL || points == NULL) {
+    free(keys);
+    free(points);
+    return false;
+  }
+  memcpy(keys, tree->keys, sizeof(uint64_t) * tree->count);
+  memcpy(points, tree->points, sizeof(V2) * tree->count);
+  tree->keys = keys;
+  tree->points = points;
+  tree->cap = new_cap;
+  tree->view = false;
+  return true;
+}
+
+static bool lqtree_reserve(LQTree* tree, size_t cap) {
+  if (cap <= tree->cap) return true;
+  size_t new_cap = tree->cap * 2 > cap ? tree->cap * 2 : cap;
+  if (tree->view) return lqtree_own(tree, new_cap);
+  uint64_t* keys = realloc(tree->keys, sizeof(uint64_t) * new_cap);
+  if (keys == NULL) return false;
+  tree->keys = keys;
+  V2* points = realloc(tree->points, sizeof(V2) * new_cap);
+  if (points == NULL) return false;
+  tree->points = points;
+  tree->cap = new_cap;
+  return true;
+}
+
+static bool lqtree_in_bounds(const LQTree* tree, V2 point) {
+  return !((point.x > tree->pos.x + tree->w / 2)
+        || (point.x < tree->pos.x - tree->w / 2)
+        || (point.y > tree->pos.y + tree->h / 2)
+        || (point.y < tree->pos.y - tree->h / 2));
+}
+
+// first index in [lo, hi) with keys[idx] >= key
+static size_t lower_bound(const uint64_t* keys, size_t lo, size_t hi, uint64_t key) {
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (keys[mid] < key) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+static bool lqtree_contains(const LQTree* tree, size_t idx, uint64_t key, V2 point) {
+  for (; idx < tree->count && tree->keys[idx] == key; idx++) {
+    if (v2_eq(tree->points[idx], point)) return true;
+  }
+  return false;
+}
+
+bool lqtree_insert(LQTree* tree, V2 point) {
+  if (!lqtree_in_bounds(tree, point)) {
+    log_msg("Node at (%.2f, %.2f) out of bounds", P_COORDS(point));
+    return false;
+  }
+
+  const uint64_t key = morton_key(point, tree->pos, tree->w, tree->h);
+  const size_t idx = lower_bound(tree->keys, 0, tree->count, key);
+  if (lqtree_contains(tree, idx, key, point)) {
+    log_wrn("IGNORING NODE AT (%.2f, %.2f)", P_COORDS(point));
+    return false;
+  }
+  if (!lqtree_reserve(tree, tree->count + 1)) {
+    log_wrn("Could not grow linear qtree to %ld points", tree->count + 1);
+    return false;
+  }
+
+  memmove(&tree->keys[idx + 1], &tree->keys[idx], sizeof(uint64_t) * (tree->count - idx));
+  memmove(&tree->points[idx + 1], &tree->points[idx], sizeof(V2) * (tree->count - idx));
+  tree->keys[idx] = key;
+  tree->points[idx] = point;
+  tree->count++;
+  return true;
+}
+
+typedef struct {
+  uint64_t key;
+  V2 point;
+} LQEntry;
+
+static int lqentry_cmp(const void* a, const void* b) {
+  const LQEntry* ea = a;
+  const LQEntry* eb = b;
+  if (ea->key != eb->key) return ea->key < eb->key ? -1 : 1;
+  if (ea->point.x != eb->point.x) return ea->point.x < eb->point.x ? -1 : 1;
+  if (ea->point.y != eb->point.y) return ea->point.y < eb->point.y ? -1 : 1;
+  return 0;
+}
+
+size_t lqtree_insert_batch(LQTree* tree, const V2* points, size_t n) {
+  LQEntry* entries = malloc(sizeof(LQEntry) * (n > 0 ? n : 1));
+  if (entries == NULL) {
+    log_wrn("Could not allocate the keys of %ld points for the linear qtree", n);
+    return 0;
+  }
+  size_t n_new = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (!lqtree_in_bounds(tree, points[i])) continue;
+    entries[n_new++] = (LQEntry) {
+      .key = morton_key(points[i], tree->pos, tree->w, tree->h),
+      .point = points[i],
+    };
+  }
+  qsort(entries, n_new, sizeof(LQEntry), lqentry_cmp);
+
+  if (!lqtree_reserve(tree, tree->count + n_new)) {
+    log_wrn("Could not grow linear qtree to %ld points", tree->count + n_new);
+    free(entries);
+    return 0;
+  }
+
+  // merge from the back so the existing points move at most once
+  size_t old = tree->count;
+  size_t out = tree->count + n_new;
+  size_t inserted = 0;
+  for (size_t i = n_new; i > 0; i--) {
+    const LQEntry* e = &entries[i - 1];
+    if (i > 1 && lqentry_cmp(e, &entries[i - 2]) == 0) continue;
+    while (old > 0 && tree->keys[old - 1] > e->key) {
+      out--; old--;
+      tree->keys[out] = tree->keys[old];
+      tree->points[out] = tree->points[old];
+    }
+    if (lqtree_contains(tree, lower_bound(tree->keys, 0, old, e->key), e->key, e->point)) {
+      continue;
+    }
+    out--;
+    tree->keys[out] = e->key;
+    tree->points[out] = e->point;
+    inserted++;
+  }
+  // close the gap left by skipped duplicates
+  if (out != old) {
+    memmove(&tree->keys[old], &tree->keys[out], sizeof(uint64_t) * (tree->count + n_new - out));
+    memmove(&tree->points[old], &tree->points[out], sizeof(V2) * (tree->count + n_new - out));
+  }
+  tree->count += inserted;
+
+  free(entries);
+  return inserted;
+}
+
+size_t lqtree_count_leaves(const LQTree* tree) {
+  // every point is alone in its cell
+  return tree->count;
+}
+
+// implicit cell of the linear tree: [lo, hi) of keys sharing a prefix
+typedef struct {
+  size_t lo;
+  size_t hi;
+  unsigned level;
+  Node node; // geometry of the cell
+} LQCell;
+
+static void lqtree_children(const LQTree* tree, const LQCell* cell, LQCell children[4]) {
+  const unsigned shift = 2 * (MORTON_LEVELS - 1 - cell->level);
+  const uint64_t prefix = cell->level == 0
+    ? 0 : tree->keys[cell->lo] & ~((UINT64_C(1) << (shift + 2)) - 1);
+
+  size_t lo = cell->lo;
+  for (int quad = 0; quad < 4; quad++) {
+    size_t hi = quad == 3
+      ? cell->hi : lower_bound(tree->keys, lo, cell->hi, prefix | ((uint64_t)(quad + 1) << shift));
+    const RelPos rpos = quad_to_relpos[quad];
+    children[quad] = (LQCell) {
+      .lo = lo,
+      .hi = hi,
+      .level = cell->level + 1,
+      .node = node_new(gen_pos_parent((Node*)&cell->node, rpos), NODE_BRANCH,
+                       cell->node.w / 2, cell->node.h / 2),
+    };
+    lo = hi;
+  }
+}
+
+static LQCell lqtree_root_cell(const LQTree* tree) {
+  return (LQCell) {
+    .lo = 0,
+    .hi = tree->count,
+    .level = 0,
+    .node = node_new(tree->pos, NODE_ROOT, tree->w, tree->h),
+  };
+}
+
+static void lqtree_traverse_cell(FILE* f, const LQTree* tree, const LQCell* cell) {
+  size_t n = cell->hi - cell->lo;
+  if (n == 0) {
+    fprintf(f, "%s at %.2f %.2f with dimensions %.2f, %.2f\n",
+            node_type_to_cstr(NODE_EMPTY),
+            cell->node.pos.x, cell->node.pos.y, cell->node.w, cell->node.h);
+    return;
+  }
+
+  if ((n == 1 && cell->level > 0) || cell->level == MORTON_LEVELS) {
+    for (size_t i = cell->lo; i < cell->hi; i++) {
+      fprintf(f, "%s at %.2f %.2f with dimensions %.2f, %.2f\n",
+              node_type_to_cstr(NODE_LEAF),
+              tree->points[i].x, tree->points[i].y, cell->node.w, cell->node.h);
+    }
+    return;
+  }
+
+  LQCell children[4];
+  lqtree_children(tree, cell, children);
+  for (size_t rpos = RELPOS_UR; rpos < RELPOS_NUM; rpos++) {
+    lqtree_traverse_cell(f, tree, &children[relpos_to_quad[rpos]]);
+  }
+}
+
+void _lqtree_traverse_node(FILE* f, const LQTree* tree) {
+  if (tree->count == 0) return;
+  const LQCell root = lqtree_root_cell(tree);
+  lqtree_traverse_cell(f, tree, &root);
+}
+
+static void lqtree_closest_cell(const LQTree* tree, const LQCell* cell, const V2* point,
+                                size_t* best, float* best_dist2) {
+  if (cell->hi - cell->lo <= LQTREE_SCAN_SIZE || cell->level == MORTON_LEVELS) {
+    for (size_t i = cell->lo; i < cell->hi; i++) {
+      V2 d = v2_sub(tree->points[i], *point);
+      float dist2 = d.x * d.x + d.y * d.y;
+      if (dist2 < *best_dist2) {
+        *best_dist2 = dist2;
+        *best = i;
+      }
+    }
+    return;
+  }
+
+  LQCell children[4];
+  float dists[4];
+  int order[4] = {0, 1, 2, 3};
+  lqtree_children(tree, cell, children);
+  for (int quad = 0; quad < 4; quad++) {
+    dists[quad] = cell_dist2(&children[quad].node, point);
+  }
+  // closest cells first, so the bound shrinks as early as possible
+  for (int i = 1; i < 4; i++) {
+    for (int j = i; j > 0 && dists[order[j]] < dists[order[j - 1]]; j--) {
+      int tmp = order[j]; order[j] = order[j - 1]; order[j - 1] = tmp;
+    }
+  }
+  for (int i = 0; i < 4; i++) {
+    const LQCell* child = &children[order[i]];
+    if (child->hi == child->lo) continue;
+    if (dists[order[i]] >= *best_dist2) break;
+    lqtree_closest_cell(tree, child, point, best, best_dist2);
+  }
+}
+
+const V2* lqtree_find_closest(const LQTree* tree, const V2* point, float* dist) {
+  if (tree->count == 0) {
+    return NULL;
+  }
+  const LQCell root = lqtree_root_cell(tree);
+  size_t best = 0;
+  float best_dist2 = INFINITY;
+  lqtree_closest_cell(tree, &root, point, &best, &best_dist2);
+  if (dist != NULL) {
+    *dist = sqrtf(best_dist2);
+  }
+  return &tree->points[best];
+}
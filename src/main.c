@@ -1,4 +1,6 @@
 #include "stdio.h"
+#include "string.h"
+#include "stdlib.h"
 #include "stdbool.h"
 #include "assert.h"
 
@@ -7,7 +9,10 @@
 #include "datastructs.h"
 #include "qtree.h"
 #include "mesh.h"
+#include "delaunay.h"
+#include "predicates.h"
 #include "logging.h"
+#include "instrument.h"
 
 
 #define UNPACK(val) (val & 0xFF000000) >> 24,\
@@ -26,10 +31,16 @@
 #define C_QTREE_EMPTY 0x485F84FF
 #define C_QTREE_LEAF  0xE49B5DFF
 #define C_QTREE_ROBR  0x7D2A2FFF
+#define C_MESH 0xD8CAB8FF
 
 #define POINTS_DRAW_RADIUS 10 // pixels
+#define QTREE_DRAW_MIN_CELL 2 // pixels, smaller cells are not subdivided when drawing
 
-#define POINTS_CAP 1024
+#define POINTS_CAP 1024 // initial capacity, the lists grow
+#define MESH_MAX_POINTS (1024 * 1024) // points added by refinement at most
+#define MESH_MIN_ANGLE 25 // degrees
+#define QTREE_BUILD_THREADS 0 // one per cpu
+#define BATCH_CAP 1024 // initial rects per batch, the batches grow
 
 
 void draw_rect(SDL_Renderer* renderer, float x, float y, float w, float h, bool fill) {
@@ -46,6 +57,77 @@ void draw_rect(SDL_Renderer* renderer, float x, float y, float w, float h, bool
   }
 }
 
+/****************************************************
+ * Retained rects: grouped by colour and style, rebuilt
+ * when the points or the qtree change and drawn with
+ * one call per group every frame.
+ */
+typedef struct {
+  SDL_FRect* rects;
+  size_t count;
+  size_t cap;
+  uint32_t color;
+  bool fill;
+} RectBatch;
+
+RectBatch RectBatch_new(uint32_t color, bool fill) {
+  return (RectBatch) {
+    .rects = NULL,
+    .count = 0,
+    .cap = 0,
+    .color = color,
+    .fill = fill,
+  };
+}
+
+// rect of size w, h centered at x, y like draw_rect
+bool RectBatch_push(RectBatch* batch, float x, float y, float w, float h) {
+  if (batch->count >= batch->cap) {
+    const size_t cap = batch->cap == 0 ? BATCH_CAP : 2 * batch->cap;
+    SDL_FRect* rects = realloc(batch->rects, sizeof(SDL_FRect) * cap);
+    if (rects == NULL) {
+      return false;
+    }
+    batch->rects = rects;
+    batch->cap = cap;
+  }
+  batch->rects[batch->count++] = (SDL_FRect) {x - w / 2, y - h / 2, w, h};
+  return true;
+}
+
+void RectBatch_draw(SDL_Renderer* renderer, const RectBatch* batch) {
+  if (batch->count == 0) {
+    return;
+  }
+  SDL_SetRenderDrawColor(renderer, UNPACK(batch->color));
+  if (batch->fill) {
+    SDL_RenderFillRectsF(renderer, batch->rects, (int)batch->count);
+  } else {
+    SDL_RenderDrawRectsF(renderer, batch->rects, (int)batch->count);
+  }
+}
+
+void RectBatch_free(RectBatch* batch) {
+  free(batch->rects);
+  *batch = RectBatch_new(batch->color, batch->fill);
+}
+
+typedef enum {
+  BATCH_POINTS = 0,
+  BATCH_TREE_CELLS,   // outlines of branches
+  BATCH_TREE_EMPTY,   // outlines of empty leaves
+  BATCH_TREE_CENTERS, // centers of the root and branches
+  BATCH_TREE_EMPTY_CENTERS,
+  BATCH_TREE_POINTS,  // points of leaves
+  N_BATCHES
+} BatchKind;
+
+// in the order they are drawn
+RectBatch batches[N_BATCHES];
+// the batches of the points or of the tree are out of date
+bool points_dirty = true;
+bool tree_dirty = true;
+
 typedef enum {
   MODE_POINTS = 0,
   MODE_OUTLINE,
@@ -55,77 +137,199 @@ typedef enum {
 
 PList g_points;
 PList outline;
+PList steiner; // points added by mesh refinement
 
 EList edges;
-Node qtree;
+QTree qtree;
 Mesh mesh;
 bool draw_tree = false;
 
 ProgramMode mode = MODE_OUTLINE;
 SDL_Renderer *renderer;
 
-void draw_qtree(Node* node) {
+void batches_init() {
+  batches[BATCH_POINTS] = RectBatch_new(C_PNTS, true);
+  batches[BATCH_TREE_CELLS] = RectBatch_new(C_QTREE_ROBR, false);
+  batches[BATCH_TREE_EMPTY] = RectBatch_new(C_QTREE_EMPTY, false);
+  batches[BATCH_TREE_CENTERS] = RectBatch_new(C_QTREE_ROBR, true);
+  batches[BATCH_TREE_EMPTY_CENTERS] = RectBatch_new(C_QTREE_EMPTY, true);
+  batches[BATCH_TREE_POINTS] = RectBatch_new(C_QTREE_LEAF, true);
+}
+
+void batches_free() {
+  for (size_t i = 0; i < N_BATCHES; i++) {
+    RectBatch_free(&batches[i]);
+  }
+}
+
+// rects that do not fit are not drawn
+void batch_push(BatchKind kind, V2 pos, float w, float h, bool* ok) {
+  *ok = RectBatch_push(&batches[kind], P_COORDS(pos), w, h) && *ok;
+}
+
+void batch_points() {
+  INSTR_SCOPE("batch_points");
+  bool ok = true;
+  batches[BATCH_POINTS].count = 0;
+  for (size_t i = 0; i < g_points.count; i++) {
+    batch_push(BATCH_POINTS, g_points.points[i], POINTS_DRAW_RADIUS, POINTS_DRAW_RADIUS, &ok);
+  }
+  if (!ok) {
+    log_wrn("Out of memory for drawing points");
+  }
+}
+
+// batches a single node, children are visited by qtree_query_rect
+void batch_qtree_node(Node* node, void* user) {
+  bool* ok = user;
   switch (node->type) {
     case NODE_BRANCH:
-      SDL_SetRenderDrawColor(renderer, UNPACK(C_QTREE_ROBR));
-      draw_rect(renderer, P_COORDS(node->pos),
-                POINTS_DRAW_RADIUS, POINTS_DRAW_RADIUS, true);
-      draw_rect(renderer, P_COORDS(node->pos),
-                node->w, node->h, false);
-      for (size_t pos = RELPOS_UR; pos < RELPOS_NUM; pos++) {
-        draw_qtree(&node->children[pos]);
-      }
+      batch_push(BATCH_TREE_CENTERS, node->pos, POINTS_DRAW_RADIUS, POINTS_DRAW_RADIUS, ok);
+      batch_push(BATCH_TREE_CELLS, node->pos, node->w, node->h, ok);
       break;
     case NODE_LEAF:
-      SDL_SetRenderDrawColor(renderer, UNPACK(C_QTREE_LEAF));
-      draw_rect(renderer, P_COORDS(node->pos),
-                POINTS_DRAW_RADIUS, POINTS_DRAW_RADIUS, true);
+      for (uint32_t i = 0; i < node->count; i++) {
+        batch_push(BATCH_TREE_POINTS, node->points[i], POINTS_DRAW_RADIUS, POINTS_DRAW_RADIUS, ok);
+      }
       break;
     case NODE_EMPTY:
-      SDL_SetRenderDrawColor(renderer, UNPACK(C_QTREE_EMPTY));
-      draw_rect(renderer, P_COORDS(node->pos), node->w, node->h, false);
-      draw_rect(renderer, P_COORDS(node->pos),
-                POINTS_DRAW_RADIUS, POINTS_DRAW_RADIUS, true);
+      batch_push(BATCH_TREE_EMPTY, node->pos, node->w, node->h, ok);
+      batch_push(BATCH_TREE_EMPTY_CENTERS, node->pos, POINTS_DRAW_RADIUS, POINTS_DRAW_RADIUS, ok);
       break;
     case NODE_ROOT:
-      SDL_SetRenderDrawColor(renderer, UNPACK(C_QTREE_ROBR));
-      draw_rect(renderer, P_COORDS(node->pos),
-                POINTS_DRAW_RADIUS, POINTS_DRAW_RADIUS, true);
-      if (node->children != NULL) {
-        for (size_t pos = RELPOS_UR; pos < RELPOS_NUM; pos++) {
-          draw_qtree(&node->children[pos]);
-        }
-      }
+      batch_push(BATCH_TREE_CENTERS, node->pos, POINTS_DRAW_RADIUS, POINTS_DRAW_RADIUS, ok);
       break;
   }
 }
 
+// only the part of the tree inside the viewport
+void batch_qtree(Node* root, V2 view_min, V2 view_max) {
+  INSTR_SCOPE("batch_qtree");
+  bool ok = true;
+  for (size_t i = BATCH_TREE_CELLS; i < N_BATCHES; i++) {
+    batches[i].count = 0;
+  }
+  qtree_query_rect(root, view_min, view_max, QTREE_DRAW_MIN_CELL, batch_qtree_node, &ok);
+  if (!ok) {
+    log_wrn("Out of memory for drawing the qtree");
+  }
+}
+
+void draw_batches(size_t first, size_t end) {
+  for (size_t i = first; i < end; i++) {
+    RectBatch_draw(renderer, &batches[i]);
+  }
+}
+
 // build a qtree form n_lists PLists
-void build_qtree(Node* root, size_t n_lists, ...) {
+void build_qtree(QTree* tree, size_t n_lists, ...) {
+  const PList* lists[n_lists];
   va_list args;
   va_start(args, n_lists);
 
   for (size_t i = 0; i < n_lists; i++) {
-    PList *list = va_arg(args, PList*);
-    for (size_t j = 0; j < list->count; j++) {
-      qtree_insert(root, list->points[j]);
-    }
+    lists[i] = va_arg(args, PList*);
   }
   va_end(args);
+
+  INSTR_SCOPE("build_qtree");
+  qtree_build_parallel(tree, n_lists, lists, QTREE_BUILD_THREADS);
 }
 
 void regenerate_qtree() {
-  qtree_free(&qtree);
   build_qtree(&qtree, 2, &g_points, &outline);
+  tree_dirty = true;
+}
+
+// edges of the closed outline
+void outline_edges(EList* list) {
+  list->count = 0;
+  for (size_t i = 0; i < outline.count; i++) {
+    EList_push(list, &outline.points[i], &outline.points[(i + 1) % outline.count]);
+  }
+}
+
+// only mesh inside of the outline once it is a polygon
+void compute_mesh() {
+  const PList* lists[] = {&outline, &g_points};
+  bool ok;
+  predicate_stats_reset();
+  if (outline.count >= 3) {
+    outline_edges(&edges);
+    ok = mesh_triangulate_constrained(&mesh, 2, lists, &edges);
+  } else {
+    ok = mesh_triangulate(&mesh, 2, lists);
+  }
+  if (ok) {
+    const PredicateStats st = predicate_stats();
+    log_msg("Triangulated %ld points into %ld cells, exact predicates: %lu orient2d, %lu incircle",
+            outline.count + g_points.count, mesh.count, st.orient2d_exact, st.incircle_exact);
+  }
+}
+
+// refine to the point density of the qtree cells
+void refine_mesh() {
+  const PList* lists[] = {&outline, &g_points};
+  const MeshQuality quality = {
+    .min_angle = MESH_MIN_ANGLE,
+    .size = mesh_size_qtree,
+    .size_user = &qtree,
+    .max_points = MESH_MAX_POINTS,
+  };
+  if (outline.count >= 3) {
+    outline_edges(&edges);
+  }
+  mesh_refine(&mesh, 2, lists, outline.count >= 3 ? &edges : NULL, &quality, &steiner);
+  log_msg("Refined %ld points into %ld cells with %ld new points",
+          outline.count + g_points.count, mesh.count, steiner.count);
+}
+
+void draw_mesh() {
+  SDL_SetRenderDrawColor(renderer, UNPACK(C_MESH));
+  for (size_t i = 0; i < mesh.count; i++) {
+    const Cell* cell = &mesh.cells[i];
+    const SDL_FPoint loop[4] = {
+      {P_COORDS((*cell->points[0]))},
+      {P_COORDS((*cell->points[1]))},
+      {P_COORDS((*cell->points[2]))},
+      {P_COORDS((*cell->points[0]))},
+    };
+    SDL_RenderDrawLinesF(renderer, loop, 4);
+  }
+}
+
+// append point to list, cells and edges follow the points if the list moves
+bool push_point(PList* list, V2 point) {
+  const V2* old = list->points;
+  if (!PList_push(list, P_COORDS(point))) {
+    return false;
+  }
+  if (list->points != old) {
+    Mesh_rebase(&mesh, old, list->count - 1, list->points);
+    EList_rebase(&edges, old, list->count - 1, list->points);
+  }
+  return true;
+}
+
+// remove the last point of list from the list and the qtree
+void undo_point(PList* list) {
+  if (list->count == 0) {
+    return;
+  }
+  qtree_remove(&qtree, list->points[list->count - 1]);
+  PList_pop(list);
+  points_dirty = tree_dirty = true;
+  // cells may point at the removed point
+  mesh.count = 0;
 }
 
 void undo() {
   switch (mode) {
     case MODE_OUTLINE:
-      PList_pop(&outline);
+      undo_point(&outline);
       break;
     case MODE_POINTS:
-      PList_pop(&g_points);
+      undo_point(&g_points);
       break;
     case MODE_SELECT:
       break;
@@ -146,12 +350,18 @@ void handle_sdlevents(bool* quit) {
         case SDLK_g:
           regenerate_qtree();
           break;
+        case SDLK_m:
+          compute_mesh();
+          break;
         case SDLK_p:
-          qtree_traverse_node(&qtree);
+          qtree_traverse_node(&qtree.root);
           break;
         case SDLK_q:
           *quit = true;;
           break;
+        case SDLK_r:
+          refine_mesh();
+          break;
         case SDLK_u:
           undo();
           break;
@@ -164,9 +374,15 @@ void handle_sdlevents(bool* quit) {
 
     if (event.type == SDL_MOUSEBUTTONUP) {
       PList* cur_list = mode == MODE_OUTLINE ? &outline : &g_points;
-      if (!PList_push(cur_list, event.button.x, event.button.y)) {
-        log_msg("WARN: Point capacity Reached");
+      const V2 point = v2(event.button.x, event.button.y);
+      // the qtree rejects duplicates, keep the lists free of them as well
+      if (!qtree_insert(&qtree, point)) {
+        log_wrn("Ignoring point at (%.2f, %.2f)", P_COORDS(point));
+      } else if (!push_point(cur_list, point)) {
+        qtree_remove(&qtree, point);
+        log_wrn("Out of memory for points");
       }
+      points_dirty = tree_dirty = true;
     }
 
     if (event.type == SDL_MOUSEBUTTONDOWN) {
@@ -190,9 +406,19 @@ void draw_outline() {
             POINTS_DRAW_RADIUS, POINTS_DRAW_RADIUS, true);
 }
 
-int main() {
+int main(int argc, char** argv) {
+  // -p trace.json: time the frames and the work they trigger
+  const char* trace = argc == 3 && strcmp(argv[1], "-p") == 0 ? argv[2] : NULL;
+  if (argc != 1 && trace == NULL) {
+    fprintf(stderr, "usage: %s [-p trace.json]\n", argv[0]);
+    return 2;
+  }
+  if (trace != NULL) instr_enable(true);
+
+  // a full ring drops messages rather than a frame
+  log_async_start(NULL, LOG_DROP);
   if (SDL_Init(SDL_INIT_VIDEO) != 0) {
-    log_msg("ERROR: Failed to initialise SDL!");
+    log_err("Failed to initialise SDL!");
     exit(1);
   }
 
@@ -202,7 +428,7 @@ int main() {
                             SDL_WINDOW_SHOWN);
 
   if (window == NULL) {
-    log_msg("ERROR: Window could not be created!");
+    log_err("Window could not be created!");
     exit(1);
   }
 
@@ -211,29 +437,47 @@ int main() {
 
   g_points = PList_new(POINTS_CAP);
   outline = PList_new(POINTS_CAP);
+  edges = EList_new(POINTS_CAP);
+  steiner = PList_new(POINTS_CAP);
 
-  qtree = node_new(v2(SCREEN_WIDTH / 2, SCREEN_HEIGHT / 2),
-                   NODE_ROOT,
-                   SCREEN_WIDTH, SCREEN_HEIGHT);
+  mesh = Mesh_new(POINTS_CAP);
+  batches_init();
+  qtree = qtree_new(v2(SCREEN_WIDTH / 2, SCREEN_HEIGHT / 2),
+                    SCREEN_WIDTH, SCREEN_HEIGHT);
 
   log_msg("Root of Qtree at (%.2f, %.2f) with dims (%.2f, %.2f)",
-          P_COORDS(qtree.pos), qtree.w, qtree.h);
+          P_COORDS(qtree.root.pos), qtree.root.w, qtree.root.h);
 
   while (!quit) {
-    handle_sdlevents(&quit);
+    INSTR_SCOPE("frame");
+    {
+      INSTR_SCOPE("events");
+      handle_sdlevents(&quit);
+    }
 
-    SDL_SetRenderDrawColor(renderer, UNPACK(C_PNTS));
-    for (size_t i = 0; i < g_points.count; i++) {
-      draw_rect(renderer, g_points.points[i].x, g_points.points[i].y,
-                POINTS_DRAW_RADIUS, POINTS_DRAW_RADIUS, true);
+    if (points_dirty) {
+      batch_points();
+      points_dirty = false;
     }
+    // the tree is only batched while it is shown
+    if (draw_tree && tree_dirty) {
+      batch_qtree(&qtree.root, v2(0, 0), v2(SCREEN_WIDTH, SCREEN_HEIGHT));
+      tree_dirty = false;
+    }
+
+    {
+      INSTR_SCOPE("draw");
+      draw_batches(BATCH_POINTS, BATCH_TREE_CELLS);
 
-    draw_outline();
+      draw_mesh();
+      draw_outline();
 
-    if (draw_tree) {
-      draw_qtree(&qtree);
+      if (draw_tree) {
+        draw_batches(BATCH_TREE_CELLS, N_BATCHES);
+      }
     }
 
+    INSTR_SCOPE("present");
     SDL_RenderPresent(renderer);
     SDL_SetRenderDrawColor(renderer, UNPACK(C_BACK));
     SDL_RenderClear(renderer);
@@ -241,8 +485,19 @@ int main() {
 
   PList_free(&g_points);
   PList_free(&outline);
+  EList_free(&edges);
+  PList_free(&steiner);
+  qtree_free(&qtree);
+  Mesh_free(&mesh);
+  batches_free();
 
   SDL_DestroyWindow(window);
   SDL_Quit();
+
+  if (trace != NULL) {
+    instr_enable(false);
+    instr_write_summary(stdout);
+    if (!instr_write_trace(trace)) log_err("Could not write the trace to %s", trace);
+  }
   return 0;
 }
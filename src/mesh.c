@@ -1,6 +1,8 @@
 #include "mesh.h"
 
 #include "memory.h"
+#include "assert.h"
+#include "logging.h"
 
 Mesh Mesh_new(size_t cell_cap) {
   return (Mesh) {
@@ -12,11 +14,41 @@ Mesh Mesh_new(size_t cell_cap) {
 
 void Mesh_free(Mesh* msh) {
   free(msh->cells);
+  msh->cells = NULL;
+  msh->count = 0;
   msh->cap = 0;
 }
 
+bool Mesh_reserve(Mesh* msh, size_t cell_cap) {
+  if (cell_cap <= msh->cap) {
+    return true;
+  }
+  Cell* cells = realloc(msh->cells, sizeof(Cell) * cell_cap);
+  if (cells == NULL) {
+    return false;
+  }
+  msh->cells = cells;
+  msh->cap = cell_cap;
+  return true;
+}
+
+bool Mesh_shrink(Mesh* msh) {
+  if (msh->count == 0) {
+    Mesh_free(msh);
+    return true;
+  }
+  Cell* cells = realloc(msh->cells, sizeof(Cell) * msh->count);
+  if (cells == NULL) {
+    return false;
+  }
+  msh->cells = cells;
+  msh->cap = msh->count;
+  return true;
+}
+
 bool Mesh_push(Mesh* msh, V2* p0, V2* p1, V2* p2, int64_t neighbors[3]) {
-  if (msh->count >= msh->cap) {
+  if (msh->count >= msh->cap
+      && !Mesh_reserve(msh, msh->cap > 0 ? 2 * msh->cap : LIST_MIN_CAP)) {
     return false;
   }
 
@@ -37,3 +69,91 @@ bool Mesh_pop(Mesh* msh) {
   msh->count--;
   return true;
 }
+
+void Mesh_rebase(Mesh* msh, const V2* old, size_t count, V2* new) {
+  for (size_t c = 0; c < msh->count; c++) {
+    for (int k = 0; k < 3; k++) {
+      msh->cells[c].points[k] = rebase_point(msh->cells[c].points[k], old, count, new);
+    }
+  }
+}
+
+IMesh IMesh_new(size_t n_verts, size_t n_cells) {
+  return (IMesh) {
+    .x = malloc(sizeof(float) * n_verts),
+    .y = malloc(sizeof(float) * n_verts),
+    .n_verts = n_verts,
+    .verts = malloc(sizeof(uint32_t) * 3 * n_cells),
+    .neighbors = malloc(sizeof(uint32_t) * 3 * n_cells),
+    .n_cells = n_cells,
+  };
+}
+
+void IMesh_free(IMesh* msh) {
+  if (!msh->view) {
+    free(msh->x);
+    free(msh->y);
+    free(msh->verts);
+    free(msh->neighbors);
+  }
+  *msh = (IMesh) {0};
+}
+
+// corner of a cell, sorted by the point it refers to
+typedef struct {
+  const V2* point;
+  size_t corner;
+} CornerRef;
+
+static int corner_ref_cmp(const void* a, const void* b) {
+  const CornerRef* ca = a;
+  const CornerRef* cb = b;
+  if (ca->point != cb->point) return ca->point < cb->point ? -1 : 1;
+  return (ca->corner > cb->corner) - (ca->corner < cb->corner);
+}
+
+bool IMesh_from_mesh(IMesh* imsh, const Mesh* msh) {
+  // corners and cells are indexed with 32 bits, UINT32_MAX is IMESH_NONE
+  if (msh->count > (UINT32_MAX - 1) / 3) {
+    log_err("%zu cells do not fit 32 bit indices", msh->count);
+    return false;
+  }
+  const size_t n_corners = 3 * msh->count;
+  CornerRef* refs = malloc(sizeof(CornerRef) * n_corners);
+  if (refs == NULL && n_corners > 0) return false;
+  for (size_t c = 0; c < msh->count; c++) {
+    for (int k = 0; k < 3; k++) {
+      refs[3 * c + k] = (CornerRef) { .point = msh->cells[c].points[k], .corner = 3 * c + k };
+    }
+  }
+  // points in the same PList keep their order
+  qsort(refs, n_corners, sizeof(CornerRef), corner_ref_cmp);
+
+  size_t n_verts = 0;
+  for (size_t i = 0; i < n_corners; i++) {
+    if (i == 0 || refs[i].point != refs[i - 1].point) n_verts++;
+  }
+
+  IMesh_free(imsh);
+  *imsh = IMesh_new(n_verts, msh->count);
+  if (((imsh->x == NULL || imsh->y == NULL) && n_verts > 0)
+      || ((imsh->verts == NULL || imsh->neighbors == NULL) && msh->count > 0)) {
+    IMesh_free(imsh);
+    free(refs);
+    return false;
+  }
+
+  uint32_t v = 0;
+  for (size_t i = 0; i < n_corners; i++) {
+    if (i > 0 && refs[i].point != refs[i - 1].point) v++;
+    imsh->x[v] = refs[i].point->x;
+    imsh->y[v] = refs[i].point->y;
+    imsh->verts[refs[i].corner] = v;
+  }
+  for (size_t i = 0; i < n_corners; i++) {
+    const int64_t nb = msh->cells[i / 3].neighbors[i % 3];
+    imsh->neighbors[i] = nb < 0 ? IMESH_NONE : (uint32_t)nb;
+  }
+  free(refs);
+  return true;
+}
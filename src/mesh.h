@@ -1,10 +1,13 @@
 #ifndef MESH_H
 #define MESH_H
+#include "stdint.h"
+
 #include "datastructs.h"
 
 /****************************************************
  * A Mesh is made from Cells, which in turn consist 
  * of 3 Points and 3 (optional) indices of neighbors.
+ * It grows like a PList.
  */
 
 typedef struct {
@@ -22,4 +25,50 @@ Mesh Mesh_new(size_t cell_cap);
 void Mesh_free(Mesh* msh);
 bool Mesh_push(Mesh* msh, V2* p0, V2* p1, V2* p2, int64_t neighbors[3]);
 bool Mesh_pop(Mesh* msh);
+bool Mesh_reserve(Mesh* msh, size_t cell_cap);
+bool Mesh_shrink(Mesh* msh);
+// repoint cells into the count points at old (a PList that moved) to new
+void Mesh_rebase(Mesh* msh, const V2* old, size_t count, V2* new);
+
+/****************************************************
+ * IMesh is a Mesh made from plain index arrays, so it
+ * stays valid when point storage moves and can be
+ * written to disk as is. Vertex coordinates are kept
+ * in separate x and y arrays. Cell c has the vertices
+ * verts[3 * c + k] and borders neighbors[3 * c + k]
+ * across the edge opposite of vertex k.
+ */
+#define IMESH_NONE UINT32_MAX
+
+typedef struct {
+  float *x;
+  float *y;
+  size_t n_verts;
+  uint32_t *verts;
+  uint32_t *neighbors; // IMESH_NONE for none
+  size_t n_cells;
+  bool view; // the arrays are borrowed (e.g. from a mapped file) and not freed
+} IMesh;
+
+IMesh IMesh_new(size_t n_verts, size_t n_cells);
+void IMesh_free(IMesh* msh);
+// replace the contents of imsh (from IMesh_new) with msh, every point the
+// cells of msh share by pointer becomes one vertex. false if allocation fails
+bool IMesh_from_mesh(IMesh* imsh, const Mesh* msh);
+
+static inline V2 imesh_vertex(const IMesh* msh, uint32_t v) {
+  return (V2) {msh->x[v], msh->y[v]};
+}
+
+static inline uint32_t imesh_cell_vertex(const IMesh* msh, size_t cell, int k) {
+  return msh->verts[3 * cell + k];
+}
+
+static inline V2 imesh_cell_point(const IMesh* msh, size_t cell, int k) {
+  return imesh_vertex(msh, msh->verts[3 * cell + k]);
+}
+
+static inline uint32_t imesh_neighbor(const IMesh* msh, size_t cell, int k) {
+  return msh->neighbors[3 * cell + k];
+}
 #endif // MESH_H
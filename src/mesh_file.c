@@ -0,0 +1,372 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "stdint.h"
+#include "string.h"
+#include "math.h"
+#include "errno.h"
+#include "fcntl.h"
+#include "limits.h"
+#include "unistd.h"
+#include "sys/mman.h"
+#include "sys/stat.h"
+#include "sys/uio.h"
+
+#include "mesh_io.h"
+#include "v2batch.h"
+#include "logging.h"
+
+#define MESH_FILE_MAGIC "GENMESH" // 8 bytes with the terminator
+#define MESH_FILE_BYTE_ORDER 0x01020304u
+#define MESH_FILE_CHECKSUM 1u // header flag
+
+/****************************************************
+ * Layout: the Header, padded to a multiple of
+ * MESH_FILE_ALIGN, then the sections in the order of
+ * the Section enum, each padded to MESH_FILE_ALIGN.
+ * Empty sections take no space and have offset 0.
+ */
+typedef enum {
+  SECTION_OUTLINE = 0,  // V2
+  SECTION_POINTS,       // V2
+  SECTION_QTREE_KEYS,   // uint64_t, sorted
+  SECTION_QTREE_POINTS, // V2, one per key
+  SECTION_X,            // float per vertex
+  SECTION_Y,            // float per vertex
+  SECTION_VERTS,        // uint32_t, 3 per cell
+  SECTION_NEIGHBORS,    // uint32_t, 3 per cell
+  SECTION_NUM
+} Section;
+
+static const size_t item_size[SECTION_NUM] = {
+  [SECTION_OUTLINE] = sizeof(V2),
+  [SECTION_POINTS] = sizeof(V2),
+  [SECTION_QTREE_KEYS] = sizeof(uint64_t),
+  [SECTION_QTREE_POINTS] = sizeof(V2),
+  [SECTION_X] = sizeof(float),
+  [SECTION_Y] = sizeof(float),
+  [SECTION_VERTS] = sizeof(uint32_t),
+  [SECTION_NEIGHBORS] = sizeof(uint32_t),
+};
+
+typedef struct {
+  uint64_t offset; // from the start of the file
+  uint64_t count;  // entries
+} SectionRef;
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order; // MESH_FILE_BYTE_ORDER as the writer stored it
+  uint32_t flags;
+  uint32_t n_sections;
+  uint64_t size;     // of the whole file
+  uint64_t checksum; // of all of the file, with checksum 0
+  V2 min;
+  V2 max;
+  V2 qtree_pos;
+  float qtree_w;
+  float qtree_h;
+  SectionRef sections[SECTION_NUM];
+} Header;
+
+static size_t align_up(size_t n) {
+  return (n + MESH_FILE_ALIGN - 1) / MESH_FILE_ALIGN * MESH_FILE_ALIGN;
+}
+
+#define HEADER_SIZE align_up(sizeof(Header))
+_Static_assert(sizeof(Header) % sizeof(uint64_t) == 0, "the checksum reads the header in words");
+
+/****************************************************
+ * Checksum over 64 bit words, a partial last word is
+ * padded with zeros. Only meant to catch damaged files.
+ */
+#define CHECKSUM_SEED 0x27d4eb2f165667c5ull
+#define CHECKSUM_P1 0x9e3779b185ebca87ull
+#define CHECKSUM_P2 0xc2b2ae3d27d4eb4full
+
+static inline uint64_t checksum_word(uint64_t h, uint64_t w) {
+  h ^= w * CHECKSUM_P2;
+  h = (h << 31) | (h >> 33);
+  return h * CHECKSUM_P1;
+}
+
+static uint64_t checksum_update(uint64_t h, const void* data, size_t n) {
+  const char* bytes = data;
+  uint64_t w;
+  for (; n >= sizeof(w); bytes += sizeof(w), n -= sizeof(w)) {
+    memcpy(&w, bytes, sizeof(w));
+    h = checksum_word(h, w);
+  }
+  if (n > 0) {
+    w = 0;
+    memcpy(&w, bytes, n);
+    h = checksum_word(h, w);
+  }
+  return h;
+}
+
+static uint64_t checksum_zeros(uint64_t h, size_t n) {
+  for (size_t i = 0; i < n; i += sizeof(uint64_t)) {
+    h = checksum_word(h, 0);
+  }
+  return h;
+}
+
+static uint64_t header_checksum(const Header* header) {
+  Header unsummed = *header;
+  unsummed.checksum = 0;
+  return checksum_update(CHECKSUM_SEED, &unsummed, sizeof(unsummed));
+}
+
+// checksum of the file the writer is about to write, the padding is zeros
+static uint64_t parts_checksum(const Header* header, const void* const data[SECTION_NUM]) {
+  uint64_t h = checksum_zeros(header_checksum(header), HEADER_SIZE - sizeof(Header));
+  for (int s = 0; s < SECTION_NUM; s++) {
+    const size_t size = header->sections[s].count * item_size[s];
+    const size_t words = (size + sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t);
+    h = checksum_zeros(checksum_update(h, data[s], size), align_up(size) - words);
+  }
+  return h;
+}
+
+// checksum of all bytes of a mapped file
+static uint64_t map_checksum(const Header* header) {
+  const char* bytes = (const char*)header;
+  return checksum_update(header_checksum(header), &bytes[sizeof(Header)],
+                         header->size - sizeof(Header));
+}
+
+/****************************************************
+ * Writing
+ */
+static void bounds_merge(V2* min, V2* max, bool* any, V2 lmin, V2 lmax) {
+  *min = *any ? v2(fminf(min->x, lmin.x), fminf(min->y, lmin.y)) : lmin;
+  *max = *any ? v2(fmaxf(max->x, lmax.x), fmaxf(max->y, lmax.y)) : lmax;
+  *any = true;
+}
+
+static bool writev_all(int fd, struct iovec* iov, int n) {
+  while (n > 0) {
+    ssize_t written = writev(fd, iov, n);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    // drop what is written, the last part may be written partially
+    while (n > 0 && (size_t)written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (char*)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+  return true;
+}
+
+bool MeshFile_write(const char* path, const PList* outline, const PList* points,
+                    const LQTree* qtree, const IMesh* msh, bool checksum) {
+  const PList no_points = {0};
+  const LQTree no_qtree = {0};
+  const IMesh no_mesh = {0};
+  if (outline == NULL) outline = &no_points;
+  if (points == NULL) points = &no_points;
+  if (qtree == NULL) qtree = &no_qtree;
+  if (msh == NULL) msh = &no_mesh;
+
+  const void* const data[SECTION_NUM] = {
+    [SECTION_OUTLINE] = outline->points,
+    [SECTION_POINTS] = points->points,
+    [SECTION_QTREE_KEYS] = qtree->keys,
+    [SECTION_QTREE_POINTS] = qtree->points,
+    [SECTION_X] = msh->x,
+    [SECTION_Y] = msh->y,
+    [SECTION_VERTS] = msh->verts,
+    [SECTION_NEIGHBORS] = msh->neighbors,
+  };
+  const size_t counts[SECTION_NUM] = {
+    [SECTION_OUTLINE] = outline->count,
+    [SECTION_POINTS] = points->count,
+    [SECTION_QTREE_KEYS] = qtree->count,
+    [SECTION_QTREE_POINTS] = qtree->count,
+    [SECTION_X] = msh->n_verts,
+    [SECTION_Y] = msh->n_verts,
+    [SECTION_VERTS] = 3 * msh->n_cells,
+    [SECTION_NEIGHBORS] = 3 * msh->n_cells,
+  };
+
+  Header header = {
+    .version = MESH_FILE_VERSION,
+    .byte_order = MESH_FILE_BYTE_ORDER,
+    .flags = checksum ? MESH_FILE_CHECKSUM : 0,
+    .n_sections = SECTION_NUM,
+    .qtree_pos = qtree->pos,
+    .qtree_w = qtree->w,
+    .qtree_h = qtree->h,
+  };
+  memcpy(header.magic, MESH_FILE_MAGIC, sizeof(header.magic));
+
+  bool any = false;
+  V2 lmin, lmax;
+  if (v2_bounds(outline->points, outline->count, &lmin, &lmax)) {
+    bounds_merge(&header.min, &header.max, &any, lmin, lmax);
+  }
+  if (v2_bounds(points->points, points->count, &lmin, &lmax)) {
+    bounds_merge(&header.min, &header.max, &any, lmin, lmax);
+  }
+  for (size_t v = 0; v < msh->n_verts; v++) {
+    const V2 p = v2(msh->x[v], msh->y[v]);
+    bounds_merge(&header.min, &header.max, &any, p, p);
+  }
+
+  // the arrays are handed to writev as they are
+  static const char zeros[MESH_FILE_ALIGN];
+  struct iovec iov[2 + 2 * SECTION_NUM];
+  int n_iov = 0;
+  iov[n_iov++] = (struct iovec) {&header, sizeof(header)};
+  iov[n_iov++] = (struct iovec) {(void*)zeros, HEADER_SIZE - sizeof(header)};
+  uint64_t offset = HEADER_SIZE;
+  for (int s = 0; s < SECTION_NUM; s++) {
+    const size_t size = counts[s] * item_size[s];
+    header.sections[s] = (SectionRef) {size > 0 ? offset : 0, counts[s]};
+    if (size == 0) continue;
+    iov[n_iov++] = (struct iovec) {(void*)data[s], size};
+    iov[n_iov++] = (struct iovec) {(void*)zeros, align_up(size) - size};
+    offset += align_up(size);
+  }
+  header.size = offset;
+  if (checksum) header.checksum = parts_checksum(&header, data);
+
+  // readers that still map the old file keep seeing it
+  char tmp[PATH_MAX];
+  if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+    log_wrn("Path too long: %s", path);
+    return false;
+  }
+  const int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    log_wrn("Could not open %s", tmp);
+    return false;
+  }
+  bool ok = writev_all(fd, iov, n_iov);
+  ok = close(fd) == 0 && ok;
+  ok = ok && rename(tmp, path) == 0;
+  if (!ok) {
+    log_wrn("Could not write %s", path);
+    unlink(tmp);
+  }
+  return ok;
+}
+
+/****************************************************
+ * Mapping
+ */
+// NULL if the header describes a valid file of size bytes
+static const char* header_error(const Header* header, size_t size) {
+  if (memcmp(header->magic, MESH_FILE_MAGIC, sizeof(header->magic)) != 0) {
+    return "not a mesh file";
+  }
+  if (header->version != MESH_FILE_VERSION) return "unsupported version";
+  if (header->byte_order != MESH_FILE_BYTE_ORDER) return "written with another byte order";
+  if (header->n_sections != SECTION_NUM || header->size != size) return "truncated or damaged";
+
+  for (int s = 0; s < SECTION_NUM; s++) {
+    const SectionRef* ref = &header->sections[s];
+    if (ref->count == 0) continue;
+    if (ref->count > size / item_size[s]
+        || ref->offset % MESH_FILE_ALIGN != 0 || ref->offset < HEADER_SIZE
+        || ref->offset > size || ref->count * item_size[s] > size - ref->offset) {
+      return "truncated or damaged";
+    }
+  }
+
+  const SectionRef* sec = header->sections;
+  if (sec[SECTION_QTREE_KEYS].count != sec[SECTION_QTREE_POINTS].count
+      || sec[SECTION_X].count != sec[SECTION_Y].count
+      || sec[SECTION_VERTS].count != sec[SECTION_NEIGHBORS].count
+      || sec[SECTION_VERTS].count % 3 != 0
+      || sec[SECTION_X].count > UINT32_MAX) {
+    return "inconsistent counts";
+  }
+  return NULL;
+}
+
+bool MeshFile_map(MeshFile* file, const char* path, bool verify) {
+  *file = (MeshFile) {0};
+  const int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    log_wrn("Could not open %s", path);
+    return false;
+  }
+  struct stat st;
+  void* map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(Header)) {
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (map == MAP_FAILED) {
+    log_wrn("Could not map %s", path);
+    return false;
+  }
+
+  const Header* header = map;
+  const char* err = header_error(header, st.st_size);
+  if (err == NULL && verify && (header->flags & MESH_FILE_CHECKSUM)
+      && map_checksum(header) != header->checksum) {
+    err = "checksum mismatch";
+  }
+  if (err != NULL) {
+    log_wrn("%s: %s", path, err);
+    munmap(map, st.st_size);
+    return false;
+  }
+
+  const SectionRef* sec = header->sections;
+  void* data[SECTION_NUM];
+  for (int s = 0; s < SECTION_NUM; s++) {
+    data[s] = sec[s].count > 0 ? (char*)map + sec[s].offset : NULL;
+  }
+  const size_t n_qtree = sec[SECTION_QTREE_KEYS].count;
+  *file = (MeshFile) {
+    .outline = PList_view(data[SECTION_OUTLINE], sec[SECTION_OUTLINE].count),
+    .points = PList_view(data[SECTION_POINTS], sec[SECTION_POINTS].count),
+    .qtree = {
+      .pos = header->qtree_pos,
+      .w = header->qtree_w,
+      .h = header->qtree_h,
+      .keys = data[SECTION_QTREE_KEYS],
+      .points = data[SECTION_QTREE_POINTS],
+      .count = n_qtree,
+      .cap = n_qtree,
+      .view = true,
+    },
+    .mesh = {
+      .x = data[SECTION_X],
+      .y = data[SECTION_Y],
+      .n_verts = sec[SECTION_X].count,
+      .verts = data[SECTION_VERTS],
+      .neighbors = data[SECTION_NEIGHBORS],
+      .n_cells = sec[SECTION_VERTS].count / 3,
+      .view = true,
+    },
+    .min = header->min,
+    .max = header->max,
+    .map = map,
+    .map_size = st.st_size,
+  };
+  log_msg("Mapped %s: %ld outline points, %ld points, %ld vertices, %ld cells", path,
+          file->outline.count, file->points.count, file->mesh.n_verts, file->mesh.n_cells);
+  return true;
+}
+
+void MeshFile_unmap(MeshFile* file) {
+  // parts that grew own their memory now
+  PList_free(&file->outline);
+  PList_free(&file->points);
+  lqtree_free(&file->qtree);
+  IMesh_free(&file->mesh);
+  if (file->map != NULL) munmap(file->map, file->map_size);
+  *file = (MeshFile) {0};
+}
@@ -0,0 +1,446 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "stdarg.h"
+#include "stdint.h"
+#include "string.h"
+#include "strings.h"
+#include "math.h"
+#include "errno.h"
+#include "fcntl.h"
+#include "unistd.h"
+#include "assert.h"
+
+#include "mesh_io.h"
+#include "logging.h"
+
+#define WRITER_CAP (1 << 20)
+// bigger arrays are written from where they are
+#define WRITER_DIRECT (WRITER_CAP / 2)
+#define HEADER_CAP 512
+#define FLOAT_CHARS 16 // -d.dddddddde-dd
+#define U32_CHARS 10
+
+#define VTK_TRIANGLE 5
+
+/****************************************************
+ * Buffered writes to a file descriptor
+ */
+typedef struct {
+  int fd;
+  char* buf;
+  size_t len;
+  bool ok; // false after the first failed write
+} Writer;
+
+static bool write_all(int fd, const char* data, size_t n) {
+  while (n > 0) {
+    const ssize_t written = write(fd, data, n);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    data += written;
+    n -= written;
+  }
+  return true;
+}
+
+static bool writer_open(Writer* w, const char* path) {
+  *w = (Writer) {
+    .fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644),
+    .buf = malloc(WRITER_CAP),
+    .len = 0,
+    .ok = true,
+  };
+  if (w->fd < 0 || w->buf == NULL) {
+    log_wrn("Could not open %s", path);
+    if (w->fd >= 0) close(w->fd);
+    free(w->buf);
+    return false;
+  }
+  return true;
+}
+
+static void writer_flush(Writer* w) {
+  if (w->ok && w->len > 0) {
+    w->ok = write_all(w->fd, w->buf, w->len);
+  }
+  w->len = 0;
+}
+
+// room for n <= WRITER_CAP bytes, the caller advances len by what it used
+static inline char* writer_reserve(Writer* w, size_t n) {
+  if (w->len + n > WRITER_CAP) writer_flush(w);
+  return &w->buf[w->len];
+}
+
+static void writer_put(Writer* w, const void* data, size_t n) {
+  if (n >= WRITER_DIRECT) {
+    writer_flush(w);
+    if (w->ok) w->ok = write_all(w->fd, data, n);
+    return;
+  }
+  memcpy(writer_reserve(w, n), data, n);
+  w->len += n;
+}
+
+// for headers only, the bulk data is not formatted with printf
+__attribute__((format(printf, 2, 3)))
+static void writer_printf(Writer* w, const char* fmt, ...) {
+  char* out = writer_reserve(w, HEADER_CAP);
+  va_list args;
+  va_start(args, fmt);
+  const int n = vsnprintf(out, HEADER_CAP, fmt, args);
+  va_end(args);
+  assert(n >= 0 && n < HEADER_CAP && "header line too long");
+  w->len += n;
+}
+
+static bool writer_close(Writer* w, const char* path) {
+  writer_flush(w);
+  bool ok = w->ok;
+  if (close(w->fd) != 0) ok = false;
+  free(w->buf);
+  if (!ok) log_wrn("Could not write %s", path);
+  return ok;
+}
+
+/****************************************************
+ * Number formatting and byte order
+ */
+static size_t fmt_u32(uint32_t v, char* out) {
+  char rev[U32_CHARS];
+  size_t n = 0;
+  do {
+    rev[n++] = '0' + v % 10;
+    v /= 10;
+  } while (v > 0);
+  for (size_t i = 0; i < n; i++) {
+    out[i] = rev[n - 1 - i];
+  }
+  return n;
+}
+
+// 9 significant digits in scientific notation, trailing zeros dropped
+static size_t fmt_float(float v, char* out) {
+  size_t n = 0;
+  if (isnan(v)) {
+    memcpy(out, "nan", 3);
+    return 3;
+  }
+  if (signbit(v)) {
+    out[n++] = '-';
+    v = -v;
+  }
+  if (isinf(v)) {
+    memcpy(&out[n], "inf", 3);
+    return n + 3;
+  }
+  if (v == 0) {
+    out[n++] = '0';
+    return n;
+  }
+
+  // doubles are precise enough to get the digits of a float right
+  const double d = v;
+  int exp10 = (int)floor(log10(d));
+  uint64_t digits = (uint64_t)llround(d * pow(10, 8 - exp10));
+  if (digits >= 1000000000) {
+    exp10++;
+    digits = (uint64_t)llround(d * pow(10, 8 - exp10));
+  } else if (digits < 100000000) {
+    exp10--;
+    digits = (uint64_t)llround(d * pow(10, 8 - exp10));
+  }
+
+  char dig[9];
+  for (int i = 8; i >= 0; i--) {
+    dig[i] = '0' + digits % 10;
+    digits /= 10;
+  }
+  int n_dig = 9;
+  while (n_dig > 1 && dig[n_dig - 1] == '0') n_dig--;
+  out[n++] = dig[0];
+  if (n_dig > 1) {
+    out[n++] = '.';
+    memcpy(&out[n], &dig[1], n_dig - 1);
+    n += n_dig - 1;
+  }
+  const int e = exp10 < 0 ? -exp10 : exp10;
+  out[n++] = 'e';
+  out[n++] = exp10 < 0 ? '-' : '+';
+  out[n++] = '0' + e / 10;
+  out[n++] = '0' + e % 10;
+  return n;
+}
+
+static bool host_big_endian(void) {
+  const uint16_t one = 1;
+  uint8_t first;
+  memcpy(&first, &one, 1);
+  return first == 0;
+}
+
+static inline void put_u32(char* out, uint32_t v, bool big_endian) {
+  if (big_endian != host_big_endian()) v = __builtin_bswap32(v);
+  memcpy(out, &v, 4);
+}
+
+static inline void put_f32(char* out, float f, bool big_endian) {
+  uint32_t v;
+  memcpy(&v, &f, 4);
+  put_u32(out, v, big_endian);
+}
+
+static inline void put_u16(char* out, uint16_t v, bool big_endian) {
+  if (big_endian != host_big_endian()) v = __builtin_bswap16(v);
+  memcpy(out, &v, 2);
+}
+
+/****************************************************
+ * Formats
+ */
+static const char* format_names[MESH_FMT_NUM] = {
+  [MESH_FMT_TEXT] = "text",
+  [MESH_FMT_VTK_ASCII] = "vtk-ascii",
+  [MESH_FMT_VTK_BINARY] = "vtk",
+  [MESH_FMT_VTU] = "vtu",
+  [MESH_FMT_STL] = "stl",
+  [MESH_FMT_NATIVE] = "native",
+};
+
+const char* mesh_format_to_cstr(MeshFormat fmt) {
+  assert(fmt < MESH_FMT_NUM && "unknown mesh format");
+  return format_names[fmt];
+}
+
+MeshFormat mesh_format_from_cstr(const char* name) {
+  for (int fmt = MESH_FMT_TEXT; fmt < MESH_FMT_NUM; fmt++) {
+    if (strcasecmp(name, format_names[fmt]) == 0) return fmt;
+  }
+  return MESH_FMT_NUM;
+}
+
+MeshFormat mesh_format_from_path(const char* path) {
+  const char* ext = strrchr(path, '.');
+  if (ext == NULL || strchr(ext, '/') != NULL) return MESH_FMT_TEXT;
+  if (strcasecmp(ext, ".vtk") == 0) return MESH_FMT_VTK_BINARY;
+  if (strcasecmp(ext, ".vtu") == 0) return MESH_FMT_VTU;
+  if (strcasecmp(ext, ".stl") == 0) return MESH_FMT_STL;
+  if (strcasecmp(ext, ".gmb") == 0) return MESH_FMT_NATIVE;
+  return MESH_FMT_TEXT;
+}
+
+bool IMesh_write(const IMesh* msh, const char* path, MeshFormat fmt) {
+  switch (fmt) {
+    case MESH_FMT_TEXT:
+      return IMesh_write_text(msh, path);
+    case MESH_FMT_VTK_ASCII:
+      return IMesh_write_vtk(msh, path, false);
+    case MESH_FMT_VTK_BINARY:
+      return IMesh_write_vtk(msh, path, true);
+    case MESH_FMT_VTU:
+      return IMesh_write_vtu(msh, path);
+    case MESH_FMT_STL:
+      return IMesh_write_stl(msh, path);
+    case MESH_FMT_NATIVE:
+      return MeshFile_write(path, NULL, NULL, NULL, msh, true);
+    default:
+      assert(false && "unknown mesh format");
+  }
+  return false;
+}
+
+// vertex v as 'x y' or 'x y 0'
+static void put_vertex_text(Writer* w, const IMesh* msh, size_t v, bool z) {
+  char* out = writer_reserve(w, 2 * FLOAT_CHARS + 5);
+  size_t n = fmt_float(msh->x[v], out);
+  out[n++] = ' ';
+  n += fmt_float(msh->y[v], &out[n]);
+  if (z) {
+    memcpy(&out[n], " 0", 2);
+    n += 2;
+  }
+  out[n++] = '\n';
+  w->len += n;
+}
+
+// cell c as 'a b c', prefixed by its vertex count for VTK
+static void put_cell_text(Writer* w, const IMesh* msh, size_t c, bool count) {
+  char* out = writer_reserve(w, 3 * (U32_CHARS + 1) + 2);
+  size_t n = 0;
+  if (count) {
+    memcpy(out, "3 ", 2);
+    n += 2;
+  }
+  for (int k = 0; k < 3; k++) {
+    n += fmt_u32(msh->verts[3 * c + k], &out[n]);
+    out[n++] = k < 2 ? ' ' : '\n';
+  }
+  w->len += n;
+}
+
+bool IMesh_write_text(const IMesh* msh, const char* path) {
+  Writer w;
+  if (!writer_open(&w, path)) return false;
+  writer_printf(&w, "%ld %ld\n", msh->n_verts, msh->n_cells);
+  for (size_t v = 0; v < msh->n_verts; v++) {
+    put_vertex_text(&w, msh, v, false);
+  }
+  for (size_t c = 0; c < msh->n_cells; c++) {
+    put_cell_text(&w, msh, c, false);
+  }
+  return writer_close(&w, path);
+}
+
+bool IMesh_write_vtk(const IMesh* msh, const char* path, bool binary) {
+  Writer w;
+  if (!writer_open(&w, path)) return false;
+  writer_printf(&w, "# vtk DataFile Version 3.0\ngen_mesh\n%s\nDATASET UNSTRUCTURED_GRID\n",
+                binary ? "BINARY" : "ASCII");
+
+  writer_printf(&w, "POINTS %ld float\n", msh->n_verts);
+  for (size_t v = 0; v < msh->n_verts; v++) {
+    if (binary) {
+      char* out = writer_reserve(&w, 12);
+      put_f32(out, msh->x[v], true);
+      put_f32(&out[4], msh->y[v], true);
+      put_f32(&out[8], 0, true);
+      w.len += 12;
+    } else {
+      put_vertex_text(&w, msh, v, true);
+    }
+  }
+
+  writer_printf(&w, "%sCELLS %ld %ld\n", binary ? "\n" : "", msh->n_cells, 4 * msh->n_cells);
+  for (size_t c = 0; c < msh->n_cells; c++) {
+    if (binary) {
+      char* out = writer_reserve(&w, 16);
+      put_u32(out, 3, true);
+      for (int k = 0; k < 3; k++) {
+        put_u32(&out[4 + 4 * k], msh->verts[3 * c + k], true);
+      }
+      w.len += 16;
+    } else {
+      put_cell_text(&w, msh, c, true);
+    }
+  }
+
+  writer_printf(&w, "%sCELL_TYPES %ld\n", binary ? "\n" : "", msh->n_cells);
+  for (size_t c = 0; c < msh->n_cells; c++) {
+    if (binary) {
+      put_u32(writer_reserve(&w, 4), VTK_TRIANGLE, true);
+      w.len += 4;
+    } else {
+      memcpy(writer_reserve(&w, 2), "5\n", 2);
+      w.len += 2;
+    }
+  }
+  if (binary) writer_put(&w, "\n", 1);
+  return writer_close(&w, path);
+}
+
+// size header of an appended VTU array
+static void put_vtu_size(Writer* w, uint64_t size) {
+  writer_put(w, &size, sizeof(size));
+}
+
+bool IMesh_write_vtu(const IMesh* msh, const char* path) {
+  // connectivity and offsets are Int32, offsets run up to 3 * n_cells
+  if (msh->n_verts > INT32_MAX || msh->n_cells > INT32_MAX / 3) {
+    log_err("%s: %zu vertices and %zu cells do not fit Int32 connectivity",
+            path, msh->n_verts, msh->n_cells);
+    return false;
+  }
+  Writer w;
+  if (!writer_open(&w, path)) return false;
+
+  // sizes of the arrays, each is preceded by its size as UInt64
+  const uint64_t points_size = 12 * (uint64_t)msh->n_verts;
+  const uint64_t conn_size = 12 * (uint64_t)msh->n_cells;
+  const uint64_t offsets_size = 4 * (uint64_t)msh->n_cells;
+  const uint64_t types_size = msh->n_cells;
+  const uint64_t conn_at = sizeof(uint64_t) + points_size;
+  const uint64_t offsets_at = conn_at + sizeof(uint64_t) + conn_size;
+  const uint64_t types_at = offsets_at + sizeof(uint64_t) + offsets_size;
+
+  writer_printf(&w,
+    "<?xml version=\"1.0\"?>\n"
+    "<VTKFile type=\"UnstructuredGrid\" version=\"1.0\" byte_order=\"%s\" header_type=\"UInt64\">\n"
+    "  <UnstructuredGrid>\n"
+    "    <Piece NumberOfPoints=\"%ld\" NumberOfCells=\"%ld\">\n",
+    host_big_endian() ? "BigEndian" : "LittleEndian", msh->n_verts, msh->n_cells);
+  writer_printf(&w,
+    "      <Points>\n"
+    "        <DataArray type=\"Float32\" NumberOfComponents=\"3\" format=\"appended\" offset=\"0\"/>\n"
+    "      </Points>\n"
+    "      <Cells>\n"
+    "        <DataArray type=\"Int32\" Name=\"connectivity\" format=\"appended\" offset=\"%lu\"/>\n"
+    "        <DataArray type=\"Int32\" Name=\"offsets\" format=\"appended\" offset=\"%lu\"/>\n"
+    "        <DataArray type=\"UInt8\" Name=\"types\" format=\"appended\" offset=\"%lu\"/>\n"
+    "      </Cells>\n",
+    conn_at, offsets_at, types_at);
+  writer_printf(&w,
+    "    </Piece>\n"
+    "  </UnstructuredGrid>\n"
+    "  <AppendedData encoding=\"raw\">\n"
+    "   _");
+
+  // native byte order, so only the points have to be interleaved
+  put_vtu_size(&w, points_size);
+  for (size_t v = 0; v < msh->n_verts; v++) {
+    const float p[3] = {msh->x[v], msh->y[v], 0};
+    memcpy(writer_reserve(&w, sizeof(p)), p, sizeof(p));
+    w.len += sizeof(p);
+  }
+  put_vtu_size(&w, conn_size);
+  writer_put(&w, msh->verts, conn_size);
+  put_vtu_size(&w, offsets_size);
+  for (size_t c = 0; c < msh->n_cells; c++) {
+    const int32_t end = 3 * (c + 1);
+    memcpy(writer_reserve(&w, sizeof(end)), &end, sizeof(end));
+    w.len += sizeof(end);
+  }
+  put_vtu_size(&w, types_size);
+  for (size_t c = 0; c < msh->n_cells; c += WRITER_DIRECT) {
+    const size_t n = msh->n_cells - c < WRITER_DIRECT ? msh->n_cells - c : WRITER_DIRECT;
+    memset(writer_reserve(&w, n), VTK_TRIANGLE, n);
+    w.len += n;
+  }
+  writer_printf(&w, "\n  </AppendedData>\n</VTKFile>\n");
+  return writer_close(&w, path);
+}
+
+bool IMesh_write_stl(const IMesh* msh, const char* path) {
+  // the header holds the number of triangles as UInt32
+  if (msh->n_cells > UINT32_MAX) {
+    log_err("%s: %zu cells do not fit the UInt32 count of STL", path, msh->n_cells);
+    return false;
+  }
+  Writer w;
+  if (!writer_open(&w, path)) return false;
+
+  // the header must not start with 'solid', that marks ASCII STL
+  char header[84];
+  memset(header, ' ', 80);
+  memcpy(header, "gen_mesh binary STL", 19);
+  put_u32(&header[80], msh->n_cells, false);
+  writer_put(&w, header, sizeof(header));
+
+  // normal, 3 vertices, attribute byte count
+  for (size_t c = 0; c < msh->n_cells; c++) {
+    char* out = writer_reserve(&w, 50);
+    put_f32(&out[0], 0, false);
+    put_f32(&out[4], 0, false);
+    put_f32(&out[8], 1, false);
+    for (int k = 0; k < 3; k++) {
+      const uint32_t v = msh->verts[3 * c + k];
+      put_f32(&out[12 + 12 * k], msh->x[v], false);
+      put_f32(&out[16 + 12 * k], msh->y[v], false);
+      put_f32(&out[20 + 12 * k], 0, false);
+    }
+    put_u16(&out[48], 0, false);
+    w.len += 50;
+  }
+  return writer_close(&w, path);
+}
@@ -0,0 +1,76 @@
+#ifndef MESH_IO_H
+#define MESH_IO_H
+#include "stdbool.h"
+
+#include "mesh.h"
+#include "qtree.h"
+
+/****************************************************
+ * Mesh files. Writers copy the IMesh arrays into a
+ * large buffer (or hand them to write(2) directly)
+ * instead of going through stdio, floats in text
+ * formats are printed with 9 significant digits, which
+ * reads back to the same float.
+ *
+ * Vertices get z = 0 in the 3D formats.
+ */
+typedef enum {
+  MESH_FMT_TEXT = 0, // '<n_verts> <n_cells>', 'x y' per vertex, 'a b c' per cell
+  MESH_FMT_VTK_ASCII,  // legacy VTK unstructured grid
+  MESH_FMT_VTK_BINARY, // legacy VTK, big endian as the format requires
+  MESH_FMT_VTU,        // VTK XML unstructured grid with raw appended data
+  MESH_FMT_STL,        // binary STL
+  MESH_FMT_NATIVE,     // MeshFile below, holding only the mesh
+  MESH_FMT_NUM
+} MeshFormat;
+
+const char* mesh_format_to_cstr(MeshFormat fmt);
+// format named like mesh_format_to_cstr, MESH_FMT_NUM if unknown
+MeshFormat mesh_format_from_cstr(const char* name);
+// format for the extension of path (.vtk is binary, .gmb native), MESH_FMT_TEXT if unknown
+MeshFormat mesh_format_from_path(const char* path);
+
+// false if the file could not be written
+bool IMesh_write(const IMesh* msh, const char* path, MeshFormat fmt);
+bool IMesh_write_text(const IMesh* msh, const char* path);
+bool IMesh_write_vtk(const IMesh* msh, const char* path, bool binary);
+bool IMesh_write_vtu(const IMesh* msh, const char* path);
+bool IMesh_write_stl(const IMesh* msh, const char* path);
+
+/****************************************************
+ * MeshFile is the native format, which loads with
+ * mmap and no parsing. A fixed header (version, byte
+ * order, counts, bounding box, optional checksum) is
+ * followed by the arrays of the outline, the interior
+ * points, a linear qtree and an IMesh, each aligned to
+ * MESH_FILE_ALIGN bytes and in the byte order of the
+ * host that wrote them.
+ *
+ * A mapped file is made of views into the mapping. It
+ * is mapped copy on write, so processes mapping the
+ * same file share its pages until they modify them.
+ */
+#define MESH_FILE_VERSION 1
+#define MESH_FILE_ALIGN 64
+
+typedef struct {
+  PList outline;
+  PList points;
+  LQTree qtree; // empty if the file holds none
+  IMesh mesh;
+  V2 min; // bounding box of all points and vertices
+  V2 max;
+  void* map; // the mapping, NULL if nothing is mapped
+  size_t map_size;
+} MeshFile;
+
+// any of the parts may be NULL, the file is replaced atomically
+bool MeshFile_write(const char* path, const PList* outline, const PList* points,
+                    const LQTree* qtree, const IMesh* msh, bool checksum);
+// map path into file, verify checks the checksum if the file has one
+// (which reads all of the file). false if the file is not valid
+bool MeshFile_map(MeshFile* file, const char* path, bool verify);
+// free the parts of file and drop its mapping
+void MeshFile_unmap(MeshFile* file);
+
+#endif // MESH_IO_H
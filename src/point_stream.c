@@ -0,0 +1,304 @@
+#include "stdio.h"
+#include "stdint.h"
+#include "string.h"
+#include "strings.h"
+#include "math.h"
+#include "errno.h"
+#include "fcntl.h"
+#include "unistd.h"
+#include "assert.h"
+
+#include "point_stream.h"
+#include "v2batch.h"
+#include "logging.h"
+
+/****************************************************
+ * Float parsing
+ */
+// powers of ten that are exact in floats
+static const float exact_pow10[] = {
+  1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f,
+};
+#define MAX_EXACT_POW10 10
+#define MAX_EXACT_MANTISSA (1ull << 24)
+#define MAX_DIGITS 19 // significant digits that fit into the mantissa
+
+static inline bool is_digit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+static const char* parse_float_slow(const char* s, float* out) {
+  char* end;
+  *out = strtof(s, &end);
+  return end;
+}
+
+// parse the float at s, returns its end, s if there is none. Decimals whose
+// mantissa and power of ten are exact floats take one float multiply or
+// divide, which rounds only once. Everything else, like inf, nan or more
+// than 7 significant digits, goes to strtof
+static const char* parse_float(const char* s, float* out) {
+  const char* cur = s;
+  const bool neg = *cur == '-';
+  if (*cur == '-' || *cur == '+') cur++;
+  if (!is_digit(*cur) && !(*cur == '.' && is_digit(cur[1]))) {
+    const bool word = *cur == 'i' || *cur == 'I' || *cur == 'n' || *cur == 'N';
+    return word ? parse_float_slow(s, out) : s;
+  }
+
+  uint64_t mant = 0;
+  int digits = 0;
+  int exp10 = 0;
+  bool exact = true;
+  for (; is_digit(*cur); cur++) {
+    if (digits < MAX_DIGITS) {
+      mant = 10 * mant + (*cur - '0');
+      digits += mant > 0;
+    } else {
+      exact = false;
+    }
+  }
+  if (*cur == '.') {
+    for (cur++; is_digit(*cur); cur++) {
+      if (digits < MAX_DIGITS) {
+        mant = 10 * mant + (*cur - '0');
+        digits += mant > 0;
+        exp10--;
+      } else {
+        exact = false;
+      }
+    }
+  }
+  // an 'e' without digits is not part of the number
+  if ((*cur == 'e' || *cur == 'E')
+      && (is_digit(cur[1]) || ((cur[1] == '-' || cur[1] == '+') && is_digit(cur[2])))) {
+    cur++;
+    const bool exp_neg = *cur == '-';
+    if (*cur == '-' || *cur == '+') cur++;
+    int e = 0;
+    for (; is_digit(*cur); cur++) {
+      if (e < 10000) e = 10 * e + (*cur - '0');
+    }
+    exp10 += exp_neg ? -e : e;
+  }
+
+  if (!exact || mant > MAX_EXACT_MANTISSA || exp10 > MAX_EXACT_POW10 || exp10 < -MAX_EXACT_POW10) {
+    return parse_float_slow(s, out);
+  }
+  float v = (float)mant;
+  v = exp10 < 0 ? v / exact_pow10[-exp10] : v * exact_pow10[exp10];
+  *out = neg ? -v : v;
+  return cur;
+}
+
+static inline bool is_blank(char c) {
+  return c == ' ' || c == '\t';
+}
+
+// point of the line at s, *skip is set for empty lines and comments
+// false if the line holds no point
+static bool parse_line(const char* s, V2* p, bool* skip) {
+  while (is_blank(*s)) s++;
+  *skip = *s == '#' || *s == '\n' || *s == '\r' || *s == '\0';
+  if (*skip) return true;
+
+  const char* end = parse_float(s, &p->x);
+  if (end == s) return false;
+  s = end;
+  while (is_blank(*s) || *s == ',' || *s == ';') s++;
+  return parse_float(s, &p->y) != s;
+}
+
+/****************************************************
+ * Streams
+ */
+const char* point_format_to_cstr(PointFormat fmt) {
+  switch (fmt) {
+    case POINTS_TEXT:
+      return "text";
+    case POINTS_RAW:
+      return "raw";
+    default:
+      assert(false && "unknown point format");
+  }
+  return NULL;
+}
+
+PointFormat point_format_from_path(const char* path) {
+  const char* ext = strrchr(path, '.');
+  if (ext == NULL || strchr(ext, '/') != NULL) return POINTS_TEXT;
+  if (strcasecmp(ext, ".bin") == 0 || strcasecmp(ext, ".f32") == 0 || strcasecmp(ext, ".raw") == 0) {
+    return POINTS_RAW;
+  }
+  return POINTS_TEXT;
+}
+
+bool PointStream_open(PointStream* stream, const char* path, PointFormat fmt) {
+  *stream = (PointStream) {
+    .path = path,
+    .fmt = fmt,
+    .fd = open(path, O_RDONLY),
+    .buf = malloc(POINT_STREAM_CHUNK + 1),
+    .ok = true,
+  };
+  if (stream->fd < 0 || stream->buf == NULL) {
+    log_wrn("Could not open %s", path);
+    PointStream_close(stream);
+    return false;
+  }
+  posix_fadvise(stream->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  stream->buf[0] = '\0';
+  return true;
+}
+
+void PointStream_close(PointStream* stream) {
+  if (stream->fd >= 0) close(stream->fd);
+  free(stream->buf);
+  stream->fd = -1;
+  stream->buf = NULL;
+}
+
+bool PointStream_rewind(PointStream* stream) {
+  if (lseek(stream->fd, 0, SEEK_SET) != 0) {
+    log_wrn("Could not rewind %s", stream->path);
+    return stream->ok = false;
+  }
+  stream->begin = stream->end = 0;
+  stream->buf[0] = '\0';
+  stream->eof = false;
+  stream->ok = true;
+  stream->line = stream->bytes = stream->points = 0;
+  return true;
+}
+
+// move the bytes not parsed yet to the front and read up to a full chunk
+static bool stream_fill(PointStream* stream) {
+  const size_t left = stream->end - stream->begin;
+  memmove(stream->buf, &stream->buf[stream->begin], left);
+  stream->begin = 0;
+  stream->end = left;
+  while (stream->end < POINT_STREAM_CHUNK && !stream->eof) {
+    const ssize_t n = read(stream->fd, &stream->buf[stream->end], POINT_STREAM_CHUNK - stream->end);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      log_wrn("Could not read %s", stream->path);
+      return stream->ok = false;
+    }
+    stream->eof = n == 0;
+    stream->end += n;
+    stream->bytes += n;
+  }
+  stream->buf[stream->end] = '\0';
+  return true;
+}
+
+// room for n more points, growing like PList_push
+static bool reserve_more(PList* out, size_t n) {
+  const size_t cap = out->count + n;
+  if (cap <= out->cap) return true;
+  return PList_reserve(out, cap > 2 * out->cap ? cap : 2 * out->cap);
+}
+
+static size_t read_text(PointStream* stream, PList* out, size_t max) {
+  size_t appended = 0;
+  while (stream->ok && (max == 0 || appended < max)) {
+    char* line = &stream->buf[stream->begin];
+    char* nl = memchr(line, '\n', stream->end - stream->begin);
+    if (nl == NULL && !stream->eof) {
+      if (stream->begin == 0 && stream->end == POINT_STREAM_CHUNK) {
+        log_wrn("%s:%ld: line too long", stream->path, stream->line + 1);
+        stream->ok = false;
+      } else {
+        stream_fill(stream);
+      }
+      continue;
+    }
+    if (nl == NULL) {
+      // the last line may end without a newline
+      if (stream->begin == stream->end) break;
+      nl = &stream->buf[stream->end];
+    }
+
+    stream->line++;
+    V2 p;
+    bool skip;
+    if (!parse_line(line, &p, &skip)) {
+      log_wrn("%s:%ld: expected a point", stream->path, stream->line);
+      stream->ok = false;
+      break;
+    }
+    stream->begin = nl - stream->buf + (nl < &stream->buf[stream->end]);
+    if (skip) continue;
+    if (!PList_push(out, p.x, p.y)) {
+      log_wrn("Out of memory after %ld points of %s", stream->points + appended, stream->path);
+      stream->ok = false;
+      break;
+    }
+    appended++;
+  }
+  return appended;
+}
+
+static size_t read_raw(PointStream* stream, PList* out, size_t max) {
+  size_t appended = 0;
+  while (stream->ok && (max == 0 || appended < max)) {
+    size_t n = (stream->end - stream->begin) / sizeof(V2);
+    if (n == 0 && !stream->eof) {
+      stream_fill(stream);
+      continue;
+    }
+    if (n == 0) {
+      if (stream->begin != stream->end) {
+        log_wrn("%s: %ld bytes after the last point", stream->path, stream->end - stream->begin);
+        stream->ok = false;
+      }
+      break;
+    }
+    if (max > 0 && n > max - appended) n = max - appended;
+    if (!reserve_more(out, n)) {
+      log_wrn("Out of memory after %ld points of %s", stream->points + appended, stream->path);
+      stream->ok = false;
+      break;
+    }
+    memcpy(&out->points[out->count], &stream->buf[stream->begin], sizeof(V2) * n);
+    out->count += n;
+    stream->begin += sizeof(V2) * n;
+    appended += n;
+  }
+  return appended;
+}
+
+size_t PointStream_read(PointStream* stream, PList* out, size_t max) {
+  const size_t appended = stream->fmt == POINTS_RAW
+    ? read_raw(stream, out, max)
+    : read_text(stream, out, max);
+  stream->points += appended;
+  return appended;
+}
+
+bool PointStream_bounds(PointStream* stream, V2* min, V2* max) {
+  PList batch = PList_new(POINT_STREAM_BATCH);
+  bool any = false;
+  while (PointStream_read(stream, &batch, POINT_STREAM_BATCH) > 0) {
+    V2 bmin, bmax;
+    v2_bounds(batch.points, batch.count, &bmin, &bmax);
+    *min = any ? v2(fminf(min->x, bmin.x), fminf(min->y, bmin.y)) : bmin;
+    *max = any ? v2(fmaxf(max->x, bmax.x), fmaxf(max->y, bmax.y)) : bmax;
+    any = true;
+    batch.count = 0;
+  }
+  const bool ok = stream->ok;
+  PList_free(&batch);
+  return PointStream_rewind(stream) && ok && any;
+}
+
+size_t PointStream_insert(PointStream* stream, QTree* tree, size_t batch) {
+  PList points = PList_new(batch);
+  size_t inserted = 0;
+  while (PointStream_read(stream, &points, batch) > 0) {
+    inserted += qtree_insert_batch(tree, points.points, points.count);
+    points.count = 0;
+  }
+  PList_free(&points);
+  return inserted;
+}
@@ -0,0 +1,59 @@
+#ifndef POINT_STREAM_H
+#define POINT_STREAM_H
+#include "stdbool.h"
+#include "stdlib.h"
+
+#include "datastructs.h"
+#include "qtree.h"
+
+/****************************************************
+ * PointStream reads the points of a file in chunks of
+ * POINT_STREAM_CHUNK bytes, so its memory does not
+ * grow with the file. Text files hold one point per
+ * line, 'x y' or 'x,y' (further columns like z are
+ * skipped) and '#' starts a comment. Raw files are
+ * pairs of floats in the byte order of the host.
+ */
+#define POINT_STREAM_CHUNK (1 << 20)
+// points per batch when streaming into a qtree
+#define POINT_STREAM_BATCH 65536
+
+typedef enum {
+  POINTS_TEXT = 0,
+  POINTS_RAW,
+  POINTS_FMT_NUM
+} PointFormat;
+
+const char* point_format_to_cstr(PointFormat fmt);
+// .bin, .f32 and .raw are raw, anything else is text
+PointFormat point_format_from_path(const char* path);
+
+typedef struct {
+  const char* path;
+  PointFormat fmt;
+  int fd;
+  char* buf;    // POINT_STREAM_CHUNK bytes and a terminator
+  size_t begin; // buf[begin, end) is read but not parsed yet
+  size_t end;
+  bool eof;
+  bool ok;      // false after an error
+  size_t line;  // of text files, for messages
+  size_t bytes; // read so far
+  size_t points;
+} PointStream;
+
+bool PointStream_open(PointStream* stream, const char* path, PointFormat fmt);
+void PointStream_close(PointStream* stream);
+// start over at the beginning of the file
+bool PointStream_rewind(PointStream* stream);
+// append up to max points to out (max 0: all that are left), returns the
+// number appended. 0 at the end of the file and on errors, which clear ok
+size_t PointStream_read(PointStream* stream, PList* out, size_t max);
+// bounding box of the points left in stream, rewinds it afterwards
+// false if there are none or on errors
+bool PointStream_bounds(PointStream* stream, V2* min, V2* max);
+// insert the points left in stream into tree in batches of batch points,
+// only one batch is held at a time. returns the number of points inserted
+size_t PointStream_insert(PointStream* stream, QTree* tree, size_t batch);
+
+#endif // POINT_STREAM_H
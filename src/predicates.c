@@ -0,0 +1,259 @@
+#include "string.h"
+#include "math.h"
+#include "stdbool.h"
+
+#include "predicates.h"
+#include "instrument.h"
+
+#ifdef __FAST_MATH__
+#error "the predicates need IEEE rounding, build without -ffast-math"
+#endif
+
+static _Thread_local PredicateStats stats;
+
+PredicateStats predicate_stats(void) {
+  return stats;
+}
+
+void predicate_stats_reset(void) {
+  stats = (PredicateStats) {0};
+}
+
+/****************************************************
+ * Expansion arithmetic. An expansion is a sum of
+ * doubles ordered by increasing magnitude, whose bits
+ * do not overlap. The last (largest) component has
+ * the sign of the whole sum.
+ */
+// x + y = a + b exactly, |a| >= |b|
+static inline void fast_two_sum(double a, double b, double* x, double* y) {
+  *x = a + b;
+  *y = b - (*x - a);
+}
+
+// x + y = a + b exactly
+static inline void two_sum(double a, double b, double* x, double* y) {
+  *x = a + b;
+  const double bv = *x - a;
+  const double av = *x - bv;
+  *y = (a - av) + (b - bv);
+}
+
+// x + y = a * b exactly
+static inline void two_product(double a, double b, double* x, double* y) {
+  *x = a * b;
+#ifdef __FMA__
+  *y = fma(a, b, -*x);
+#else
+  // Dekker's product, safe as the compiler has no fma to contract it into
+  const double splitter = 134217729.0; // 2^27 + 1
+  const double ca = splitter * a, cb = splitter * b;
+  const double ahi = ca - (ca - a), alo = a - ahi;
+  const double bhi = cb - (cb - b), blo = b - bhi;
+  *y = alo * blo - (((*x - ahi * bhi) - alo * bhi) - ahi * blo);
+#endif
+}
+
+// a - b as an expansion of two components
+static inline void two_diff(double a, double b, double e[2]) {
+  const double x = a - b;
+  const double bv = a - x;
+  const double av = x + bv;
+  e[0] = (a - av) + (bv - b);
+  e[1] = x;
+}
+
+static inline double next_component(const double* e, int len, int* i) {
+  return ++*i < len ? e[*i] : 0;
+}
+
+// h = e + f, returns the number of components of h (at most elen + flen)
+static int expansion_sum(int elen, const double* e, int flen, const double* f, double* h) {
+  int ei = 0, fi = 0, hi = 0;
+  double enow = e[0], fnow = f[0];
+  double q, qnew, hh;
+  if ((fnow > enow) == (fnow > -enow)) {
+    q = enow;
+    enow = next_component(e, elen, &ei);
+  } else {
+    q = fnow;
+    fnow = next_component(f, flen, &fi);
+  }
+  if (ei < elen && fi < flen) {
+    if ((fnow > enow) == (fnow > -enow)) {
+      fast_two_sum(enow, q, &qnew, &hh);
+      enow = next_component(e, elen, &ei);
+    } else {
+      fast_two_sum(fnow, q, &qnew, &hh);
+      fnow = next_component(f, flen, &fi);
+    }
+    q = qnew;
+    if (hh != 0) h[hi++] = hh;
+    while (ei < elen && fi < flen) {
+      if ((fnow > enow) == (fnow > -enow)) {
+        two_sum(q, enow, &qnew, &hh);
+        enow = next_component(e, elen, &ei);
+      } else {
+        two_sum(q, fnow, &qnew, &hh);
+        fnow = next_component(f, flen, &fi);
+      }
+      q = qnew;
+      if (hh != 0) h[hi++] = hh;
+    }
+  }
+  for (; ei < elen; enow = next_component(e, elen, &ei)) {
+    two_sum(q, enow, &qnew, &hh);
+    q = qnew;
+    if (hh != 0) h[hi++] = hh;
+  }
+  for (; fi < flen; fnow = next_component(f, flen, &fi)) {
+    two_sum(q, fnow, &qnew, &hh);
+    q = qnew;
+    if (hh != 0) h[hi++] = hh;
+  }
+  if (q != 0 || hi == 0) h[hi++] = q;
+  return hi;
+}
+
+// h = e * b, returns the number of components of h (at most 2 * elen)
+static int expansion_scale(int elen, const double* e, double b, double* h) {
+  int hi = 0;
+  double q, hh, sum, p1, p0;
+  two_product(e[0], b, &q, &hh);
+  if (hh != 0) h[hi++] = hh;
+  for (int i = 1; i < elen; i++) {
+    two_product(e[i], b, &p1, &p0);
+    two_sum(q, p0, &sum, &hh);
+    if (hh != 0) h[hi++] = hh;
+    fast_two_sum(p1, sum, &q, &hh);
+    if (hh != 0) h[hi++] = hh;
+  }
+  if (q != 0 || hi == 0) h[hi++] = q;
+  return hi;
+}
+
+// the largest expansions of the exact incircle
+#define MUL_MAX 16
+#define TERM_MAX (2 * MUL_MAX * MUL_MAX)
+
+// h = e * f with elen, flen <= MUL_MAX, returns the number of components of h
+static int expansion_mul(int elen, const double* e, int flen, const double* f, double* h) {
+  double scaled[2 * MUL_MAX];
+  double sum[TERM_MAX];
+  int hlen = expansion_scale(elen, e, f[0], h);
+  for (int i = 1; i < flen; i++) {
+    const int slen = expansion_scale(elen, e, f[i], scaled);
+    const int len = expansion_sum(hlen, h, slen, scaled, sum);
+    memcpy(h, sum, sizeof(double) * len);
+    hlen = len;
+  }
+  return hlen;
+}
+
+static inline void negate(int elen, double* e) {
+  for (int i = 0; i < elen; i++) {
+    e[i] = -e[i];
+  }
+}
+
+/****************************************************
+ * Exact paths
+ */
+double orient2d_exact(V2 a, V2 b, V2 c) {
+  stats.orient2d_exact++;
+  INSTR_COUNT(CTR_ORIENT2D_EXACT, 1);
+  // ax * by - ax * cy + bx * cy - bx * ay + cx * ay - cx * by
+  double p[6][2];
+  two_product(a.x, b.y, &p[0][1], &p[0][0]);
+  two_product(-(double)a.x, c.y, &p[1][1], &p[1][0]);
+  two_product(b.x, c.y, &p[2][1], &p[2][0]);
+  two_product(-(double)b.x, a.y, &p[3][1], &p[3][0]);
+  two_product(c.x, a.y, &p[4][1], &p[4][0]);
+  two_product(-(double)c.x, b.y, &p[5][1], &p[5][0]);
+
+  double u[4], v[4], w[8], x[4], det[12];
+  const int ulen = expansion_sum(2, p[0], 2, p[1], u);
+  const int vlen = expansion_sum(2, p[2], 2, p[3], v);
+  const int wlen = expansion_sum(ulen, u, vlen, v, w);
+  const int xlen = expansion_sum(2, p[4], 2, p[5], x);
+  const int len = expansion_sum(wlen, w, xlen, x, det);
+  return det[len - 1];
+}
+
+// a - b, of one component if the difference is exact in doubles (the usual case)
+typedef struct {
+  double e[2];
+  int len;
+} Diff;
+
+static inline Diff diff(double a, double b) {
+  Diff d;
+  two_diff(a, b, d.e);
+  if (d.e[0] == 0) {
+    d.e[0] = d.e[1];
+    d.len = 1;
+  } else {
+    d.len = 2;
+  }
+  return d;
+}
+
+// lift of d times the 2x2 determinant of b and c, all coordinates relative to the 4th point
+static int incircle_term(const Diff d[2], const Diff b[2], const Diff c[2], double* out) {
+  double sq_x[8], sq_y[8], lift[MUL_MAX];
+  const int sxlen = expansion_mul(d[0].len, d[0].e, d[0].len, d[0].e, sq_x);
+  const int sylen = expansion_mul(d[1].len, d[1].e, d[1].len, d[1].e, sq_y);
+  const int liftlen = expansion_sum(sxlen, sq_x, sylen, sq_y, lift);
+
+  double bc[8], cb[8], det[MUL_MAX];
+  const int bclen = expansion_mul(b[0].len, b[0].e, c[1].len, c[1].e, bc);
+  const int cblen = expansion_mul(c[0].len, c[0].e, b[1].len, b[1].e, cb);
+  negate(cblen, cb);
+  const int detlen = expansion_sum(bclen, bc, cblen, cb, det);
+
+  return expansion_mul(liftlen, lift, detlen, det, out);
+}
+
+// incircle_term for exact differences, scaling the determinant by them saves
+// the general products
+static int incircle_term_exact_diffs(const Diff d[2], const Diff b[2], const Diff c[2],
+                                     double* out) {
+  double bc[2], cb[2], det[4];
+  two_product(b[0].e[0], c[1].e[0], &bc[1], &bc[0]);
+  two_product(-c[0].e[0], b[1].e[0], &cb[1], &cb[0]);
+  const int detlen = expansion_sum(2, bc, 2, cb, det);
+
+  double x[8], xx[16], y[8], yy[16];
+  const int xlen = expansion_scale(detlen, det, d[0].e[0], x);
+  const int xxlen = expansion_scale(xlen, x, d[0].e[0], xx);
+  const int ylen = expansion_scale(detlen, det, d[1].e[0], y);
+  const int yylen = expansion_scale(ylen, y, d[1].e[0], yy);
+  return expansion_sum(xxlen, xx, yylen, yy, out);
+}
+
+double incircle_exact(V2 a, V2 b, V2 c, V2 d) {
+  stats.incircle_exact++;
+  INSTR_COUNT(CTR_INCIRCLE_EXACT, 1);
+  const Diff ad[2] = {diff(a.x, d.x), diff(a.y, d.y)};
+  const Diff bd[2] = {diff(b.x, d.x), diff(b.y, d.y)};
+  const Diff cd[2] = {diff(c.x, d.x), diff(c.y, d.y)};
+  const bool exact_diffs = ad[0].len + ad[1].len + bd[0].len + bd[1].len
+                         + cd[0].len + cd[1].len == 6;
+
+  double at[TERM_MAX], bt[TERM_MAX], ct[TERM_MAX];
+  int alen, blen, clen;
+  if (exact_diffs) {
+    alen = incircle_term_exact_diffs(ad, bd, cd, at);
+    blen = incircle_term_exact_diffs(bd, cd, ad, bt);
+    clen = incircle_term_exact_diffs(cd, ad, bd, ct);
+  } else {
+    alen = incircle_term(ad, bd, cd, at);
+    blen = incircle_term(bd, cd, ad, bt);
+    clen = incircle_term(cd, ad, bd, ct);
+  }
+
+  double ab[2 * TERM_MAX], det[3 * TERM_MAX];
+  const int ablen = expansion_sum(alen, at, blen, bt, ab);
+  const int len = expansion_sum(ablen, ab, clen, ct, det);
+  return det[len - 1];
+}
@@ -0,0 +1,74 @@
+#ifndef PREDICATES_H
+#define PREDICATES_H
+#include "stdint.h"
+#include "math.h"
+
+#include "datastructs.h"
+
+/****************************************************
+ * Adaptive geometric predicates after Shewchuk. The
+ * determinant is evaluated in doubles first and only
+ * recomputed exactly (floating point expansions) if
+ * it is too close to 0 to trust its sign. The sign of
+ * the result is always exact, its value is only an
+ * approximation of the determinant. The double filters
+ * are inlined, the exact paths are not.
+ */
+
+// bounds on the rounding error of the double evaluations, relative to their permanents
+#define PREDICATE_EPS 0x1p-53
+#define ORIENT_ERRBOUND ((3.0 + 16.0 * PREDICATE_EPS) * PREDICATE_EPS)
+#define INCIRCLE_ERRBOUND ((10.0 + 96.0 * PREDICATE_EPS) * PREDICATE_EPS)
+
+// exact paths of the predicates below
+double orient2d_exact(V2 a, V2 b, V2 c);
+double incircle_exact(V2 a, V2 b, V2 c, V2 d);
+
+// number of times the exact paths ran
+typedef struct {
+  uint64_t orient2d_exact;
+  uint64_t incircle_exact;
+} PredicateStats;
+
+// counters of the calling thread, CTR_ORIENT2D_EXACT and CTR_INCIRCLE_EXACT
+// of instrument.h count all threads once enabled
+PredicateStats predicate_stats(void);
+void predicate_stats_reset(void);
+
+// > 0 if a, b, c are counter clockwise, < 0 if clockwise, 0 if collinear
+static inline double orient2d(V2 a, V2 b, V2 c) {
+  const double detleft = ((double)a.x - c.x) * ((double)b.y - c.y);
+  const double detright = ((double)a.y - c.y) * ((double)b.x - c.x);
+  const double det = detleft - detright;
+  // without branches on the signs, which are hard to predict while walking
+  const double errbound = ORIENT_ERRBOUND * (fabs(detleft) + fabs(detright));
+  if (fabs(det) >= errbound) return det;
+  return orient2d_exact(a, b, c);
+}
+
+// > 0 if d is inside the circumcircle of the counter clockwise triangle a, b, c
+// < 0 if outside, 0 if the four points are cocircular
+static inline double incircle(V2 a, V2 b, V2 c, V2 d) {
+  const double adx = (double)a.x - d.x, ady = (double)a.y - d.y;
+  const double bdx = (double)b.x - d.x, bdy = (double)b.y - d.y;
+  const double cdx = (double)c.x - d.x, cdy = (double)c.y - d.y;
+
+  const double bdxcdy = bdx * cdy, cdxbdy = cdx * bdy;
+  const double cdxady = cdx * ady, adxcdy = adx * cdy;
+  const double adxbdy = adx * bdy, bdxady = bdx * ady;
+  const double alift = adx * adx + ady * ady;
+  const double blift = bdx * bdx + bdy * bdy;
+  const double clift = cdx * cdx + cdy * cdy;
+
+  const double det = alift * (bdxcdy - cdxbdy)
+                   + blift * (cdxady - adxcdy)
+                   + clift * (adxbdy - bdxady);
+  const double permanent = (fabs(bdxcdy) + fabs(cdxbdy)) * alift
+                         + (fabs(cdxady) + fabs(adxcdy)) * blift
+                         + (fabs(adxbdy) + fabs(bdxady)) * clift;
+  const double errbound = INCIRCLE_ERRBOUND * permanent;
+  if (fabs(det) > errbound) return det;
+  return incircle_exact(a, b, c, d);
+}
+
+#endif // PREDICATES_H
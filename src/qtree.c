@@ -1,14 +1,23 @@
 #include "stdio.h"
+#include "string.h"
+#include "math.h"
+#include "stdint.h"
+#include "stdatomic.h"
+#include "pthread.h"
+#include "unistd.h"
 #include "qtree.h"
+#include "v2batch.h"
 #include "assert.h"
 
 #include "logging.h"
+#include "instrument.h"
 
 Node node_new(V2 pos, NodeType type, float w, float h) {
   return (Node) {
     .pos = pos,
     .type = type, 
     .w = w, .h = h,
+    .count = 0,
     .children = NULL,
   };
 }
@@ -36,11 +45,18 @@ void _qtree_traverse_node(FILE* f, Node* node) { // counter clockwise starting a
     }
   }
 
-  if (node->type == NODE_LEAF || node->type == NODE_EMPTY) {
+  if (node->type == NODE_EMPTY) {
     fprintf(f, "%s at %.2f %.2f with dimensions %.2f, %.2f\n",
            node_type_to_cstr(node->type),
            node->pos.x, node->pos.y, node->w, node->h);
   }
+  if (node->type == NODE_LEAF) {
+    for (uint32_t i = 0; i < node->count; i++) {
+      fprintf(f, "%s at %.2f %.2f with dimensions %.2f, %.2f\n",
+             node_type_to_cstr(node->type),
+             node->points[i].x, node->points[i].y, node->w, node->h);
+    }
+  }
 }
 
 size_t _qtree_count_leaves(Node* node, size_t cur) {
@@ -61,26 +77,154 @@ size_t _qtree_count_leaves(Node* node, size_t cur) {
   }
 }
 
+size_t qtree_count_points(Node* node) {
+  size_t tmp = 0;
+  switch (node->type) {
+  case NODE_EMPTY:
+    return 0;
+  case NODE_LEAF:
+    return node->count;
+  case NODE_BRANCH ... NODE_ROOT:
+    if (node->children == NULL) {
+      return 0;
+    }
+    for (int rpos = RELPOS_UR; rpos < RELPOS_NUM; rpos++) {
+      tmp += qtree_count_points(&node->children[rpos]);
+    }
+    return tmp;
+  }
+}
 
-void qtree_free(Node* node) {
-  if (node->type == NODE_BRANCH || node->type == NODE_ROOT) {
-    if (node->children != NULL) {
-      for (int rpos = RELPOS_UR; rpos < RELPOS_NUM; rpos++) {
-        qtree_free(&node->children[rpos]);
+size_t qtree_max_depth(Node* node) {
+  size_t max = 0;
+  if ((node->type == NODE_BRANCH || node->type == NODE_ROOT) && node->children != NULL) {
+    for (int rpos = RELPOS_UR; rpos < RELPOS_NUM; rpos++) {
+      size_t depth = 1 + qtree_max_depth(&node->children[rpos]);
+      if (depth > max) max = depth;
+    }
+  }
+  return max;
+}
+
+
+struct NodeChunk_t {
+  NodeChunk *next;
+  size_t used; // blocks handed out from this chunk
+  Node nodes[4 * QTREE_ARENA_CHUNK_BLOCKS];
+};
+
+NodeArena node_arena_new(void) {
+  return (NodeArena) {
+    .chunks = NULL,
+    .chunks_tail = NULL,
+    .spare = NULL,
+    .free_blocks = NULL,
+    .n_blocks = 0,
+  };
+}
+
+Node* node_arena_alloc(NodeArena* arena) {
+  INSTR_COUNT(CTR_NODES, RELPOS_NUM);
+  arena->n_blocks++;
+  if (arena->free_blocks != NULL) {
+    Node* block = arena->free_blocks;
+    arena->free_blocks = block[0].children;
+    return block;
+  }
+
+  NodeChunk* chunk = arena->chunks;
+  if (chunk == NULL || chunk->used >= QTREE_ARENA_CHUNK_BLOCKS) {
+    if (arena->spare != NULL) {
+      chunk = arena->spare;
+      arena->spare = chunk->next;
+    } else {
+      chunk = (NodeChunk*) malloc(sizeof(NodeChunk));
+      if (chunk == NULL) {
+        assert(false && "out of memory while allocating qtree nodes");
       }
     }
+    chunk->used = 0;
+    chunk->next = arena->chunks;
+    if (arena->chunks == NULL) {
+      arena->chunks_tail = chunk;
+    }
+    arena->chunks = chunk;
+  }
+
+  return &chunk->nodes[4 * chunk->used++];
+}
+
+void node_arena_release(NodeArena* arena, Node* block) {
+  block[0].children = arena->free_blocks;
+  arena->free_blocks = block;
+  arena->n_blocks--;
+}
+
+void node_arena_reset(NodeArena* arena) {
+  if (arena->chunks != NULL) {
+    arena->chunks_tail->next = arena->spare;
+    arena->spare = arena->chunks;
   }
-  node_free(node);
+  arena->chunks = NULL;
+  arena->chunks_tail = NULL;
+  arena->free_blocks = NULL;
+  arena->n_blocks = 0;
 }
 
-void node_free(Node* node) {
-  if (node->children != NULL) {
-    free(node->children);
+void node_arena_free(NodeArena* arena) {
+  node_arena_reset(arena);
+  while (arena->spare != NULL) {
+    NodeChunk* next = arena->spare->next;
+    free(arena->spare);
+    arena->spare = next;
   }
 }
 
-void insert_children(Node* node) {
-  node->children = (Node*) malloc(4 * sizeof(Node));
+void node_arena_merge(NodeArena* dst, NodeArena* src) {
+  if (src->chunks != NULL) {
+    if (dst->chunks == NULL) {
+      dst->chunks = src->chunks;
+    } else {
+      dst->chunks_tail->next = src->chunks;
+    }
+    dst->chunks_tail = src->chunks_tail;
+  }
+  if (src->spare != NULL) {
+    NodeChunk* last = src->spare;
+    while (last->next != NULL) last = last->next;
+    last->next = dst->spare;
+    dst->spare = src->spare;
+  }
+  if (src->free_blocks != NULL) {
+    Node* last = src->free_blocks;
+    while (last[0].children != NULL) last = last[0].children;
+    last[0].children = dst->free_blocks;
+    dst->free_blocks = src->free_blocks;
+  }
+  dst->n_blocks += src->n_blocks;
+  *src = node_arena_new();
+}
+
+QTree qtree_new(V2 pos, float w, float h) {
+  return (QTree) {
+    .root = node_new(pos, NODE_ROOT, w, h),
+    .arena = node_arena_new(),
+  };
+}
+
+void qtree_reset(QTree* tree) {
+  node_arena_reset(&tree->arena);
+  tree->root.children = NULL;
+}
+
+void qtree_free(QTree* tree) {
+  node_arena_free(&tree->arena);
+  tree->root.children = NULL;
+}
+
+void insert_children(NodeArena* arena, Node* node) {
+  INSTR_COUNT(CTR_SPLITS, 1);
+  node->children = node_arena_alloc(arena);
   for (size_t rpos = RELPOS_UR; rpos < RELPOS_NUM; rpos++) {
     node->children[rpos] = node_new(
       gen_pos_parent(node, rpos),
@@ -90,8 +234,26 @@ void insert_children(Node* node) {
   }
 }
 
-bool _qtree_insert(Node *ins_node, V2 point, size_t depth) {
-  log_msg("Insert (%.2f, %.2f) into tree at (%.2f, %.2f) (%s) with depth %ld", 
+static bool leaf_contains(const Node* leaf, V2 point) {
+  for (uint32_t i = 0; i < leaf->count; i++) {
+    if (v2_eq(leaf->points[i], point)) return true;
+  }
+  return false;
+}
+
+// turn an empty node into a leaf, or append to a leaf with space left
+static void leaf_add(Node* node, V2 point) {
+  if (node->type == NODE_EMPTY) {
+    node->type = NODE_LEAF;
+    node->pos = point;
+    node->count = 0;
+  }
+  node->points[node->count++] = point;
+}
+
+// trace logs every step, batches only count what they could not insert
+static bool qtree_insert_node(QTree *tree, Node *ins_node, V2 point, size_t depth, bool trace) {
+  if (trace) log_msg("Insert (%.2f, %.2f) into tree at (%.2f, %.2f) (%s) with depth %ld", 
           P_COORDS(point), P_COORDS(ins_node->pos),
           relpos_to_cstr(relative_pos(&ins_node->pos, &point)),
           depth);
@@ -103,9 +265,11 @@ bool _qtree_insert(Node *ins_node, V2 point, size_t depth) {
     || (point.y < cur_node->pos.y - cur_node->h / 2)) {
     // Node out of bounds
 
-    log_msg("Node at (%.2f, %.2f) out of bounds", point.x, point.y);
-    log_msg("For parent at (%.2f, %.2f) with dims (%.2f, %.2f)!",
-        cur_node->pos.x, cur_node->pos.y, cur_node->w, cur_node->h);
+    if (trace) {
+      log_msg("Node at (%.2f, %.2f) out of bounds", point.x, point.y);
+      log_msg("For parent at (%.2f, %.2f) with dims (%.2f, %.2f)!",
+          cur_node->pos.x, cur_node->pos.y, cur_node->w, cur_node->h);
+    }
     return false;
   }
 
@@ -115,12 +279,12 @@ bool _qtree_insert(Node *ins_node, V2 point, size_t depth) {
       if (cur_node->type == NODE_BRANCH) {
         assert(false && "Node type cannot be branch and have NULL as children");
       }
-      log_msg("Inserting children (At root)");
-      insert_children(cur_node);
+      if (trace) log_msg("Inserting children (At root)");
+      insert_children(&tree->arena, cur_node);
     }
 
     RelPos rpos = relative_pos(&cur_node->pos, &point);
-    log_msg("Point at (%.2f, %.2f) is %s of %s at (%.2f, %.2f)",
+    if (trace) log_msg("Point at (%.2f, %.2f) is %s of %s at (%.2f, %.2f)",
             P_COORDS(point),
             relpos_to_cstr(rpos),
             node_type_to_cstr(cur_node->type),
@@ -137,77 +301,792 @@ bool _qtree_insert(Node *ins_node, V2 point, size_t depth) {
       if (!(parent->type == NODE_BRANCH || parent->type == NODE_ROOT)) {
         assert(false && "Must be child of branch");
       }
-      cur_node->type = NODE_LEAF;
-      cur_node->pos = point;
+      leaf_add(cur_node, point);
+      INSTR_MAX(CTR_MAX_DEPTH, depth);
       return true;
   } else if (cur_node->type == NODE_LEAF) { // data at node
-    // insert point as new leaf
-    if (v2_eq(cur_node->pos, point)) {
-      log_wrn("IGNORING NODE AT (%.2f, %.2f)", P_COORDS(point));
+    if (leaf_contains(cur_node, point)) {
+      if (trace) log_wrn("IGNORING NODE AT (%.2f, %.2f)", P_COORDS(point));
       return false;
     }
+    if (cur_node->count < QTREE_LEAF_CAP) {
+      leaf_add(cur_node, point);
+      INSTR_MAX(CTR_MAX_DEPTH, depth);
+      return true;
+    }
+    if (depth >= QTREE_MAX_DEPTH) {
+      if (trace) log_wrn("IGNORING NODE AT (%.2f, %.2f), maximum depth reached", P_COORDS(point));
+      return false;
+    }
+
+    // insert point as new leaf
     cur_node->type = NODE_BRANCH;
     cur_node->w = parent->w / 2;
     cur_node->h = parent->h / 2;
 
-    // this position will one of the children's position
-    // the other one will be point
-    const V2 prev_node_pos = cur_node->pos;
+    // these points move to the children, point is inserted afterwards
+    V2 prev_points[QTREE_LEAF_CAP];
+    const uint32_t n_prev = cur_node->count;
+    memcpy(prev_points, cur_node->points, sizeof(V2) * n_prev);
 
     // insert current node as new leaf
     const RelPos cur_node_direction = relative_pos(&parent->pos, &cur_node->pos);
     cur_node->pos = gen_pos_parent(parent, cur_node_direction);
+    cur_node->count = 0;
 
-    if (cur_node->children != NULL) {
-      assert(false && "This node should not have children yet");
-    }
     // Initialize children at default empty position
-    insert_children(cur_node);
-    
-    // insert node of current position
-    const RelPos prev_node_rpos = relative_pos(&cur_node->pos, &prev_node_pos);
-    cur_node->children[prev_node_rpos].pos = prev_node_pos;
-    cur_node->children[prev_node_rpos].type = NODE_LEAF;
-
-    return _qtree_insert(cur_node, point, depth++);
+    insert_children(&tree->arena, cur_node);
+
+    // insert previous points of the leaf
+    for (uint32_t i = 0; i < n_prev; i++) {
+      const RelPos prev_rpos = relative_pos(&cur_node->pos, &prev_points[i]);
+      leaf_add(&cur_node->children[prev_rpos], prev_points[i]);
+    }
+
+    return qtree_insert_node(tree, cur_node, point, depth, trace);
   } else {
     assert(false && "unreachable, other types handled before");
   }
 }
 
-// TODO: find_closest is broken
-Node* qtree_find_closest(Node* root, V2* point) {
+bool _qtree_insert(QTree *tree, Node *ins_node, V2 point, size_t depth) {
+  INSTR_SCOPE("qtree_insert");
+  return qtree_insert_node(tree, ins_node, point, depth, true);
+}
+
+typedef struct {
+  uint64_t key;
+  V2 point;
+} KeyedPoint;
+
+static int keyed_point_cmp(const void* a, const void* b) {
+  const uint64_t ka = ((const KeyedPoint*)a)->key, kb = ((const KeyedPoint*)b)->key;
+  return (ka > kb) - (ka < kb);
+}
+
+size_t qtree_insert_batch(QTree* tree, const V2* points, size_t n) {
+  INSTR_SCOPE("qtree_insert_batch");
+  size_t inserted = 0;
+  // in z-order, successive points take mostly the same path down the tree
+  // without memory for sorting, they are inserted as they are
+  KeyedPoint* keyed = malloc(sizeof(KeyedPoint) * n);
+  if (keyed != NULL) {
+    const Node* root = &tree->root;
+    for (size_t i = 0; i < n; i++) {
+      keyed[i] = (KeyedPoint) {morton_key(points[i], root->pos, root->w, root->h), points[i]};
+    }
+    qsort(keyed, n, sizeof(KeyedPoint), keyed_point_cmp);
+  }
+  for (size_t i = 0; i < n; i++) {
+    const V2 point = keyed != NULL ? keyed[i].point : points[i];
+    inserted += qtree_insert_node(tree, &tree->root, point, 0, false);
+  }
+  free(keyed);
+  if (inserted < n) {
+    log_wrn("Ignored %ld of %ld points (duplicates, out of bounds or too deep)", n - inserted, n);
+  }
+  return inserted;
+}
+
+static bool qtree_in_bounds(const Node* root, V2 point) {
+  return !((point.x > root->pos.x + root->w / 2)
+        || (point.x < root->pos.x - root->w / 2)
+        || (point.y > root->pos.y + root->h / 2)
+        || (point.y < root->pos.y - root->h / 2));
+}
+
+// collect up to max distinct points of pts into out
+// returns the number of distinct points, or max + 1 if there are more
+static size_t distinct_points(const V2* pts, size_t n, V2* out, size_t max) {
+  size_t n_out = 0;
+  for (size_t i = 0; i < n; i++) {
+    bool seen = false;
+    for (size_t j = 0; j < n_out && !seen; j++) {
+      seen = v2_eq(out[j], pts[i]);
+    }
+    if (seen) continue;
+    if (n_out == max) return max + 1;
+    out[n_out++] = pts[i];
+  }
+  return n_out;
+}
+
+// sort pts into the quadrants of node at out, start and count are indexed by RelPos
+// rpos is scratch space for one relative position per point
+static void partition_quadrants(const Node* node, const V2* pts, V2* out, uint8_t* rpos, size_t n,
+                                size_t start[RELPOS_NUM], size_t count[RELPOS_NUM]) {
+  relative_pos_batch(pts, n, node->pos, rpos);
+  memset(count, 0, sizeof(size_t) * RELPOS_NUM);
+  for (size_t i = 0; i < n; i++) {
+    count[rpos[i]]++;
+  }
+  size_t next[RELPOS_NUM];
+  for (size_t q = RELPOS_UR, at = 0; q < RELPOS_NUM; at += count[q], q++) {
+    start[q] = next[q] = at;
+  }
+  for (size_t i = 0; i < n; i++) {
+    out[next[rpos[i]]++] = pts[i];
+  }
+}
+
+typedef struct {
+  Node* node; // branch without children yet
+  V2* pts;
+  V2* tmp; // scratch space like pts
+  uint8_t* rpos;
+  size_t n;
+  size_t depth; // of node
+} BuildTask;
+
+typedef struct {
+  NodeArena* arena;
+  size_t split_depth; // below this depth, branches are recorded as tasks
+  BuildTask* tasks;
+  size_t n_tasks;
+} BuildCtx;
+
+// node is a branch or root with freshly inserted (empty) children
+// the points are sorted from pts to tmp, which swap roles for the children
+static void qtree_build_node(BuildCtx* ctx, Node* node, V2* pts, V2* tmp, uint8_t* rpos, size_t n,
+                             size_t depth) {
+  size_t start[RELPOS_NUM];
+  size_t count[RELPOS_NUM];
+  partition_quadrants(node, pts, tmp, rpos, n, start, count);
+
+  for (int q = RELPOS_UR; q < RELPOS_NUM; q++) {
+    Node* child = &node->children[q];
+    V2* child_pts = &tmp[start[q]];
+    V2* child_tmp = &pts[start[q]];
+    if (count[q] == 0) {
+      continue;
+    }
+    // duplicates are dropped, like repeated qtree_insert calls do
+    V2 distinct[QTREE_LEAF_CAP];
+    size_t n_distinct = distinct_points(child_pts, count[q], distinct, QTREE_LEAF_CAP);
+    if (n_distinct > QTREE_LEAF_CAP && depth + 1 >= QTREE_MAX_DEPTH) {
+      log_wrn("Dropping points at (%.2f, %.2f), maximum depth reached", P_COORDS(child->pos));
+      n_distinct = QTREE_LEAF_CAP;
+    }
+    if (n_distinct <= QTREE_LEAF_CAP) {
+      for (size_t i = 0; i < n_distinct; i++) {
+        leaf_add(child, distinct[i]);
+      }
+      INSTR_MAX(CTR_MAX_DEPTH, depth + 1);
+      continue;
+    }
+    child->type = NODE_BRANCH;
+    if (depth + 1 >= ctx->split_depth) {
+      ctx->tasks[ctx->n_tasks++] = (BuildTask) {
+        child, child_pts, child_tmp, &rpos[start[q]], count[q], depth + 1
+      };
+      continue;
+    }
+    insert_children(ctx->arena, child);
+    qtree_build_node(ctx, child, child_pts, child_tmp, &rpos[start[q]], count[q], depth + 1);
+  }
+}
+
+// copy the points of all lists inside of root to a new array
+// *out is NULL if there is no memory for it
+static size_t qtree_collect_points(const Node* root, size_t n_lists, const PList* lists[],
+                                   V2** out, size_t* total) {
+  *total = 0;
+  for (size_t i = 0; i < n_lists; i++) {
+    *total += lists[i]->count;
+  }
+  V2* pts = malloc(sizeof(V2) * (*total > 0 ? *total : 1));
+  *out = pts;
+  if (pts == NULL) return 0;
+  size_t n = 0;
+  for (size_t i = 0; i < n_lists; i++) {
+    for (size_t j = 0; j < lists[i]->count; j++) {
+      if (qtree_in_bounds(root, lists[i]->points[j])) {
+        pts[n++] = lists[i]->points[j];
+      }
+    }
+  }
+  return n;
+}
+
+size_t qtree_build(QTree* tree, size_t n_lists, const PList* lists[]) {
+  INSTR_SCOPE("qtree_build");
+  qtree_reset(tree);
+
+  V2* pts;
+  size_t total;
+  size_t n = qtree_collect_points(&tree->root, n_lists, lists, &pts, &total);
+  if (pts == NULL) {
+    log_wrn("Could not allocate the points of the qtree build");
+    return 0;
+  }
+  if (n > 0) {
+    BuildCtx ctx = {.arena = &tree->arena, .split_depth = SIZE_MAX};
+    V2* tmp = malloc(sizeof(V2) * n);
+    uint8_t* rpos = malloc(n);
+    if (tmp == NULL || rpos == NULL) {
+      log_wrn("Could not allocate the scratch space of the qtree build");
+      free(rpos);
+      free(tmp);
+      free(pts);
+      return 0;
+    }
+    insert_children(&tree->arena, &tree->root);
+    qtree_build_node(&ctx, &tree->root, pts, tmp, rpos, n, 0);
+    free(rpos);
+    free(tmp);
+  }
+  free(pts);
+
+  log_msg("Built qtree from %ld of %ld points", n, total);
+  return n;
+}
+
+typedef struct {
+  BuildTask* tasks;
+  size_t n_tasks;
+  atomic_size_t next;
+} BuildQueue;
+
+typedef struct {
+  BuildQueue* queue;
+  NodeArena arena; // every worker allocates from its own arena
+} BuildWorker;
+
+static void* qtree_build_worker(void* arg) {
+  BuildWorker* worker = arg;
+  BuildQueue* queue = worker->queue;
+  BuildCtx ctx = {.arena = &worker->arena, .split_depth = SIZE_MAX};
+
+  for (;;) {
+    size_t i = atomic_fetch_add(&queue->next, 1);
+    if (i >= queue->n_tasks) break;
+    BuildTask* task = &queue->tasks[i];
+    INSTR_SCOPE("qtree_build_task");
+    insert_children(ctx.arena, task->node);
+    qtree_build_node(&ctx, task->node, task->pts, task->tmp, task->rpos, task->n, task->depth);
+  }
+  return NULL;
+}
+
+static int build_task_cmp(const void* a, const void* b) {
+  const BuildTask* ta = a;
+  const BuildTask* tb = b;
+  return (ta->n < tb->n) - (ta->n > tb->n);
+}
+
+size_t qtree_build_parallel(QTree* tree, size_t n_lists, const PList* lists[], size_t n_threads) {
+  INSTR_SCOPE("qtree_build_parallel");
+  if (n_threads == 0) {
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    n_threads = n_cpus > 0 ? (size_t)n_cpus : 1;
+  }
+
+  V2* pts;
+  size_t total;
+  size_t n = qtree_collect_points(&tree->root, n_lists, lists, &pts, &total);
+  // without memory for the points qtree_build reports it
+  if (n_threads == 1 || n < QTREE_PARALLEL_MIN_POINTS || pts == NULL) {
+    free(pts);
+    return qtree_build(tree, n_lists, lists);
+  }
+  qtree_reset(tree);
+
+  // split deep enough for about 4 tasks per thread
+  size_t split_depth = 1;
+  size_t max_tasks = 4;
+  while (max_tasks < 4 * n_threads && split_depth < QTREE_PARALLEL_MAX_SPLIT) {
+    split_depth++;
+    max_tasks *= 4;
+  }
+
+  BuildCtx ctx = {
+    .arena = &tree->arena,
+    .split_depth = split_depth,
+    .tasks = malloc(sizeof(BuildTask) * max_tasks),
+    .n_tasks = 0,
+  };
+  V2* tmp = malloc(sizeof(V2) * n);
+  uint8_t* rpos = malloc(n);
+  BuildWorker* workers = malloc(sizeof(BuildWorker) * n_threads);
+  pthread_t* threads = malloc(sizeof(pthread_t) * n_threads);
+  if (ctx.tasks == NULL || tmp == NULL || rpos == NULL || workers == NULL || threads == NULL) {
+    log_wrn("Could not allocate the scratch space of the parallel qtree build");
+    free(threads);
+    free(workers);
+    free(ctx.tasks);
+    free(rpos);
+    free(tmp);
+    free(pts);
+    return 0;
+  }
+  insert_children(&tree->arena, &tree->root);
+  qtree_build_node(&ctx, &tree->root, pts, tmp, rpos, n, 0);
+  // largest subtrees first, so no thread is left with a big one at the end
+  qsort(ctx.tasks, ctx.n_tasks, sizeof(BuildTask), build_task_cmp);
+
+  BuildQueue queue = {.tasks = ctx.tasks, .n_tasks = ctx.n_tasks};
+  atomic_init(&queue.next, 0);
+  for (size_t i = 0; i < n_threads; i++) {
+    workers[i] = (BuildWorker) {.queue = &queue, .arena = node_arena_new()};
+  }
+  // the calling thread is worker 0
+  size_t n_started = 1;
+  for (; n_started < n_threads; n_started++) {
+    if (pthread_create(&threads[n_started], NULL, qtree_build_worker, &workers[n_started]) != 0) {
+      log_wrn("Could only start %ld of %ld qtree build threads", n_started, n_threads);
+      break;
+    }
+  }
+  qtree_build_worker(&workers[0]);
+  for (size_t i = 1; i < n_started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  for (size_t i = 0; i < n_threads; i++) {
+    node_arena_merge(&tree->arena, &workers[i].arena);
+  }
+
+  free(threads);
+  free(workers);
+  free(ctx.tasks);
+  free(rpos);
+  free(tmp);
+  free(pts);
+
+  log_msg("Built qtree from %ld of %ld points with %ld threads", n, total, n_started);
+  return n;
+}
+
+Node* qtree_locate(Node* root, V2 point) {
   Node* cur_node = root;
-  Node* parent = root;
+  while ((cur_node->type == NODE_ROOT || cur_node->type == NODE_BRANCH)
+         && cur_node->children != NULL) {
+    cur_node = &cur_node->children[relative_pos(&cur_node->pos, &point)];
+  }
+  return cur_node;
+}
 
-  if (root->type == NODE_LEAF || root->type == NODE_EMPTY) {
-    log_msg("WARN: cannot find closest node using leaf node as entry point");
-    return NULL;
+Node* qtree_find(Node* root, V2 point) {
+  Node* cur_node = qtree_locate(root, point);
+  if (cur_node->type == NODE_LEAF && leaf_contains(cur_node, point)) {
+    return cur_node;
+  }
+  return NULL;
+}
+
+// turn a branch whose points fit into a single leaf back into a leaf / empty node
+static void qtree_collapse(QTree* tree, Node* node) {
+  V2 points[QTREE_LEAF_CAP];
+  uint32_t n = 0;
+  for (int rpos = RELPOS_UR; rpos < RELPOS_NUM; rpos++) {
+    Node* child = &node->children[rpos];
+    if (child->type == NODE_BRANCH) return;
+    if (child->type == NODE_LEAF) {
+      if (n + child->count > QTREE_LEAF_CAP) return;
+      memcpy(&points[n], child->points, sizeof(V2) * child->count);
+      n += child->count;
+    }
   }
 
-  while (!(cur_node->type == NODE_LEAF || cur_node->type == NODE_EMPTY)) {
-    RelPos rpos = relative_pos(&cur_node->pos, point);
+  // the root keeps its children, even for a single point
+  if (n > 0 && node->type == NODE_ROOT) return;
+  node_arena_release(&tree->arena, node->children);
+  node->children = NULL;
 
-    // Here, CUR_NODE can become NODE_LEAF or NODE_EMPTY
+  if (n == 0) {
+    if (node->type == NODE_BRANCH) {
+      node->type = NODE_EMPTY;
+    }
+  } else {
+    node->type = NODE_LEAF;
+    node->count = n;
+    memcpy(node->points, points, sizeof(V2) * n);
+    node->pos = points[0];
+  }
+}
+
+// remove point from a leaf, the leaf becomes empty after its last point
+static bool leaf_remove(Node* leaf, V2 point, V2 center) {
+  for (uint32_t i = 0; i < leaf->count; i++) {
+    if (!v2_eq(leaf->points[i], point)) continue;
+    memmove(&leaf->points[i], &leaf->points[i + 1], sizeof(V2) * (leaf->count - i - 1));
+    leaf->count--;
+    if (leaf->count == 0) {
+      leaf->type = NODE_EMPTY;
+      leaf->pos = center;
+      leaf->children = NULL;
+    } else {
+      leaf->pos = leaf->points[0];
+    }
+    return true;
+  }
+  return false;
+}
+
+// node is a branch or root with children
+static bool qtree_remove_node(QTree* tree, Node* node, V2 point) {
+  const RelPos rpos = relative_pos(&node->pos, &point);
+  Node* child = &node->children[rpos];
+
+  if (child->type == NODE_LEAF) {
+    if (!leaf_remove(child, point, gen_pos_parent(node, rpos))) return false;
+  } else if (child->type == NODE_BRANCH) {
+    if (!qtree_remove_node(tree, child, point)) return false;
+  } else {
+    return false;
+  }
+
+  qtree_collapse(tree, node);
+  return true;
+}
+
+bool qtree_remove(QTree* tree, V2 point) {
+  if (tree->root.children == NULL) {
+    return false;
+  }
+  return qtree_remove_node(tree, &tree->root, point);
+}
+
+// whether inserting point into the full leaf at depth, with the cell cell
+// and the n points pts, splits it down to a leaf above QTREE_MAX_DEPTH
+static bool split_fits(Node cell, const V2* pts, uint32_t n, V2 point, size_t depth) {
+  V2 inside[QTREE_LEAF_CAP];
+  memcpy(inside, pts, sizeof(V2) * n);
+  for (; depth < QTREE_MAX_DEPTH; depth++) {
+    const RelPos rpos = relative_pos(&cell.pos, &point);
+    uint32_t m = 0;
+    for (uint32_t i = 0; i < n; i++) {
+      if (relative_pos(&cell.pos, &inside[i]) == rpos) inside[m++] = inside[i];
+    }
+    if (m < QTREE_LEAF_CAP) return true;
+    n = m;
+    cell = node_new(gen_pos_parent(&cell, rpos), NODE_BRANCH, cell.w / 2, cell.h / 2);
+  }
+  return false;
+}
+
+bool qtree_move(QTree* tree, V2 from, V2 to) {
+  Node* leaf = qtree_find(&tree->root, from);
+  if (leaf == NULL) {
+    return false;
+  }
+  if (v2_eq(from, to)) {
+    return true;
+  }
+  if (!qtree_in_bounds(&tree->root, to) || qtree_find(&tree->root, to) != NULL) {
+    return false;
+  }
+
+  // still in the cell of the leaf, no structural change needed
+  Node* cur_node = &tree->root;
+  Node* parent = cur_node;
+  size_t depth = 0;
+  while (cur_node->type == NODE_ROOT || cur_node->type == NODE_BRANCH) {
     parent = cur_node;
-    cur_node = &cur_node->children[rpos];
+    cur_node = &cur_node->children[relative_pos(&cur_node->pos, &to)];
+    depth++;
+  }
+  if (cur_node == leaf) {
+    for (uint32_t i = 0; i < leaf->count; i++) {
+      if (v2_eq(leaf->points[i], from)) leaf->points[i] = to;
+    }
+    leaf->pos = leaf->points[0];
+    return true;
+  }
+
+  // a full leaf has to split until to has a leaf of its own, which may need
+  // more levels than QTREE_MAX_DEPTH allows. Removing from cannot free up any
+  // room below the leaf, it is in another one
+  if (cur_node->type == NODE_LEAF && cur_node->count >= QTREE_LEAF_CAP) {
+    const Node cell = node_new(gen_pos_parent(parent, relative_pos(&parent->pos, &cur_node->pos)),
+                               NODE_BRANCH, parent->w / 2, parent->h / 2);
+    if (!split_fits(cell, cur_node->points, cur_node->count, to, depth)) {
+      return false;
+    }
+  }
+
+  qtree_remove(tree, from);
+  if (!qtree_insert(tree, to)) {
+    // not expected after the check above, from goes back where it was
+    qtree_insert(tree, from);
+    return false;
   }
+  return true;
+}
+
+float cell_dist2(const Node* cell, const V2* point) {
+  float dx = fabsf(point->x - cell->pos.x) - cell->w / 2;
+  float dy = fabsf(point->y - cell->pos.y) - cell->h / 2;
+  dx = dx > 0 ? dx : 0;
+  dy = dy > 0 ? dy : 0;
+  return dx * dx + dy * dy;
+}
 
-  Node* closest = NULL;
-  float closest_dist = -1.0;
-  for (int rpos = RELPOS_UR; rpos < RELPOS_NUM; rpos++) { // max 4 iterations
-    if (parent->children[rpos].type == NODE_LEAF) { // current child is not NULL
-      float cur_dist = v2_dist(parent->children[rpos].pos, *point);
-      if (closest_dist > cur_dist) { // if no distance set yet, this will be true
-        closest = &parent->children[rpos];
-        closest_dist = cur_dist;
-      } 
+// leaves below this many points skip the dispatched batch kernel
+#define LEAF_BATCH_MIN 8
+
+// squared distances of the points of a leaf to point
+static inline void leaf_dist2(const Node* leaf, const V2* point, float* dist2) {
+#if QTREE_LEAF_CAP >= LEAF_BATCH_MIN
+  if (leaf->count >= LEAF_BATCH_MIN) {
+    v2_dist2_batch(leaf->points, leaf->count, *point, dist2);
+    return;
+  }
+#endif
+  for (uint32_t i = 0; i < leaf->count; i++) {
+    V2 d = v2_sub(leaf->points[i], *point);
+    dist2[i] = d.x * d.x + d.y * d.y;
+  }
+}
+
+// node is a branch or a root with children
+static void qtree_closest_node(Node* node, const V2* point, const V2** best, float* best_dist2) {
+  INSTR_COUNT(CTR_NN_VISITED, 1);
+  float dists[RELPOS_NUM];
+  int order[RELPOS_NUM];
+  int n_branches = 0;
+
+  for (int rpos = RELPOS_UR; rpos < RELPOS_NUM; rpos++) {
+    Node* child = &node->children[rpos];
+    if (child->type == NODE_LEAF) {
+      float dist2[QTREE_LEAF_CAP];
+      leaf_dist2(child, point, dist2);
+      for (uint32_t i = 0; i < child->count; i++) {
+        if (dist2[i] < *best_dist2) {
+          *best_dist2 = dist2[i];
+          *best = &child->points[i];
+        }
+      }
+    } else if (child->type == NODE_BRANCH) {
+      dists[rpos] = cell_dist2(child, point);
+      // insertion sort, closest quadrant first
+      int i = n_branches++;
+      for (; i > 0 && dists[order[i - 1]] > dists[rpos]; i--) {
+        order[i] = order[i - 1];
+      }
+      order[i] = rpos;
     }
   }
 
+  for (int i = 0; i < n_branches; i++) {
+    // all remaining quadrants are further away than the best point
+    if (dists[order[i]] >= *best_dist2) break;
+    qtree_closest_node(&node->children[order[i]], point, best, best_dist2);
+  }
+}
+
+const V2* qtree_find_closest(Node* root, const V2* point, float* dist) {
+  if (root->type == NODE_LEAF || root->type == NODE_EMPTY) {
+    log_wrn("cannot find closest node using leaf node as entry point");
+    return NULL;
+  }
+  if (root->children == NULL) {
+    return NULL;
+  }
+
+  const V2* closest = NULL;
+  float closest_dist2 = INFINITY;
+  qtree_closest_node(root, point, &closest, &closest_dist2);
+
+  if (dist != NULL && closest != NULL) {
+    *dist = sqrtf(closest_dist2);
+  }
   return closest;
 }
 
+// max-heap on the squared distances of the k best points so far,
+// stored directly in the caller's buffers
+typedef struct {
+  V2* points;
+  float* dist2;
+  size_t k;
+  size_t count;
+} KnnHeap;
+
+static void knn_heap_swap(KnnHeap* heap, size_t a, size_t b) {
+  V2 p = heap->points[a]; heap->points[a] = heap->points[b]; heap->points[b] = p;
+  float d = heap->dist2[a]; heap->dist2[a] = heap->dist2[b]; heap->dist2[b] = d;
+}
+
+static void knn_heap_sift_down(KnnHeap* heap, size_t idx, size_t count) {
+  for (;;) {
+    size_t largest = idx;
+    size_t l = 2 * idx + 1;
+    size_t r = l + 1;
+    if (l < count && heap->dist2[l] > heap->dist2[largest]) largest = l;
+    if (r < count && heap->dist2[r] > heap->dist2[largest]) largest = r;
+    if (largest == idx) return;
+    knn_heap_swap(heap, idx, largest);
+    idx = largest;
+  }
+}
+
+static void knn_heap_push(KnnHeap* heap, V2 point, float dist2) {
+  if (heap->count < heap->k) {
+    size_t idx = heap->count++;
+    heap->points[idx] = point;
+    heap->dist2[idx] = dist2;
+    while (idx > 0 && heap->dist2[(idx - 1) / 2] < heap->dist2[idx]) {
+      knn_heap_swap(heap, idx, (idx - 1) / 2);
+      idx = (idx - 1) / 2;
+    }
+  } else if (dist2 < heap->dist2[0]) {
+    heap->points[0] = point;
+    heap->dist2[0] = dist2;
+    knn_heap_sift_down(heap, 0, heap->count);
+  }
+}
+
+static float knn_heap_bound(const KnnHeap* heap) {
+  return heap->count < heap->k ? INFINITY : heap->dist2[0];
+}
+
+// node is a branch or a root with children
+static void qtree_knn_node(Node* node, const V2* point, KnnHeap* heap) {
+  INSTR_COUNT(CTR_NN_VISITED, 1);
+  float dists[RELPOS_NUM];
+  int order[RELPOS_NUM];
+  int n_branches = 0;
+
+  for (int rpos = RELPOS_UR; rpos < RELPOS_NUM; rpos++) {
+    Node* child = &node->children[rpos];
+    if (child->type == NODE_LEAF) {
+      float dist2[QTREE_LEAF_CAP];
+      leaf_dist2(child, point, dist2);
+      for (uint32_t i = 0; i < child->count; i++) {
+        knn_heap_push(heap, child->points[i], dist2[i]);
+      }
+    } else if (child->type == NODE_BRANCH) {
+      dists[rpos] = cell_dist2(child, point);
+      int i = n_branches++;
+      for (; i > 0 && dists[order[i - 1]] > dists[rpos]; i--) {
+        order[i] = order[i - 1];
+      }
+      order[i] = rpos;
+    }
+  }
+
+  for (int i = 0; i < n_branches; i++) {
+    if (dists[order[i]] >= knn_heap_bound(heap)) break;
+    qtree_knn_node(&node->children[order[i]], point, heap);
+  }
+}
+
+size_t qtree_knn(Node* root, const V2* point, size_t k, V2* out, float* dists) {
+  if (root->type == NODE_LEAF || root->type == NODE_EMPTY) {
+    log_wrn("cannot search neighbours using leaf node as entry point");
+    return 0;
+  }
+  if (root->children == NULL || k == 0) {
+    return 0;
+  }
+
+  KnnHeap heap = {.points = out, .dist2 = dists, .k = k, .count = 0};
+  qtree_knn_node(root, point, &heap);
+
+  // heap sort in place, closest first
+  for (size_t end = heap.count; end > 1; end--) {
+    knn_heap_swap(&heap, 0, end - 1);
+    knn_heap_sift_down(&heap, 0, end - 1);
+  }
+  for (size_t i = 0; i < heap.count; i++) {
+    dists[i] = sqrtf(dists[i]);
+  }
+  return heap.count;
+}
+
+size_t qtree_knn_batch(Node* root, const V2* queries, size_t n, size_t k,
+                       V2* out, float* dists, size_t* counts) {
+  size_t total = 0;
+  for (size_t i = 0; i < n; i++) {
+    counts[i] = qtree_knn(root, &queries[i], k, &out[i * k], &dists[i * k]);
+    total += counts[i];
+  }
+  return total;
+}
+
+// node is a branch or a root with children
+static void qtree_radius_node(Node* node, const V2* point, float r2, PList* out, size_t* found) {
+  for (int rpos = RELPOS_UR; rpos < RELPOS_NUM; rpos++) {
+    Node* child = &node->children[rpos];
+    if (child->type == NODE_LEAF) {
+      float dist2[QTREE_LEAF_CAP];
+      leaf_dist2(child, point, dist2);
+      for (uint32_t i = 0; i < child->count; i++) {
+        if (dist2[i] <= r2 && PList_push(out, P_COORDS(child->points[i]))) {
+          (*found)++;
+        }
+      }
+    } else if (child->type == NODE_BRANCH && cell_dist2(child, point) <= r2) {
+      qtree_radius_node(child, point, r2, out, found);
+    }
+  }
+}
+
+size_t qtree_radius(Node* root, const V2* point, float r, PList* out) {
+  if (root->type == NODE_LEAF || root->type == NODE_EMPTY) {
+    log_wrn("cannot search neighbours using leaf node as entry point");
+    return 0;
+  }
+  size_t found = 0;
+  if (root->children != NULL) {
+    qtree_radius_node(root, point, r * r, out, &found);
+  }
+  return found;
+}
+
+size_t qtree_radius_batch(Node* root, const V2* queries, size_t n, float r,
+                          PList* out, size_t* offsets) {
+  offsets[0] = out->count;
+  for (size_t i = 0; i < n; i++) {
+    qtree_radius(root, &queries[i], r, out);
+    offsets[i + 1] = out->count;
+  }
+  return offsets[n] - offsets[0];
+}
+
+typedef struct {
+  V2 min;
+  V2 max;
+  float min_size;
+  QTreeVisitor* visit;
+  void* user;
+  size_t visited;
+} RectQuery;
+
+// center is passed separately, because leaves store their point in pos
+static void qtree_query_rect_node(Node* node, V2 center, RectQuery* query) {
+  if (center.x + node->w / 2 < query->min.x || center.x - node->w / 2 > query->max.x
+   || center.y + node->h / 2 < query->min.y || center.y - node->h / 2 > query->max.y) {
+    return;
+  }
+
+  query->visit(node, query->user);
+  query->visited++;
+
+  if (!(node->type == NODE_BRANCH || node->type == NODE_ROOT) || node->children == NULL) {
+    return;
+  }
+  // level of detail cut-off, the children would be too small to matter
+  if (node->w < query->min_size && node->h < query->min_size) {
+    return;
+  }
+  for (int rpos = RELPOS_UR; rpos < RELPOS_NUM; rpos++) {
+    qtree_query_rect_node(&node->children[rpos], gen_pos_parent(node, rpos), query);
+  }
+}
+
+size_t qtree_query_rect(Node* root, V2 min, V2 max, float min_size,
+                        QTreeVisitor* visit, void* user) {
+  RectQuery query = {
+    .min = min, .max = max,
+    .min_size = min_size,
+    .visit = visit, .user = user,
+    .visited = 0,
+  };
+  qtree_query_rect_node(root, root->pos, &query);
+  return query.visited;
+}
+
 V2 gen_pos_parent(Node* parent, RelPos pos) {
   switch (pos) {
     case RELPOS_UR:
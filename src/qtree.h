@@ -2,12 +2,23 @@
 #define QTREE_H
 
 #include "stdio.h"
+#include "stdint.h"
 #include "stdbool.h"
 #include "assert.h"
 
 #include "datastructs.h"
 
 
+// points a leaf holds before it is split
+#ifndef QTREE_LEAF_CAP
+#define QTREE_LEAF_CAP 1
+#endif
+
+// leaves at this depth are not split anymore, further points are rejected
+#ifndef QTREE_MAX_DEPTH
+#define QTREE_MAX_DEPTH 40
+#endif
+
 typedef struct Node_t Node;
 typedef enum {
   NODE_EMPTY, // leaf node with centered position, no information 
@@ -17,32 +28,207 @@ typedef enum {
 } NodeType;
 
 struct Node_t {
-  V2 pos;
+  V2 pos; // for leaves, this is the first point
   float w;
   float h;
   NodeType type;
-  Node* children; // 4 Children or None
+  uint32_t count; // number of points of a leaf
+  union {
+    Node* children; // 4 Children or None
+    V2 points[QTREE_LEAF_CAP]; // points of a leaf
+  };
 };
 
 const char* node_type_to_cstr(NodeType type);
 Node node_new(V2 pos, NodeType type, float w, float h);
 
+/****************************************************
+ * NodeArena hands out the blocks of 4 children that
+ * make up a qtree. Blocks are carved from large chunks
+ * and recycled through a free list, so siblings are
+ * always adjacent and a whole tree is dropped at once.
+ */
+#define QTREE_ARENA_CHUNK_BLOCKS 1024
+
+typedef struct NodeChunk_t NodeChunk;
+typedef struct {
+  NodeChunk *chunks;      // chunks in use, the first one is being filled
+  NodeChunk *chunks_tail; // last chunk in use, for O(1) reset
+  NodeChunk *spare;       // chunks kept for reuse after a reset
+  Node *free_blocks;      // released blocks, linked through children[0].children
+  size_t n_blocks;        // blocks currently handed out
+} NodeArena;
+
+NodeArena node_arena_new(void);
+// returns an uninitialized block of 4 nodes
+Node* node_arena_alloc(NodeArena* arena);
+void node_arena_release(NodeArena* arena, Node* block);
+void node_arena_reset(NodeArena* arena);
+void node_arena_free(NodeArena* arena);
+// move all memory of src into dst, src is left empty
+void node_arena_merge(NodeArena* dst, NodeArena* src);
+
+/****************************************************
+ * QTree owns a root node and the arena its children
+ * are allocated from.
+ */
+typedef struct {
+  Node root;
+  NodeArena arena;
+} QTree;
+
+QTree qtree_new(V2 pos, float w, float h);
+// remove all points but keep the arena memory around
+void qtree_reset(QTree* tree);
+void qtree_free(QTree* tree);
+
 // generate a new V2 from parent node
 // with parents width and height / 2 as distance per direction
 V2 gen_pos_parent(Node* parent, RelPos pos);
 
-#define qtree_insert(node, point) _qtree_insert(node, point, 0)
-bool _qtree_insert(Node *node, V2 point, size_t depth);
+#define qtree_insert(tree, point) _qtree_insert(tree, &(tree)->root, point, 0)
+bool _qtree_insert(QTree *tree, Node *node, V2 point, size_t depth);
+// insert n points without logging each of them, in morton order of the
+// root cell so that successive inserts share their path down the tree
+// returns the number of points inserted
+size_t qtree_insert_batch(QTree* tree, const V2* points, size_t n);
+
+// replace the contents of tree with the points of n_lists PLists at once
+// gives the same tree as inserting the points one by one
+// returns the number of points inside of the root, 0 with an empty tree
+// if there is no memory for the build
+size_t qtree_build(QTree* tree, size_t n_lists, const PList* lists[]);
+
+// trees with fewer points are always built serially
+#define QTREE_PARALLEL_MIN_POINTS 4096
+// deepest level at which the tree is split into subtrees for the threads
+#define QTREE_PARALLEL_MAX_SPLIT 6
+
+// like qtree_build, but the subtrees below the first few levels are
+// built concurrently by n_threads threads (0: one per online cpu)
+// also returns 0 with an empty tree if there is no memory for the build
+size_t qtree_build_parallel(QTree* tree, size_t n_lists, const PList* lists[], size_t n_threads);
+
+// leaf holding exactly point, NULL if point is not in the tree
+Node* qtree_find(Node* root, V2 point);
+// deepest node whose cell holds point (an empty node, a leaf or the bare root)
+Node* qtree_locate(Node* root, V2 point);
+// remove point from the tree, branches that are left with a single
+// leaf or no leaves collapse back into a leaf or empty node
+bool qtree_remove(QTree* tree, V2 point);
+// relocate the point at from to to
+// false, and no change, if from is not in the tree, to is outside of
+// the root, to is already in the tree or its leaf is at the maximum depth
+bool qtree_move(QTree* tree, V2 from, V2 to);
 
 #define qtree_traverse_node(node) _qtree_traverse_node(stdout, node)
 void _qtree_traverse_node(FILE* f, Node* node);
 
 #define qtree_count_leaves(node) _qtree_count_leaves(node, 0)
 size_t _qtree_count_leaves(Node* node, size_t cur);
+size_t qtree_count_points(Node* node);
+size_t qtree_max_depth(Node* node);
+
+// squared distance from point to the rectangle of cell, 0 if inside
+float cell_dist2(const Node* cell, const V2* point);
+
+// closest point to point inside of its leaf, NULL for an empty tree
+// if dist is not NULL, the distance to the point is stored there
+const V2* qtree_find_closest(Node* root, const V2* point, float* dist);
+
+// k closest points to point, closest first
+// out and dists must hold k entries, returns the number of points found
+size_t qtree_knn(Node* root, const V2* point, size_t k, V2* out, float* dists);
+// knn for n queries, results of query i start at out[i * k] / dists[i * k]
+// counts[i] receives the number of points found for query i
+size_t qtree_knn_batch(Node* root, const V2* queries, size_t n, size_t k,
+                       V2* out, float* dists, size_t* counts);
+
+typedef void (QTreeVisitor)(Node* node, void* user);
+// visit all nodes whose cell intersects the rectangle [min, max], parents first
+// branches with both dimensions below min_size are visited, their children are not
+// returns the number of visited nodes
+size_t qtree_query_rect(Node* root, V2 min, V2 max, float min_size,
+                        QTreeVisitor* visit, void* user);
+
+// append all points within r of point to out, returns the number appended
+// (out grows as needed, points are only dropped if memory runs out)
+size_t qtree_radius(Node* root, const V2* point, float r, PList* out);
+// radius query for n queries, results of query i are
+// out->points[offsets[i]] to out->points[offsets[i + 1]], offsets holds n + 1 entries
+size_t qtree_radius_batch(Node* root, const V2* queries, size_t n, float r,
+                          PList* out, size_t* offsets);
+
+/****************************************************
+ * LQTree is a linear quadtree over the same root cell
+ * as a QTree. Points are kept in one flat array sorted
+ * by their morton (z-order) key, cells are implicit
+ * ranges of keys. Every point sits alone in its cell,
+ * like the leaves of the pointer based tree. Like a
+ * PList, it can be a view of arrays it does not own.
+ */
+typedef struct {
+  V2 pos;
+  float w;
+  float h;
+  uint64_t *keys;
+  V2 *points;
+  size_t count;
+  size_t cap;
+  bool view; // keys and points are borrowed and not freed
+} LQTree;
+
+// interleaved 32 bit cell coordinates of point inside the cell at pos
+// points on a cell boundary go to the upper / left cell like relative_pos
+uint64_t morton_key(V2 point, V2 pos, float w, float h);
+
+LQTree lqtree_new(V2 pos, float w, float h, size_t cap);
+void lqtree_free(LQTree* tree);
+bool lqtree_insert(LQTree* tree, V2 point);
+// insert many points at once, returns the number of points inserted
+// 0 if there is no memory, then the tree stays as it is
+size_t lqtree_insert_batch(LQTree* tree, const V2* points, size_t n);
+
+#define lqtree_traverse_node(tree) _lqtree_traverse_node(stdout, tree)
+void _lqtree_traverse_node(FILE* f, const LQTree* tree);
+size_t lqtree_count_leaves(const LQTree* tree);
+
+const V2* lqtree_find_closest(const LQTree* tree, const V2* point, float* dist);
 
-void node_free(Node* node);
-void qtree_free(Node* root);
+/****************************************************
+ * QIndex is the point index for code that only inserts,
+ * counts, prints and finds the closest point. It is the
+ * pointer tree, or the linear tree when built with
+ * QTREE_LINEAR=1 (CMake option QTREE_LINEAR), so the two
+ * can be swapped and compared behind the same calls.
+ * Everything else (builds, removal, knn, radius and rect
+ * queries) only exists for the pointer tree.
+ */
+#ifndef QTREE_LINEAR
+#define QTREE_LINEAR 0
+#endif
 
-Node* qtree_find_closest(Node* root, V2* point);
+#if QTREE_LINEAR
+typedef LQTree QIndex;
+#define QINDEX_NAME "linear"
+#define qindex_new(pos, w, h) lqtree_new(pos, w, h, 0)
+#define qindex_free(index) lqtree_free(index)
+#define qindex_insert(index, point) lqtree_insert(index, point)
+#define qindex_insert_batch(index, points, n) lqtree_insert_batch(index, points, n)
+#define qindex_count_leaves(index) lqtree_count_leaves(index)
+#define _qindex_traverse(f, index) _lqtree_traverse_node(f, index)
+#define qindex_find_closest(index, point, dist) lqtree_find_closest(index, point, dist)
+#else
+typedef QTree QIndex;
+#define QINDEX_NAME "pointer"
+#define qindex_new(pos, w, h) qtree_new(pos, w, h)
+#define qindex_free(index) qtree_free(index)
+#define qindex_insert(index, point) qtree_insert(index, point)
+#define qindex_insert_batch(index, points, n) qtree_insert_batch(index, points, n)
+#define qindex_count_leaves(index) qtree_count_leaves(&(index)->root)
+#define _qindex_traverse(f, index) _qtree_traverse_node(f, &(index)->root)
+#define qindex_find_closest(index, point, dist) qtree_find_closest(&(index)->root, point, dist)
+#endif
+#define qindex_traverse(index) _qindex_traverse(stdout, index)
 
 #endif // QTREE_H
@@ -0,0 +1,346 @@
+#include "string.h"
+#include "math.h"
+#include "assert.h"
+#include "stdatomic.h"
+#include "pthread.h"
+
+#include "v2batch.h"
+#include "logging.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define V2_BATCH_X86
+#include "immintrin.h"
+#endif
+
+typedef void (Dist2Kernel)(const V2* pts, size_t n, V2 q, float* out);
+typedef void (RelPosKernel)(const V2* pts, size_t n, V2 center, uint8_t* out);
+typedef void (BoundsKernel)(const V2* pts, size_t n, V2* min, V2* max);
+
+typedef struct {
+  V2BatchIsa isa;
+  Dist2Kernel* dist2;
+  Dist2Kernel* dist;
+  RelPosKernel* relpos;
+  BoundsKernel* bounds; // n > 0
+} V2BatchOps;
+
+// right: x > center.x, lower: y > center.y
+static inline uint8_t relpos_of(bool right, bool lower) {
+  return 2 * lower + (1 ^ right ^ lower);
+}
+
+/****************************************************
+ * Scalar kernels, the reference for all others
+ */
+static void dist2_scalar(const V2* pts, size_t n, V2 q, float* out) {
+  for (size_t i = 0; i < n; i++) {
+    const float dx = pts[i].x - q.x;
+    const float dy = pts[i].y - q.y;
+    out[i] = dx * dx + dy * dy;
+  }
+}
+
+static void dist_scalar(const V2* pts, size_t n, V2 q, float* out) {
+  dist2_scalar(pts, n, q, out);
+  for (size_t i = 0; i < n; i++) {
+    out[i] = sqrtf(out[i]);
+  }
+}
+
+static void relpos_scalar(const V2* pts, size_t n, V2 center, uint8_t* out) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = relpos_of(pts[i].x > center.x, pts[i].y > center.y);
+  }
+}
+
+static void bounds_scalar(const V2* pts, size_t n, V2* min, V2* max) {
+  V2 lo = pts[0], hi = pts[0];
+  for (size_t i = 1; i < n; i++) {
+    lo.x = pts[i].x < lo.x ? pts[i].x : lo.x;
+    lo.y = pts[i].y < lo.y ? pts[i].y : lo.y;
+    hi.x = pts[i].x > hi.x ? pts[i].x : hi.x;
+    hi.y = pts[i].y > hi.y ? pts[i].y : hi.y;
+  }
+  *min = lo;
+  *max = hi;
+}
+
+static const V2BatchOps ops_scalar = {
+  V2_BATCH_SCALAR, dist2_scalar, dist_scalar, relpos_scalar, bounds_scalar
+};
+
+#ifdef V2_BATCH_X86
+// compare mask of 4 interleaved points (bit 2i: right, bit 2i + 1: lower)
+// to their 4 relative positions, filled on first use
+static uint32_t relpos_lut[256];
+
+static void relpos_lut_init(void) {
+  for (uint32_t mask = 0; mask < 256; mask++) {
+    uint32_t packed = 0;
+    for (int i = 0; i < 4; i++) {
+      const uint8_t rpos = relpos_of(mask >> (2 * i) & 1, mask >> (2 * i + 1) & 1);
+      packed |= (uint32_t)rpos << (8 * i);
+    }
+    relpos_lut[mask] = packed;
+  }
+}
+
+/****************************************************
+ * SSE2 kernels, 4 points per step. SSE2 is part of
+ * x86-64, so these need no cpu check.
+ */
+// x and y of 4 points at p
+static inline void load4_sse2(const V2* p, __m128* x, __m128* y) {
+  const __m128 a = _mm_loadu_ps(&p[0].x);
+  const __m128 b = _mm_loadu_ps(&p[2].x);
+  *x = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+  *y = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+}
+
+static inline __m128 dist2x4_sse2(const V2* p, __m128 qx, __m128 qy) {
+  __m128 x, y;
+  load4_sse2(p, &x, &y);
+  const __m128 dx = _mm_sub_ps(x, qx);
+  const __m128 dy = _mm_sub_ps(y, qy);
+  return _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+}
+
+static void dist2_sse2(const V2* pts, size_t n, V2 q, float* out) {
+  const __m128 qx = _mm_set1_ps(q.x), qy = _mm_set1_ps(q.y);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    _mm_storeu_ps(&out[i], dist2x4_sse2(&pts[i], qx, qy));
+  }
+  dist2_scalar(&pts[i], n - i, q, &out[i]);
+}
+
+static void dist_sse2(const V2* pts, size_t n, V2 q, float* out) {
+  const __m128 qx = _mm_set1_ps(q.x), qy = _mm_set1_ps(q.y);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    _mm_storeu_ps(&out[i], _mm_sqrt_ps(dist2x4_sse2(&pts[i], qx, qy)));
+  }
+  dist_scalar(&pts[i], n - i, q, &out[i]);
+}
+
+static void relpos_sse2(const V2* pts, size_t n, V2 center, uint8_t* out) {
+  const __m128 c = _mm_setr_ps(center.x, center.y, center.x, center.y);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    const int lo = _mm_movemask_ps(_mm_cmpgt_ps(_mm_loadu_ps(&pts[i].x), c));
+    const int hi = _mm_movemask_ps(_mm_cmpgt_ps(_mm_loadu_ps(&pts[i + 2].x), c));
+    const uint32_t packed = relpos_lut[lo | hi << 4];
+    memcpy(&out[i], &packed, 4);
+  }
+  relpos_scalar(&pts[i], n - i, center, &out[i]);
+}
+
+// lanes hold x y x y, the halves are reduced at the end
+static void bounds_sse2(const V2* pts, size_t n, V2* min, V2* max) {
+  const __m128 first = _mm_setr_ps(pts[0].x, pts[0].y, pts[0].x, pts[0].y);
+  __m128 lo = first, hi = first;
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    const __m128 p = _mm_loadu_ps(&pts[i].x);
+    lo = _mm_min_ps(p, lo);
+    hi = _mm_max_ps(p, hi);
+  }
+  lo = _mm_min_ps(_mm_movehl_ps(lo, lo), lo);
+  hi = _mm_max_ps(_mm_movehl_ps(hi, hi), hi);
+  float l[4], h[4];
+  _mm_storeu_ps(l, lo);
+  _mm_storeu_ps(h, hi);
+  V2 rmin = v2(l[0], l[1]), rmax = v2(h[0], h[1]);
+  if (i < n) {
+    const V2 p = pts[i];
+    rmin.x = p.x < rmin.x ? p.x : rmin.x;
+    rmin.y = p.y < rmin.y ? p.y : rmin.y;
+    rmax.x = p.x > rmax.x ? p.x : rmax.x;
+    rmax.y = p.y > rmax.y ? p.y : rmax.y;
+  }
+  *min = rmin;
+  *max = rmax;
+}
+
+static const V2BatchOps ops_sse2 = {
+  V2_BATCH_SSE2, dist2_sse2, dist_sse2, relpos_sse2, bounds_sse2
+};
+
+/****************************************************
+ * AVX2 kernels, 8 points per step. Only FMA-free
+ * instructions are used, so the results match the
+ * scalar kernels.
+ */
+#define AVX2 __attribute__((target("avx2")))
+
+// x and y of 8 points at p
+AVX2 static inline void load8_avx2(const V2* p, __m256* x, __m256* y) {
+  const __m256 a = _mm256_loadu_ps(&p[0].x);
+  const __m256 b = _mm256_loadu_ps(&p[4].x);
+  // shuffles stay inside 128 bit lanes: x0 x1 x4 x5 | x2 x3 x6 x7
+  const __m256 xs = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+  const __m256 ys = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+  *x = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(xs), _MM_SHUFFLE(3, 1, 2, 0)));
+  *y = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(ys), _MM_SHUFFLE(3, 1, 2, 0)));
+}
+
+AVX2 static inline __m256 dist2x8_avx2(const V2* p, __m256 qx, __m256 qy) {
+  __m256 x, y;
+  load8_avx2(p, &x, &y);
+  const __m256 dx = _mm256_sub_ps(x, qx);
+  const __m256 dy = _mm256_sub_ps(y, qy);
+  return _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+}
+
+AVX2 static void dist2_avx2(const V2* pts, size_t n, V2 q, float* out) {
+  const __m256 qx = _mm256_set1_ps(q.x), qy = _mm256_set1_ps(q.y);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_ps(&out[i], dist2x8_avx2(&pts[i], qx, qy));
+  }
+  dist2_sse2(&pts[i], n - i, q, &out[i]);
+}
+
+AVX2 static void dist_avx2(const V2* pts, size_t n, V2 q, float* out) {
+  const __m256 qx = _mm256_set1_ps(q.x), qy = _mm256_set1_ps(q.y);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_ps(&out[i], _mm256_sqrt_ps(dist2x8_avx2(&pts[i], qx, qy)));
+  }
+  dist_sse2(&pts[i], n - i, q, &out[i]);
+}
+
+AVX2 static void relpos_avx2(const V2* pts, size_t n, V2 center, uint8_t* out) {
+  const __m256 c = _mm256_setr_ps(center.x, center.y, center.x, center.y,
+                                  center.x, center.y, center.x, center.y);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const int lo = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(&pts[i].x), c, _CMP_GT_OQ));
+    const int hi = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(&pts[i + 4].x), c, _CMP_GT_OQ));
+    const uint64_t packed = relpos_lut[lo] | (uint64_t)relpos_lut[hi] << 32;
+    memcpy(&out[i], &packed, 8);
+  }
+  relpos_sse2(&pts[i], n - i, center, &out[i]);
+}
+
+AVX2 static void bounds_avx2(const V2* pts, size_t n, V2* min, V2* max) {
+  if (n < 4) {
+    bounds_sse2(pts, n, min, max);
+    return;
+  }
+  const V2 p0 = pts[0];
+  const __m256 first = _mm256_setr_ps(p0.x, p0.y, p0.x, p0.y, p0.x, p0.y, p0.x, p0.y);
+  __m256 lo = first, hi = first;
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    const __m256 p = _mm256_loadu_ps(&pts[i].x);
+    lo = _mm256_min_ps(p, lo);
+    hi = _mm256_max_ps(p, hi);
+  }
+  __m128 lo4 = _mm_min_ps(_mm256_extractf128_ps(lo, 1), _mm256_castps256_ps128(lo));
+  __m128 hi4 = _mm_max_ps(_mm256_extractf128_ps(hi, 1), _mm256_castps256_ps128(hi));
+  lo4 = _mm_min_ps(_mm_movehl_ps(lo4, lo4), lo4);
+  hi4 = _mm_max_ps(_mm_movehl_ps(hi4, hi4), hi4);
+  float l[4], h[4];
+  _mm_storeu_ps(l, lo4);
+  _mm_storeu_ps(h, hi4);
+  V2 rmin = v2(l[0], l[1]), rmax = v2(h[0], h[1]);
+  for (; i < n; i++) {
+    rmin.x = pts[i].x < rmin.x ? pts[i].x : rmin.x;
+    rmin.y = pts[i].y < rmin.y ? pts[i].y : rmin.y;
+    rmax.x = pts[i].x > rmax.x ? pts[i].x : rmax.x;
+    rmax.y = pts[i].y > rmax.y ? pts[i].y : rmax.y;
+  }
+  *min = rmin;
+  *max = rmax;
+}
+
+static const V2BatchOps ops_avx2 = {
+  V2_BATCH_AVX2, dist2_avx2, dist_avx2, relpos_avx2, bounds_avx2
+};
+#endif // V2_BATCH_X86
+
+/****************************************************
+ * Dispatch
+ */
+static _Atomic(const V2BatchOps*) g_ops = NULL;
+
+static const V2BatchOps* ops_for(V2BatchIsa isa) {
+  switch (isa) {
+    case V2_BATCH_SCALAR:
+      return &ops_scalar;
+#ifdef V2_BATCH_X86
+    case V2_BATCH_SSE2:
+      return &ops_sse2;
+    case V2_BATCH_AVX2:
+      return __builtin_cpu_supports("avx2") ? &ops_avx2 : NULL;
+#endif
+    default:
+      return NULL;
+  }
+}
+
+static pthread_once_t g_ops_once = PTHREAD_ONCE_INIT;
+
+static void batch_ops_init(void) {
+#ifdef V2_BATCH_X86
+  relpos_lut_init();
+#endif
+  const V2BatchOps* ops = NULL;
+  for (int isa = V2_BATCH_NUM - 1; isa >= V2_BATCH_SCALAR && ops == NULL; isa--) {
+    ops = ops_for(isa);
+  }
+  log_msg("Using %s point batch kernels", v2_batch_isa_to_cstr(ops->isa));
+  atomic_store_explicit(&g_ops, ops, memory_order_release);
+}
+
+static const V2BatchOps* batch_ops(void) {
+  const V2BatchOps* ops = atomic_load_explicit(&g_ops, memory_order_acquire);
+  if (ops != NULL) return ops;
+  pthread_once(&g_ops_once, batch_ops_init);
+  return atomic_load_explicit(&g_ops, memory_order_acquire);
+}
+
+const char* v2_batch_isa_to_cstr(V2BatchIsa isa) {
+  switch (isa) {
+    case V2_BATCH_SCALAR:
+      return "SCALAR";
+    case V2_BATCH_SSE2:
+      return "SSE2";
+    case V2_BATCH_AVX2:
+      return "AVX2";
+    default:
+      assert(false && "unknown batch kernel isa");
+  }
+  return "UNKNOWN";
+}
+
+V2BatchIsa v2_batch_isa(void) {
+  return batch_ops()->isa;
+}
+
+bool v2_batch_set_isa(V2BatchIsa isa) {
+  batch_ops(); // fills the lookup table
+  const V2BatchOps* ops = ops_for(isa);
+  if (ops == NULL) return false;
+  atomic_store_explicit(&g_ops, ops, memory_order_release);
+  return true;
+}
+
+void v2_dist2_batch(const V2* pts, size_t n, V2 q, float* out) {
+  batch_ops()->dist2(pts, n, q, out);
+}
+
+void v2_dist_batch(const V2* pts, size_t n, V2 q, float* out) {
+  batch_ops()->dist(pts, n, q, out);
+}
+
+void relative_pos_batch(const V2* pts, size_t n, V2 center, uint8_t* out) {
+  batch_ops()->relpos(pts, n, center, out);
+}
+
+bool v2_bounds(const V2* pts, size_t n, V2* min, V2* max) {
+  if (n == 0) return false;
+  batch_ops()->bounds(pts, n, min, max);
+  return true;
+}
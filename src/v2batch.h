@@ -0,0 +1,38 @@
+#ifndef V2BATCH_H
+#define V2BATCH_H
+#include "stdint.h"
+#include "stdbool.h"
+
+#include "datastructs.h"
+
+/****************************************************
+ * Batch kernels over arrays of points. There is a
+ * scalar version of every kernel and SSE2 / AVX2
+ * versions on x86-64, the fastest one the cpu supports
+ * is picked on first use. All versions give the same
+ * results bit for bit.
+ */
+typedef enum {
+  V2_BATCH_SCALAR = 0,
+  V2_BATCH_SSE2,
+  V2_BATCH_AVX2,
+  V2_BATCH_NUM
+} V2BatchIsa;
+
+const char* v2_batch_isa_to_cstr(V2BatchIsa isa);
+// kernels in use
+V2BatchIsa v2_batch_isa(void);
+// use other kernels, false if the cpu does not support them
+// not to be called while kernels run on other threads
+bool v2_batch_set_isa(V2BatchIsa isa);
+
+// out[i] = squared distance of pts[i] to q
+void v2_dist2_batch(const V2* pts, size_t n, V2 q, float* out);
+// out[i] = distance of pts[i] to q
+void v2_dist_batch(const V2* pts, size_t n, V2 q, float* out);
+// out[i] = relative_pos(&center, &pts[i]), nan coordinates count as upper / left
+void relative_pos_batch(const V2* pts, size_t n, V2 center, uint8_t* out);
+// bounding box of n points, false if n is 0
+bool v2_bounds(const V2* pts, size_t n, V2* min, V2* max);
+
+#endif // V2BATCH_H
@@ -0,0 +1,108 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "time.h"
+
+#include "qtree.h"
+
+// Built once per leaf capacity, see tests/CMakeLists.txt
+#define AREA_WIDTH 1920.0
+#define AREA_HEIGHT 1080.0
+#define N_POINTS_DEFAULT (1 << 20)
+#define N_QUERIES 100000
+#define N_KNN 8
+
+typedef enum {
+  DIST_UNIFORM = 0,
+  DIST_CLUSTERED,
+  N_DISTS
+} Distribution;
+
+const char* dist_to_cstr(Distribution dist) {
+  switch (dist) {
+    case DIST_UNIFORM:
+      return "uniform";
+    case DIST_CLUSTERED:
+      return "clustered";
+    case N_DISTS:
+      return "NUM OF DISTS";
+  }
+  return NULL;
+}
+
+float rand_float() {
+  return (float)rand() / (float)RAND_MAX;
+}
+
+double now_s() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void fill_points(PList* list, size_t n, Distribution dist) {
+  list->count = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (dist == DIST_UNIFORM) {
+      PList_push(list, rand_float() * AREA_WIDTH, rand_float() * AREA_HEIGHT);
+    } else {
+      // 16 clusters of 1% of the area width
+      float cx = (i % 16 + 0.5) * AREA_WIDTH / 16;
+      float cy = ((i / 16) % 4 + 0.5) * AREA_HEIGHT / 4;
+      PList_push(list, cx + (rand_float() - 0.5) * AREA_WIDTH / 100,
+                       cy + (rand_float() - 0.5) * AREA_WIDTH / 100);
+    }
+  }
+}
+
+int main(int argc, char** argv) {
+  size_t n_points = argc > 1 ? strtoul(argv[1], NULL, 10) : N_POINTS_DEFAULT;
+  srand(0x69);
+
+  PList points = PList_new(n_points);
+  V2* queries = malloc(sizeof(V2) * N_QUERIES);
+  V2 knn[N_KNN];
+  float knn_dists[N_KNN];
+  for (size_t i = 0; i < N_QUERIES; i++) {
+    queries[i] = v2(rand_float() * AREA_WIDTH, rand_float() * AREA_HEIGHT);
+  }
+
+  for (Distribution dist = DIST_UNIFORM; dist < N_DISTS; dist++) {
+    fill_points(&points, n_points, dist);
+    const PList* lists[] = {&points};
+    QTree tree = qtree_new(v2(AREA_WIDTH / 2, AREA_HEIGHT / 2), AREA_WIDTH, AREA_HEIGHT);
+
+    double start = now_s();
+    size_t n = qtree_build(&tree, 1, lists);
+    double build = now_s() - start;
+
+    // checksum, so the queries cannot be optimized away
+    float sum = 0;
+    start = now_s();
+    for (size_t i = 0; i < N_QUERIES; i++) {
+      float dist;
+      qtree_find_closest(&tree.root, &queries[i], &dist);
+      sum += dist;
+    }
+    double nn = now_s() - start;
+
+    start = now_s();
+    for (size_t i = 0; i < N_QUERIES; i++) {
+      qtree_knn(&tree.root, &queries[i], N_KNN, knn, knn_dists);
+      sum += knn_dists[0];
+    }
+    double knn_time = now_s() - start;
+
+    const double bytes = (double)tree.arena.n_blocks * 4 * sizeof(Node);
+    printf("leaf cap %2d | %-9s | %8zu points | %6.1f bytes/point | %8zu leaves | depth %2zu"
+           " | build %8.2f ms | nn %7.1f ns | knn%d %7.1f ns | checksum %g\n",
+           QTREE_LEAF_CAP, dist_to_cstr(dist), n, bytes / n,
+           qtree_count_leaves(&tree.root), qtree_max_depth(&tree.root),
+           build * 1e3, nn / N_QUERIES * 1e9, N_KNN, knn_time / N_QUERIES * 1e9, sum);
+
+    qtree_free(&tree);
+  }
+
+  free(queries);
+  PList_free(&points);
+  return 0;
+}
@@ -0,0 +1,528 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "stdint.h"
+#include "string.h"
+#include "math.h"
+#include "time.h"
+#include "unistd.h"
+#include "stdatomic.h"
+#include "sys/wait.h"
+
+#include "qtree.h"
+#include "delaunay.h"
+#include "logging.h"
+
+/****************************************************
+ * Benchmarks of the qtree and mesh hot paths for every
+ * input distribution and sizes from 10^3 up to -n.
+ * Every case (distribution and size) runs in a child
+ * process, so the peak RSS of one case does not carry
+ * over into the next. Results go out as JSON, progress
+ * goes to stderr.
+ */
+#define AREA_WIDTH 1920.0
+#define AREA_HEIGHT 1080.0
+#define MIN_POINTS 1000
+#define MAX_POINTS_DEFAULT 10000000
+#define MAX_TRIANGULATE_DEFAULT 1000000
+#define REPS_DEFAULT 5
+// whole-tree operations repeat until they have seen this many points
+#define MIN_POINTS_TIMED 1000000
+#define MAX_SAMPLES 1000
+#define N_QUERIES 65536
+// queries and inserts are timed in chunks, clock_gettime costs ~20 ns
+#define QUERY_CHUNK 64
+#define INSERT_CHUNK 1024
+#define N_KNN 8
+#define RECORD_CAP 1024
+#define MAX_LINEAR_INSERTS 100000 // single inserts into the linear tree up to this size
+
+typedef enum {
+  DIST_UNIFORM = 0,
+  DIST_CLUSTERED,
+  DIST_GAUSSIAN,
+  DIST_COLLINEAR,
+  N_DISTS
+} Distribution;
+
+const char* dist_to_cstr(Distribution dist) {
+  switch (dist) {
+    case DIST_UNIFORM:
+      return "uniform";
+    case DIST_CLUSTERED:
+      return "clustered";
+    case DIST_GAUSSIAN:
+      return "gaussian";
+    case DIST_COLLINEAR:
+      return "collinear";
+    case N_DISTS:
+      return "NUM OF DISTS";
+  }
+  return NULL;
+}
+
+typedef struct {
+  size_t max_points;
+  size_t max_triangulate;
+  size_t reps;
+  const char* output;
+} Options;
+
+/****************************************************
+ * Allocation counting. The bench links with
+ * -Wl,--wrap=malloc (and calloc, realloc), which sends
+ * the calls of utils through these wrappers.
+ */
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t n, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+static atomic_size_t n_allocs;
+
+void* __wrap_malloc(size_t size) {
+  atomic_fetch_add_explicit(&n_allocs, 1, memory_order_relaxed);
+  return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t n, size_t size) {
+  atomic_fetch_add_explicit(&n_allocs, 1, memory_order_relaxed);
+  return __real_calloc(n, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+  atomic_fetch_add_explicit(&n_allocs, 1, memory_order_relaxed);
+  return __real_realloc(ptr, size);
+}
+
+/****************************************************
+ * Peak RSS, reset before every operation. Writing 5
+ * to clear_refs resets VmHWM since Linux 4.0, on older
+ * kernels the peak is the one of the whole case.
+ */
+static void reset_peak_rss(void) {
+  FILE* f = fopen("/proc/self/clear_refs", "w");
+  if (f == NULL) return;
+  fputs("5", f);
+  fclose(f);
+}
+
+// bytes, 0 if unknown
+static size_t peak_rss(void) {
+  FILE* f = fopen("/proc/self/status", "r");
+  if (f == NULL) return 0;
+  char line[256];
+  size_t kb = 0;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (sscanf(line, "VmHWM: %zu kB", &kb) == 1) break;
+  }
+  fclose(f);
+  return kb * 1024;
+}
+
+/****************************************************
+ * Timing. A Result collects one sample per timed chunk,
+ * the latency of an op in the chunk is its time / ops.
+ */
+typedef struct {
+  const char* op;
+  const char* unit; // what one op is
+  double* samples;  // ns per op
+  size_t n_samples;
+  size_t cap;
+  double total_ns;
+  size_t ops;
+  size_t allocs;
+  size_t rss;
+} Result;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static Result result_begin(const char* op, const char* unit) {
+  reset_peak_rss();
+  return (Result) {
+    .op = op,
+    .unit = unit,
+    .allocs = atomic_load(&n_allocs),
+  };
+}
+
+static void result_add(Result* res, uint64_t ns, size_t ops) {
+  if (res->n_samples == res->cap) {
+    res->cap = res->cap == 0 ? 64 : 2 * res->cap;
+    // not counted, it is no allocation of the benchmarked code
+    res->samples = __real_realloc(res->samples, sizeof(double) * res->cap);
+  }
+  res->samples[res->n_samples++] = (double)ns / ops;
+  res->total_ns += ns;
+  res->ops += ops;
+}
+
+static int cmp_double(const void* a, const void* b) {
+  const double x = *(const double*)a;
+  const double y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+// nearest rank percentile of sorted samples, q in [0, 1]
+static double percentile(const double* sorted, size_t n, double q) {
+  size_t rank = (size_t)ceil(q * n);
+  return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+// one JSON object per line into out, a short line to stderr
+static void result_end(Result* res, FILE* out, Distribution dist, size_t n, const char* extra) {
+  res->allocs = atomic_load(&n_allocs) - res->allocs;
+  res->rss = peak_rss();
+  qsort(res->samples, res->n_samples, sizeof(double), cmp_double);
+  const double median = percentile(res->samples, res->n_samples, 0.5);
+  const double p99 = percentile(res->samples, res->n_samples, 0.99);
+  const double throughput = res->ops / (res->total_ns * 1e-9);
+
+  fprintf(out, "{\"op\": \"%s\", \"dist\": \"%s\", \"n\": %zu, \"unit\": \"%s\", \"samples\": %zu, "
+          "\"median_ns\": %.1f, \"p99_ns\": %.1f, \"throughput\": %.1f, "
+          "\"peak_rss_bytes\": %zu, \"allocs_per_op\": %.4f%s}\n",
+          res->op, dist_to_cstr(dist), n, res->unit, res->n_samples,
+          median, p99, throughput, res->rss, (double)res->allocs / res->ops, extra);
+  fflush(out);
+  fprintf(stderr, "%-20s | %-9s | %8zu | median %10.1f ns/%-5s | p99 %10.1f ns | %12.0f %s/s | rss %7.1f MiB"
+          " | %.3f allocs/%s\n",
+          res->op, dist_to_cstr(dist), n, median, res->unit, p99, throughput, res->unit,
+          res->rss / 1048576.0, (double)res->allocs / res->ops, res->unit);
+  free(res->samples);
+}
+
+/****************************************************
+ * Inputs
+ */
+float rand_float() {
+  return (float)rand() / (float)RAND_MAX;
+}
+
+// standard normal, Box-Muller
+static float rand_normal() {
+  const float u = 1.0f - rand_float(); // (0, 1]
+  return sqrtf(-2.0f * logf(u)) * cosf(2.0f * (float)M_PI * rand_float());
+}
+
+void fill_points(PList* list, size_t n, Distribution dist) {
+  list->count = 0;
+  for (size_t i = 0; i < n; i++) {
+    switch (dist) {
+      case DIST_UNIFORM:
+        PList_push(list, rand_float() * AREA_WIDTH, rand_float() * AREA_HEIGHT);
+        break;
+      case DIST_CLUSTERED: {
+        // 64 clusters of 1% of the area width, 16 columns by 4 rows
+        float cx = (i % 16 + 0.5) * AREA_WIDTH / 16;
+        float cy = ((i / 16) % 4 + 0.5) * AREA_HEIGHT / 4;
+        PList_push(list, cx + (rand_float() - 0.5) * AREA_WIDTH / 100,
+                         cy + (rand_float() - 0.5) * AREA_WIDTH / 100);
+        break;
+      }
+      case DIST_GAUSSIAN: {
+        // around the center, points outside of the area are drawn again
+        V2 p;
+        do {
+          p = v2(AREA_WIDTH / 2 + rand_normal() * AREA_HEIGHT / 8,
+                 AREA_HEIGHT / 2 + rand_normal() * AREA_HEIGHT / 8);
+        } while (p.x < 0 || p.x >= AREA_WIDTH || p.y < 0 || p.y >= AREA_HEIGHT);
+        PList_push(list, p.x, p.y);
+        break;
+      }
+      case DIST_COLLINEAR: {
+        // the diagonal of the area, as close to a line as floats get
+        float t = rand_float();
+        PList_push(list, t * AREA_WIDTH, t * AREA_HEIGHT);
+        break;
+      }
+      case N_DISTS:
+        break;
+    }
+  }
+}
+
+static QTree qtree_area(void) {
+  return qtree_new(v2(AREA_WIDTH / 2, AREA_HEIGHT / 2), AREA_WIDTH, AREA_HEIGHT);
+}
+
+static QIndex qindex_area(void) {
+  return qindex_new(v2(AREA_WIDTH / 2, AREA_HEIGHT / 2), AREA_WIDTH, AREA_HEIGHT);
+}
+
+// samples for operations over the whole tree, more for small trees
+static size_t whole_reps(const Options* opts, size_t n) {
+  size_t reps = MIN_POINTS_TIMED / n;
+  if (reps < opts->reps) reps = opts->reps;
+  return reps < MAX_SAMPLES ? reps : MAX_SAMPLES;
+}
+
+/****************************************************
+ * Benchmarks, each builds its own trees
+ */
+static void bench_insert(FILE* out, const Options* opts, Distribution dist, const PList* points) {
+  const size_t n = points->count;
+  size_t chunk = n / 64;
+  if (chunk < 1) chunk = 1;
+  if (chunk > INSERT_CHUNK) chunk = INSERT_CHUNK;
+
+  // single inserts into the linear tree move the array behind them, O(n^2)
+  if (!QTREE_LINEAR || n <= MAX_LINEAR_INSERTS) {
+    Result single = result_begin("qtree_insert", "point");
+    for (size_t r = 0; r < opts->reps; r++) {
+      QIndex tree = qindex_area();
+      for (size_t i = 0; i < n; i += chunk) {
+        const size_t m = i + chunk < n ? chunk : n - i;
+        const uint64_t start = now_ns();
+        for (size_t j = i; j < i + m; j++) {
+          qindex_insert(&tree, points->points[j]);
+        }
+        result_add(&single, now_ns() - start, m);
+      }
+      qindex_free(&tree);
+    }
+    result_end(&single, out, dist, n, "");
+  }
+
+  Result batch = result_begin("qtree_insert_batch", "point");
+  for (size_t r = 0; r < opts->reps; r++) {
+    QIndex tree = qindex_area();
+    for (size_t i = 0; i < n; i += INSERT_CHUNK) {
+      const size_t m = i + INSERT_CHUNK < n ? INSERT_CHUNK : n - i;
+      const uint64_t start = now_ns();
+      qindex_insert_batch(&tree, &points->points[i], m);
+      result_add(&batch, now_ns() - start, m);
+    }
+    qindex_free(&tree);
+  }
+  result_end(&batch, out, dist, n, "");
+}
+
+static void bench_build(FILE* out, const Options* opts, Distribution dist, const PList* points) {
+  const PList* lists[] = {points};
+  const size_t n = points->count;
+  const size_t reps = whole_reps(opts, n);
+
+  Result serial = result_begin("qtree_build", "point");
+  for (size_t r = 0; r < reps; r++) {
+    QTree tree = qtree_area();
+    const uint64_t start = now_ns();
+    qtree_build(&tree, 1, lists);
+    result_add(&serial, now_ns() - start, n);
+    qtree_free(&tree);
+  }
+  result_end(&serial, out, dist, n, "");
+
+  Result parallel = result_begin("qtree_build_parallel", "point");
+  for (size_t r = 0; r < reps; r++) {
+    QTree tree = qtree_area();
+    const uint64_t start = now_ns();
+    qtree_build_parallel(&tree, 1, lists, 0);
+    result_add(&parallel, now_ns() - start, n);
+    qtree_free(&tree);
+  }
+  result_end(&parallel, out, dist, n, "");
+}
+
+// traversals and queries on one index and one pointer tree (for knn) of the points
+static void bench_tree(FILE* out, const Options* opts, Distribution dist, const PList* points,
+                       const V2* queries) {
+  const PList* lists[] = {points};
+  const size_t n = points->count;
+  const size_t reps = whole_reps(opts, n);
+  QIndex index = qindex_area();
+  qindex_insert_batch(&index, points->points, n);
+  QTree tree = qtree_area();
+  qtree_build(&tree, 1, lists);
+  // checksum, so the results cannot be optimized away
+  double sum = 0;
+  char extra[64];
+
+  Result leaves = result_begin("qtree_count_leaves", "tree");
+  for (size_t r = 0; r < reps; r++) {
+    const uint64_t start = now_ns();
+    sum += qindex_count_leaves(&index);
+    result_add(&leaves, now_ns() - start, 1);
+  }
+  result_end(&leaves, out, dist, n, "");
+
+  FILE* null = fopen("/dev/null", "w");
+  if (null != NULL) {
+    Result traverse = result_begin("qtree_traverse_node", "tree");
+    for (size_t r = 0; r < opts->reps; r++) {
+      const uint64_t start = now_ns();
+      _qindex_traverse(null, &index);
+      fflush(null);
+      result_add(&traverse, now_ns() - start, 1);
+    }
+    result_end(&traverse, out, dist, n, "");
+    fclose(null);
+  }
+
+  Result nn = result_begin("qtree_find_closest", "query");
+  for (size_t i = 0; i < N_QUERIES; i += QUERY_CHUNK) {
+    const uint64_t start = now_ns();
+    for (size_t j = i; j < i + QUERY_CHUNK; j++) {
+      float dist;
+      qindex_find_closest(&index, &queries[j], &dist);
+      sum += dist;
+    }
+    result_add(&nn, now_ns() - start, QUERY_CHUNK);
+  }
+  result_end(&nn, out, dist, n, "");
+
+  V2 knn[N_KNN];
+  float knn_dists[N_KNN];
+  Result k = result_begin("qtree_knn", "query");
+  for (size_t i = 0; i < N_QUERIES; i += QUERY_CHUNK) {
+    const uint64_t start = now_ns();
+    for (size_t j = i; j < i + QUERY_CHUNK; j++) {
+      qtree_knn(&tree.root, &queries[j], N_KNN, knn, knn_dists);
+      sum += knn_dists[0];
+    }
+    result_add(&k, now_ns() - start, QUERY_CHUNK);
+  }
+  snprintf(extra, sizeof(extra), ", \"k\": %d, \"checksum\": %g", N_KNN, sum);
+  result_end(&k, out, dist, n, extra);
+
+  qindex_free(&index);
+  qtree_free(&tree);
+}
+
+static void bench_triangulate(FILE* out, const Options* opts, Distribution dist, const PList* points) {
+  const PList* lists[] = {points};
+  const size_t n = points->count;
+  size_t reps = whole_reps(opts, n) / 10;
+  if (reps < opts->reps) reps = opts->reps;
+  Mesh msh = Mesh_new(0);
+  bool ok = true;
+  char extra[64];
+
+  Result tri = result_begin("mesh_triangulate", "point");
+  for (size_t r = 0; r < reps && ok; r++) {
+    const uint64_t start = now_ns();
+    ok = mesh_triangulate(&msh, 1, lists);
+    result_add(&tri, now_ns() - start, n);
+  }
+  snprintf(extra, sizeof(extra), ", \"cells\": %zu, \"ok\": %s", msh.count, ok ? "true" : "false");
+  result_end(&tri, out, dist, n, extra);
+  Mesh_free(&msh);
+}
+
+// one case, in the child process
+static void bench_case(FILE* out, const Options* opts, Distribution dist, size_t n) {
+  srand(0x69 + n + dist);
+  PList points = PList_new(n);
+  fill_points(&points, n, dist);
+  V2* queries = malloc(sizeof(V2) * N_QUERIES);
+  for (size_t i = 0; i < N_QUERIES; i++) {
+    queries[i] = v2(rand_float() * AREA_WIDTH, rand_float() * AREA_HEIGHT);
+  }
+
+  bench_insert(out, opts, dist, &points);
+  bench_build(out, opts, dist, &points);
+  bench_tree(out, opts, dist, &points, queries);
+  if (n <= opts->max_triangulate) bench_triangulate(out, opts, dist, &points);
+
+  free(queries);
+  PList_free(&points);
+}
+
+// run a case in a child and copy its records into out
+// false if the child failed
+static bool run_case(FILE* out, const Options* opts, Distribution dist, size_t n, size_t* n_records) {
+  int fds[2];
+  if (pipe(fds) != 0) return false;
+  fflush(out);
+  fflush(stderr);
+  const pid_t pid = fork();
+  if (pid < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return false;
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    FILE* records = fdopen(fds[1], "w");
+    bench_case(records, opts, dist, n);
+    fclose(records);
+    _exit(0);
+  }
+
+  close(fds[1]);
+  FILE* records = fdopen(fds[0], "r");
+  char line[RECORD_CAP];
+  while (fgets(line, sizeof(line), records) != NULL) {
+    line[strcspn(line, "\n")] = '\0';
+    fprintf(out, "%s\n    %s", *n_records > 0 ? "," : "", line);
+    (*n_records)++;
+  }
+  fclose(records);
+
+  int status;
+  waitpid(pid, &status, 0);
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static void usage(const char* prog) {
+  fprintf(stderr,
+          "usage: %s [-n max points] [-t max triangulated] [-r reps] [-o out.json]\n"
+          "  -n  largest input, sizes go up by 10x from %d (default %d)\n"
+          "  -t  largest input that is triangulated (default %d)\n"
+          "  -r  repetitions of every benchmark at least (default %d)\n"
+          "  -o  write the JSON results to out instead of stdout\n",
+          prog, MIN_POINTS, MAX_POINTS_DEFAULT, MAX_TRIANGULATE_DEFAULT, REPS_DEFAULT);
+}
+
+static bool parse_options(int argc, char** argv, Options* opts) {
+  *opts = (Options) {
+    .max_points = MAX_POINTS_DEFAULT,
+    .max_triangulate = MAX_TRIANGULATE_DEFAULT,
+    .reps = REPS_DEFAULT,
+  };
+  int c;
+  while ((c = getopt(argc, argv, "n:t:r:o:h")) != -1) {
+    switch (c) {
+      case 'n': opts->max_points = strtoul(optarg, NULL, 10); break;
+      case 't': opts->max_triangulate = strtoul(optarg, NULL, 10); break;
+      case 'r': opts->reps = strtoul(optarg, NULL, 10); break;
+      case 'o': opts->output = optarg; break;
+      default: return false;
+    }
+  }
+  return optind == argc && opts->max_points >= MIN_POINTS && opts->reps > 0;
+}
+
+int main(int argc, char** argv) {
+  Options opts;
+  if (!parse_options(argc, argv, &opts)) {
+    usage(argv[0]);
+    return 2;
+  }
+  // warnings about duplicates would be timed too
+  log_set_level(VERB_ERR);
+  FILE* out = opts.output != NULL ? fopen(opts.output, "w") : stdout;
+  if (out == NULL) {
+    fprintf(stderr, "Could not open %s\n", opts.output);
+    return 1;
+  }
+
+  fprintf(out, "{\n  \"index\": \"%s\",\n  \"leaf_cap\": %d,\n  \"reps\": %zu,\n  \"queries\": %d,\n  \"results\": [",
+          QINDEX_NAME, QTREE_LEAF_CAP, opts.reps, N_QUERIES);
+  size_t n_records = 0;
+  bool ok = true;
+  for (size_t n = MIN_POINTS; n <= opts.max_points; n *= 10) {
+    for (Distribution dist = DIST_UNIFORM; dist < N_DISTS; dist++) {
+      if (!run_case(out, &opts, dist, n, &n_records)) {
+        fprintf(stderr, "%s with %zu points failed\n", dist_to_cstr(dist), n);
+        ok = false;
+      }
+    }
+  }
+  fprintf(out, "\n  ]\n}\n");
+  if (out != stdout) fclose(out);
+  return ok ? 0 : 1;
+}
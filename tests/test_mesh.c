@@ -0,0 +1,1036 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "math.h"
+#include "unistd.h"
+#include "pthread.h"
+
+#include "logging.h"
+#include "mesh.h"
+#include "delaunay.h"
+#include "predicates.h"
+#include "mesh_io.h"
+#include "instrument.h"
+
+#define RED "\033[1;31m"
+#define GRN "\033[1;32m"
+#define RST "\033[0m"
+
+// success if c is true
+#define TEST_SUCCESS_FAILURE(c) c;\
+  fprintf(stderr, "%s%s: %s %s:%i\n" RST, c ? GRN : RED, c ? "PASSED" : "FAILED", \
+    __FUNCTION__, __FILE__, __LINE__)
+
+// Some test constants
+#define N_POINTS_DELAUNAY 512
+#define N_POINTS_MANY (64 * 1024)
+#define GRID_SIZE 16
+#define N_DUPLICATES 8
+#define N_COMB_TEETH 8
+#define N_POINTS_INNER 256
+#define N_STAR_SEGMENTS (16 * 1024)
+#define MIN_ANGLE 28.0f
+#define MAX_SIZE 0.05f
+#define MAX_STEINER 16
+#define N_GROW (64 * 1024)
+#define N_POINTS_IO 300
+#define N_PREDICATES 4096
+#define N_PREDICATE_THREADS 4
+
+float rand_float() {
+  return (float)rand() / (float)RAND_MAX;
+}
+
+int v2_lex_cmp(const void* a, const void* b) {
+  const V2* pa = a;
+  const V2* pb = b;
+  if (pa->x != pb->x) return pa->x < pb->x ? -1 : 1;
+  return (pa->y > pb->y) - (pa->y < pb->y);
+}
+
+// number of strictly convex vertices of the convex hull (monotone chain)
+size_t hull_size(const V2* points, size_t n) {
+  V2* sorted = malloc(sizeof(V2) * n);
+  V2* hull = malloc(sizeof(V2) * 2 * n);
+  memcpy(sorted, points, sizeof(V2) * n);
+  qsort(sorted, n, sizeof(V2), v2_lex_cmp);
+
+  size_t k = 0;
+  for (size_t i = 0; i < n; i++) {
+    while (k >= 2 && orient2d(hull[k - 2], hull[k - 1], sorted[i]) <= 0) k--;
+    hull[k++] = sorted[i];
+  }
+  for (size_t i = n - 1, lower = k + 1; i > 0; i--) {
+    while (k >= lower && orient2d(hull[k - 2], hull[k - 1], sorted[i - 1]) <= 0) k--;
+    hull[k++] = sorted[i - 1];
+  }
+  free(sorted);
+  free(hull);
+  return k - 1;
+}
+
+// counter clockwise cells with symmetric neighbors sharing an edge
+bool mesh_consistent(const Mesh* msh) {
+  for (size_t c = 0; c < msh->count; c++) {
+    const Cell* cell = &msh->cells[c];
+    if (orient2d(*cell->points[0], *cell->points[1], *cell->points[2]) <= 0) return false;
+
+    for (int k = 0; k < 3; k++) {
+      const int64_t nb = cell->neighbors[k];
+      if (nb < 0) continue;
+      if ((size_t)nb >= msh->count) return false;
+
+      const Cell* other = &msh->cells[nb];
+      const V2* a = cell->points[(k + 1) % 3];
+      const V2* b = cell->points[(k + 2) % 3];
+      bool found = false;
+      for (int j = 0; j < 3; j++) {
+        if (other->neighbors[j] == (int64_t)c) {
+          found = other->points[(j + 1) % 3] == b && other->points[(j + 2) % 3] == a;
+        }
+      }
+      if (!found) return false;
+    }
+  }
+  return true;
+}
+
+// the vertex opposite of every inner edge is outside the circumcircle
+bool mesh_locally_delaunay(const Mesh* msh, double eps) {
+  for (size_t c = 0; c < msh->count; c++) {
+    const Cell* cell = &msh->cells[c];
+    for (int k = 0; k < 3; k++) {
+      const int64_t nb = cell->neighbors[k];
+      if (nb < 0) continue;
+      const Cell* other = &msh->cells[nb];
+      for (int j = 0; j < 3; j++) {
+        if (other->neighbors[j] != (int64_t)c) continue;
+        if (incircle(*cell->points[0], *cell->points[1], *cell->points[2],
+                     *other->points[j]) > eps) {
+          return false;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+// even-odd rule, the loops are closed
+bool inside_loops(size_t n_loops, const PList* loops[], V2 p) {
+  bool inside = false;
+  for (size_t l = 0; l < n_loops; l++) {
+    const PList* loop = loops[l];
+    for (size_t i = 0, j = loop->count - 1; i < loop->count; j = i++) {
+      const V2 a = loop->points[i], b = loop->points[j];
+      if ((a.y > p.y) != (b.y > p.y)
+          && p.x < (b.x - a.x) * (p.y - a.y) / (b.y - a.y) + a.x) {
+        inside = !inside;
+      }
+    }
+  }
+  return inside;
+}
+
+void push_loop(EList* edges, PList* loop) {
+  for (size_t i = 0; i < loop->count; i++) {
+    EList_push(edges, &loop->points[i], &loop->points[(i + 1) % loop->count]);
+  }
+}
+
+bool mesh_has_edge(const Mesh* msh, const V2* a, const V2* b) {
+  for (size_t c = 0; c < msh->count; c++) {
+    const Cell* cell = &msh->cells[c];
+    for (int k = 0; k < 3; k++) {
+      if ((cell->points[k] == a && cell->points[(k + 1) % 3] == b)
+          || (cell->points[k] == b && cell->points[(k + 1) % 3] == a)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// all cells are inside of the loops and all loop edges are in the mesh
+bool mesh_respects_loops(const Mesh* msh, size_t n_loops, const PList* loops[]) {
+  for (size_t c = 0; c < msh->count; c++) {
+    const Cell* cell = &msh->cells[c];
+    const V2 centroid = v2_scale(v2_add(v2_add(*cell->points[0], *cell->points[1]),
+                                        *cell->points[2]), 1.0f / 3);
+    if (!inside_loops(n_loops, loops, centroid)) return false;
+  }
+  for (size_t l = 0; l < n_loops; l++) {
+    const PList* loop = loops[l];
+    for (size_t i = 0; i < loop->count; i++) {
+      if (!mesh_has_edge(msh, &loop->points[i], &loop->points[(i + 1) % loop->count])) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// smallest angle of a cell in degrees
+double cell_min_angle(const Cell* cell) {
+  double min = 180;
+  for (int k = 0; k < 3; k++) {
+    const V2 p = *cell->points[k];
+    const V2 a = v2_sub(*cell->points[(k + 1) % 3], p);
+    const V2 b = v2_sub(*cell->points[(k + 2) % 3], p);
+    const double angle = acos((a.x * b.x + a.y * b.y) / (v2_len(a) * v2_len(b))) * 180 / M_PI;
+    if (angle < min) min = angle;
+  }
+  return min;
+}
+
+double cell_max_edge(const Cell* cell) {
+  double max = 0;
+  for (int k = 0; k < 3; k++) {
+    const double len = v2_dist(*cell->points[k], *cell->points[(k + 1) % 3]);
+    if (len > max) max = len;
+  }
+  return max;
+}
+
+double mesh_area(const Mesh* msh) {
+  double area = 0;
+  for (size_t c = 0; c < msh->count; c++) {
+    const Cell* cell = &msh->cells[c];
+    area += orient2d(*cell->points[0], *cell->points[1], *cell->points[2]) / 2;
+  }
+  return area;
+}
+
+// coordinates in [1, 2) are multiples of 2^-23, so the determinants are exact in integers
+static __int128 grid(float v) {
+  return (__int128)ldexp(v, 23);
+}
+
+static float rand_grid_float(void) {
+  return 1 + (rand() % (1 << 23)) / (float)(1 << 23);
+}
+
+static int sign128(__int128 v) {
+  return (v > 0) - (v < 0);
+}
+
+static int sign(double v) {
+  return (v > 0) - (v < 0);
+}
+
+static __int128 orient_ref(V2 a, V2 b, V2 c) {
+  return (grid(b.x) - grid(a.x)) * (grid(c.y) - grid(a.y))
+       - (grid(b.y) - grid(a.y)) * (grid(c.x) - grid(a.x));
+}
+
+static __int128 incircle_ref(V2 a, V2 b, V2 c, V2 d) {
+  const __int128 adx = grid(a.x) - grid(d.x), ady = grid(a.y) - grid(d.y);
+  const __int128 bdx = grid(b.x) - grid(d.x), bdy = grid(b.y) - grid(d.y);
+  const __int128 cdx = grid(c.x) - grid(d.x), cdy = grid(c.y) - grid(d.y);
+  return (adx * adx + ady * ady) * (bdx * cdy - cdx * bdy)
+       + (bdx * bdx + bdy * bdy) * (cdx * ady - adx * cdy)
+       + (cdx * cdx + cdy * cdy) * (adx * bdy - bdx * ady);
+}
+
+// nearly collinear and nearly cocircular points, the sign has to match the exact one
+int test_predicates(void) {
+  predicate_stats_reset();
+  int suc = true;
+  for (size_t i = 0; i < N_PREDICATES && suc; i++) {
+    const V2 a = v2(rand_grid_float(), rand_grid_float());
+    const V2 b = v2(rand_grid_float(), rand_grid_float());
+    const float t = rand_float();
+    const V2 c = v2(a.x + t * (b.x - a.x), a.y + t * (b.y - a.y));
+    suc = sign(orient2d(a, b, c)) == sign128(orient_ref(a, b, c));
+  }
+  // points of a rotated square lattice, many are exactly collinear or cocircular
+  const float u = (rand() % (1 << 19)) / (float)(1 << 23);
+  const float v = (rand() % (1 << 19)) / (float)(1 << 23);
+  for (size_t i = 0; i < N_PREDICATES && suc; i++) {
+    V2 p[4];
+    for (int k = 0; k < 4; k++) {
+      const int x = rand() % 9 - 4, y = rand() % 9 - 4;
+      p[k] = v2(1.5 + x * u - y * v, 1.5 + x * v + y * u);
+    }
+    suc = sign(orient2d(p[0], p[1], p[2])) == sign128(orient_ref(p[0], p[1], p[2]))
+       && sign(incircle(p[0], p[1], p[2], p[3])) == sign128(incircle_ref(p[0], p[1], p[2], p[3]));
+  }
+  // exactly on the line and on the circle
+  const V2 o = v2(1.25, 1.5);
+  const float s = 0x1p-20;
+  suc = suc && orient2d(o, v2(o.x + 3 * s, o.y + s), v2(o.x + 6 * s, o.y + 2 * s)) == 0
+            && incircle(v2(o.x + 5 * s, o.y), v2(o.x + 3 * s, o.y + 4 * s),
+                        v2(o.x - 4 * s, o.y + 3 * s), v2(o.x, o.y - 5 * s)) == 0;
+
+  const PredicateStats st = predicate_stats();
+  suc = suc && st.orient2d_exact > 0 && st.incircle_exact > 0;
+  suc = TEST_SUCCESS_FAILURE(suc);
+  if (!suc) {
+    fprintf(stderr, "-> exact paths: %lu orient2d, %lu incircle\n",
+            st.orient2d_exact, st.incircle_exact);
+  }
+  return suc;
+}
+
+// exactly degenerate cases, each one takes the exact path
+static void* predicate_worker(void* user) {
+  PredicateStats* st = user;
+  predicate_stats_reset();
+  const float s = 0x1p-20;
+  for (size_t i = 0; i < N_PREDICATES; i++) {
+    const V2 o = v2(1 + i * s, 1.5);
+    orient2d(o, v2(o.x + 3 * s, o.y + s), v2(o.x + 6 * s, o.y + 2 * s));
+    incircle(v2(o.x + 5 * s, o.y), v2(o.x + 3 * s, o.y + 4 * s),
+             v2(o.x - 4 * s, o.y + 3 * s), v2(o.x, o.y - 5 * s));
+  }
+  *st = predicate_stats();
+  return NULL;
+}
+
+// sum of the numbers after every key in f
+static uint64_t sum_after(FILE* f, const char* key) {
+  char line[4096];
+  uint64_t sum = 0;
+  rewind(f);
+  while (fgets(line, sizeof(line), f) != NULL) {
+    for (const char* at = strstr(line, key); at != NULL; at = strstr(at + 1, key)) {
+      sum += strtoull(at + strlen(key), NULL, 10);
+    }
+  }
+  return sum;
+}
+
+// the exact paths of all threads are merged and exported
+int test_predicates_instrument(void) {
+  instr_reset();
+  instr_enable(true);
+  PredicateStats st[N_PREDICATE_THREADS] = {0};
+  pthread_t threads[N_PREDICATE_THREADS];
+  int suc = true;
+  for (int t = 0; t < N_PREDICATE_THREADS && suc; t++) {
+    suc = pthread_create(&threads[t], NULL, predicate_worker, &st[t]) == 0;
+  }
+  for (int t = 0; t < N_PREDICATE_THREADS && suc; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  instr_enable(false);
+
+  uint64_t orient = 0, circle = 0;
+  for (int t = 0; t < N_PREDICATE_THREADS; t++) {
+    orient += st[t].orient2d_exact;
+    circle += st[t].incircle_exact;
+  }
+  suc = suc && orient == N_PREDICATE_THREADS * N_PREDICATES && circle == orient;
+  if (!INSTRUMENT) orient = circle = 0;
+  suc = suc && instr_counter(CTR_ORIENT2D_EXACT) == orient && instr_counter(CTR_INCIRCLE_EXACT) == circle;
+
+  // the trace holds the counters per thread, the summary merged
+  char path[] = "/tmp/test_predicates_XXXXXX";
+  const int fd = mkstemp(path);
+  FILE* f = NULL;
+  suc = suc && fd >= 0 && instr_write_trace(path) && (f = fopen(path, "r")) != NULL;
+  suc = suc && sum_after(f, "\"orient2d_exact\": ") == orient
+    && sum_after(f, "\"incircle_exact\": ") == circle;
+  if (f != NULL) fclose(f);
+  f = suc ? fopen(path, "w+") : NULL;
+  if (f != NULL) instr_write_summary(f);
+  suc = suc && f != NULL && sum_after(f, "orient2d_exact") == orient && sum_after(f, "incircle_exact") == circle;
+  suc = TEST_SUCCESS_FAILURE(suc);
+
+  instr_reset();
+  if (f != NULL) fclose(f);
+  if (fd >= 0) {
+    close(fd);
+    unlink(path);
+  }
+  return suc;
+}
+
+int test_delaunay_empty_circle(void) {
+  PList points = PList_new(N_POINTS_DELAUNAY);
+  for (size_t i = 0; i < N_POINTS_DELAUNAY; i++) {
+    PList_push(&points, rand_float(), rand_float());
+  }
+  const PList* lists[] = {&points};
+  Mesh msh = Mesh_new(1);
+
+  int suc = mesh_triangulate(&msh, 1, lists);
+  // euler: every triangulation of n points with h on the hull has 2n - 2 - h cells
+  suc = suc && msh.count == 2 * N_POINTS_DELAUNAY - 2 - hull_size(points.points, points.count);
+  suc = suc && mesh_consistent(&msh);
+  for (size_t c = 0; c < msh.count && suc; c++) {
+    const Cell* cell = &msh.cells[c];
+    for (size_t i = 0; i < points.count && suc; i++) {
+      suc = incircle(*cell->points[0], *cell->points[1], *cell->points[2],
+                     points.points[i]) <= 1e-12;
+    }
+  }
+  suc = TEST_SUCCESS_FAILURE(suc);
+
+  Mesh_free(&msh);
+  PList_free(&points);
+  return suc;
+}
+
+int test_delaunay_grid(void) {
+  // collinear and cocircular points everywhere, split into two lists with duplicates
+  PList outline = PList_new(GRID_SIZE * GRID_SIZE);
+  PList inner = PList_new(GRID_SIZE * GRID_SIZE + N_DUPLICATES);
+  for (size_t i = 0; i < GRID_SIZE; i++) {
+    for (size_t j = 0; j < GRID_SIZE; j++) {
+      const bool border = i == 0 || j == 0 || i == GRID_SIZE - 1 || j == GRID_SIZE - 1;
+      PList_push(border ? &outline : &inner, i, j);
+    }
+  }
+  for (size_t i = 0; i < N_DUPLICATES; i++) {
+    PList_push(&inner, P_COORDS(outline.points[i]));
+  }
+  const PList* lists[] = {&outline, &inner};
+  Mesh msh = Mesh_new(1);
+
+  int suc = mesh_triangulate(&msh, 2, lists);
+  suc = suc && msh.count == 2 * (GRID_SIZE - 1) * (GRID_SIZE - 1);
+  suc = suc && mesh_consistent(&msh) && mesh_locally_delaunay(&msh, 0);
+  suc = TEST_SUCCESS_FAILURE(suc);
+
+  Mesh_free(&msh);
+  PList_free(&outline);
+  PList_free(&inner);
+  return suc;
+}
+
+int test_delaunay_many(void) {
+  PList points = PList_new(N_POINTS_MANY);
+  for (size_t i = 0; i < N_POINTS_MANY; i++) {
+    PList_push(&points, rand_float() * 1920, rand_float() * 1080);
+  }
+  const PList* lists[] = {&points};
+  Mesh msh = Mesh_new(1);
+
+  int suc = mesh_triangulate(&msh, 1, lists);
+  suc = suc && msh.count == 2 * N_POINTS_MANY - 2 - hull_size(points.points, points.count);
+  suc = suc && mesh_consistent(&msh) && mesh_locally_delaunay(&msh, 1e-3);
+  suc = TEST_SUCCESS_FAILURE(suc);
+
+  Mesh_free(&msh);
+  PList_free(&points);
+  return suc;
+}
+
+int test_delaunay_degenerate(void) {
+  PList points = PList_new(N_POINTS_DELAUNAY);
+  const PList* lists[] = {&points};
+  Mesh msh = Mesh_new(1);
+
+  // too few and collinear points have no triangles
+  PList_push(&points, 0, 0);
+  PList_push(&points, 1, 1);
+  int suc = !mesh_triangulate(&msh, 1, lists) && msh.count == 0;
+  PList_push(&points, 2, 2);
+  PList_push(&points, 3, 3);
+  suc = suc && mesh_triangulate(&msh, 1, lists) && msh.count == 0;
+
+  // one point off the line fans out to all of them
+  PList_push(&points, 0, 3);
+  suc = suc && mesh_triangulate(&msh, 1, lists) && msh.count == 3;
+  suc = suc && mesh_consistent(&msh);
+  suc = TEST_SUCCESS_FAILURE(suc);
+
+  Mesh_free(&msh);
+  PList_free(&points);
+  return suc;
+}
+
+int test_constrained_comb(void) {
+  // a comb with narrow gaps, the plain triangulation fills the gaps
+  PList outline = PList_new(4 * N_COMB_TEETH + 2);
+  for (size_t i = 0; i < N_COMB_TEETH; i++) {
+    PList_push(&outline, 4 * i, 0);
+    PList_push(&outline, 4 * i + 3, 0);
+    PList_push(&outline, 4 * i + 3, 10);
+    PList_push(&outline, 4 * i + 4, 10);
+  }
+  PList_push(&outline, 4 * N_COMB_TEETH, 12);
+  PList_push(&outline, 0, 12);
+
+  const PList* loops[] = {&outline};
+  PList inner = PList_new(N_POINTS_INNER);
+  while (inner.count < N_POINTS_INNER) {
+    const V2 p = v2(rand_float() * 4 * N_COMB_TEETH, rand_float() * 12);
+    if (inside_loops(1, loops, p)) PList_push(&inner, P_COORDS(p));
+  }
+
+  EList edges = EList_new(outline.count);
+  push_loop(&edges, &outline);
+  const PList* lists[] = {&outline, &inner};
+  Mesh msh = Mesh_new(1);
+
+  int suc = mesh_triangulate_constrained(&msh, 2, lists, &edges);
+  // polygon with n vertices and m points inside has 2m + n - 2 cells
+  suc = suc && msh.count == 2 * inner.count + outline.count - 2;
+  suc = suc && mesh_consistent(&msh) && mesh_locally_delaunay(&msh, 1e-6);
+  suc = suc && mesh_respects_loops(&msh, 1, loops);
+  suc = TEST_SUCCESS_FAILURE(suc);
+
+  Mesh_free(&msh);
+  EList_free(&edges);
+  PList_free(&outline);
+  PList_free(&inner);
+  return suc;
+}
+
+int test_constrained_hole(void) {
+  // grid with a square hole, the constraints run through grid points
+  PList outer = PList_new(4);
+  PList hole = PList_new(4);
+  PList grid = PList_new(GRID_SIZE * GRID_SIZE);
+  PList_push(&outer, 0, 0);
+  PList_push(&outer, GRID_SIZE, 0);
+  PList_push(&outer, GRID_SIZE, GRID_SIZE);
+  PList_push(&outer, 0, GRID_SIZE);
+  PList_push(&hole, 4, 4);
+  PList_push(&hole, 4, GRID_SIZE - 4);
+  PList_push(&hole, GRID_SIZE - 4, GRID_SIZE - 4);
+  PList_push(&hole, GRID_SIZE - 4, 4);
+  for (size_t i = 0; i <= GRID_SIZE; i++) {
+    for (size_t j = 0; j <= GRID_SIZE; j++) {
+      if ((i == 0 || i == GRID_SIZE) && (j == 0 || j == GRID_SIZE)) continue;
+      PList_push(&grid, i + 0.5f * (j % 2), j);
+    }
+  }
+
+  EList edges = EList_new(8);
+  push_loop(&edges, &outer);
+  push_loop(&edges, &hole);
+  const PList* loops[] = {&outer, &hole};
+  const PList* lists[] = {&outer, &hole, &grid};
+  Mesh msh = Mesh_new(1);
+
+  int suc = mesh_triangulate_constrained(&msh, 3, lists, &edges);
+  suc = suc && msh.count > 0;
+  suc = suc && mesh_consistent(&msh) && mesh_locally_delaunay(&msh, 0);
+  // the loops are split at the grid points on them, the centroids still tell
+  for (size_t c = 0; c < msh.count && suc; c++) {
+    const Cell* cell = &msh.cells[c];
+    const V2 centroid = v2_scale(v2_add(v2_add(*cell->points[0], *cell->points[1]),
+                                        *cell->points[2]), 1.0f / 3);
+    suc = inside_loops(2, loops, centroid);
+  }
+  suc = TEST_SUCCESS_FAILURE(suc);
+
+  Mesh_free(&msh);
+  EList_free(&edges);
+  PList_free(&outer);
+  PList_free(&hole);
+  PList_free(&grid);
+  return suc;
+}
+
+int test_constrained_many(void) {
+  // star shaped outline with a jagged radius and points inside
+  PList outline = PList_new(N_STAR_SEGMENTS);
+  PList inner = PList_new(N_STAR_SEGMENTS);
+  for (size_t i = 0; i < N_STAR_SEGMENTS; i++) {
+    const float phi = 2 * M_PI * i / N_STAR_SEGMENTS;
+    const float r = 400 + (i % 2 ? 100 : 0) + rand_float() * 50;
+    PList_push(&outline, 500 + r * cosf(phi), 500 + r * sinf(phi));
+    const float r_in = rand_float() * 380;
+    PList_push(&inner, 500 + r_in * cosf(phi), 500 + r_in * sinf(phi));
+  }
+
+  EList edges = EList_new(outline.count);
+  push_loop(&edges, &outline);
+  const PList* lists[] = {&outline, &inner};
+  Mesh msh = Mesh_new(1);
+
+  int suc = mesh_triangulate_constrained(&msh, 2, lists, &edges);
+  suc = suc && msh.count == 2 * inner.count + outline.count - 2;
+  suc = suc && mesh_consistent(&msh) && mesh_locally_delaunay(&msh, 1e-3);
+  suc = TEST_SUCCESS_FAILURE(suc);
+
+  Mesh_free(&msh);
+  EList_free(&edges);
+  PList_free(&outline);
+  PList_free(&inner);
+  return suc;
+}
+
+int test_refine_angle(void) {
+  // the comb from test_constrained_comb, without inner points
+  PList outline = PList_new(4 * N_COMB_TEETH + 2);
+  for (size_t i = 0; i < N_COMB_TEETH; i++) {
+    PList_push(&outline, 4 * i, 0);
+    PList_push(&outline, 4 * i + 3, 0);
+    PList_push(&outline, 4 * i + 3, 10);
+    PList_push(&outline, 4 * i + 4, 10);
+  }
+  PList_push(&outline, 4 * N_COMB_TEETH, 12);
+  PList_push(&outline, 0, 12);
+  const PList* loops[] = {&outline};
+
+  EList edges = EList_new(outline.count);
+  push_loop(&edges, &outline);
+  PList steiner = PList_new(1);
+  const PList* lists[] = {&outline};
+  const MeshQuality quality = { .min_angle = MIN_ANGLE };
+  Mesh msh = Mesh_new(1);
+
+  int suc = mesh_refine(&msh, 1, lists, &edges, &quality, &steiner);
+  suc = suc && steiner.count > 0 && mesh_consistent(&msh);
+  // area of the comb: teeth of 3 x 10 and the 4 * N_COMB_TEETH x 2 back
+  suc = suc && fabs(mesh_area(&msh) - N_COMB_TEETH * 38) < 1e-3;
+  for (size_t c = 0; c < msh.count && suc; c++) {
+    const Cell* cell = &msh.cells[c];
+    const V2 centroid = v2_scale(v2_add(v2_add(*cell->points[0], *cell->points[1]),
+                                        *cell->points[2]), 1.0f / 3);
+    suc = cell_min_angle(cell) >= MIN_ANGLE - 1e-2 && inside_loops(1, loops, centroid);
+  }
+  suc = TEST_SUCCESS_FAILURE(suc);
+
+  Mesh_free(&msh);
+  EList_free(&edges);
+  PList_free(&outline);
+  PList_free(&steiner);
+  return suc;
+}
+
+// fine at x = 0, coarse at x = 1
+float graded_size(V2 point, void* user) {
+  (void) user;
+  return MAX_SIZE * (1 + 4 * point.x);
+}
+
+int test_refine_size(void) {
+  PList square = PList_new(4);
+  PList_push(&square, 0, 0);
+  PList_push(&square, 1, 0);
+  PList_push(&square, 1, 1);
+  PList_push(&square, 0, 1);
+  EList edges = EList_new(4);
+  push_loop(&edges, &square);
+  PList steiner = PList_new(1);
+  const PList* lists[] = {&square};
+  const MeshQuality quality = { .min_angle = 20, .size = graded_size };
+  Mesh msh = Mesh_new(1);
+
+  int suc = mesh_refine(&msh, 1, lists, &edges, &quality, &steiner);
+  suc = suc && mesh_consistent(&msh) && fabs(mesh_area(&msh) - 1) < 1e-4;
+  size_t n_left = 0, n_right = 0;
+  for (size_t c = 0; c < msh.count && suc; c++) {
+    const Cell* cell = &msh.cells[c];
+    const V2 centroid = v2_scale(v2_add(v2_add(*cell->points[0], *cell->points[1]),
+                                        *cell->points[2]), 1.0f / 3);
+    suc = cell_max_edge(cell) <= graded_size(centroid, NULL) * (1 + 1e-4);
+    suc = suc && cell_min_angle(cell) >= 20 - 1e-2;
+    if (centroid.x < 0.5) n_left++; else n_right++;
+  }
+  // the grading shows in the cell counts
+  suc = suc && n_left > 2 * n_right;
+
+  // with too few points the mesh is valid but not refined all the way
+  const MeshQuality limited = { .min_angle = 20, .size = graded_size, .max_points = MAX_STEINER };
+  PList small = PList_new(1);
+  suc = suc && !mesh_refine(&msh, 1, lists, &edges, &limited, &small);
+  suc = suc && small.count == MAX_STEINER && mesh_consistent(&msh);
+  suc = suc && fabs(mesh_area(&msh) - 1) < 1e-4;
+  suc = TEST_SUCCESS_FAILURE(suc);
+
+  Mesh_free(&msh);
+  EList_free(&edges);
+  PList_free(&square);
+  PList_free(&steiner);
+  PList_free(&small);
+  return suc;
+}
+
+int test_refine_points(void) {
+  // random points without constraints refine inside of their hull
+  PList points = PList_new(N_POINTS_DELAUNAY);
+  for (size_t i = 0; i < N_POINTS_DELAUNAY; i++) {
+    PList_push(&points, rand_float(), rand_float());
+  }
+  PList steiner = PList_new(1);
+  const PList* lists[] = {&points};
+  const MeshQuality quality = { .min_angle = 25 };
+  Mesh msh = Mesh_new(1);
+  Mesh plain = Mesh_new(1);
+
+  int suc = mesh_refine(&msh, 1, lists, NULL, &quality, &steiner);
+  suc = suc && mesh_triangulate(&plain, 1, lists);
+  suc = suc && mesh_consistent(&msh) && fabs(mesh_area(&msh) - mesh_area(&plain)) < 1e-4;
+  suc = suc && mesh_locally_delaunay(&msh, 1e-9);
+  for (size_t c = 0; c < msh.count && suc; c++) {
+    suc = cell_min_angle(&msh.cells[c]) >= 25 - 1e-2;
+  }
+  suc = TEST_SUCCESS_FAILURE(suc);
+
+  Mesh_free(&msh);
+  Mesh_free(&plain);
+  PList_free(&points);
+  PList_free(&steiner);
+  return suc;
+}
+
+int test_imesh_from_mesh(void) {
+  PList outline = PList_new(GRID_SIZE * GRID_SIZE);
+  PList inner = PList_new(N_POINTS_DELAUNAY);
+  for (size_t i = 0; i < GRID_SIZE; i++) {
+    PList_push(&outline, i, 0);
+    PList_push(&outline, GRID_SIZE, i);
+    PList_push(&outline, GRID_SIZE - i, GRID_SIZE);
+    PList_push(&outline, 0, GRID_SIZE - i);
+  }
+  for (size_t i = 0; i < N_POINTS_DELAUNAY; i++) {
+    PList_push(&inner, 1 + rand_float() * (GRID_SIZE - 2), 1 + rand_float() * (GRID_SIZE - 2));
+  }
+  const PList* lists[] = {&outline, &inner};
+  Mesh msh = Mesh_new(1);
+  IMesh imsh = IMesh_new(0, 0);
+
+  int suc = mesh_triangulate(&msh, 2, lists) && IMesh_from_mesh(&imsh, &msh);
+  suc = suc && imsh.n_verts == outline.count + inner.count && imsh.n_cells == msh.count;
+  for (size_t c = 0; c < msh.count && suc; c++) {
+    for (int k = 0; k < 3 && suc; k++) {
+      const int64_t nb = msh.cells[c].neighbors[k];
+      suc = v2_eq(imesh_cell_point(&imsh, c, k), *msh.cells[c].points[k]);
+      suc = suc && imesh_neighbor(&imsh, c, k) == (nb < 0 ? IMESH_NONE : (uint32_t)nb);
+    }
+  }
+  // cells sharing an edge share the vertex indices
+  for (size_t c = 0; c < imsh.n_cells && suc; c++) {
+    for (int k = 0; k < 3 && suc; k++) {
+      const uint32_t nb = imesh_neighbor(&imsh, c, k);
+      if (nb == IMESH_NONE) continue;
+      const uint32_t a = imesh_cell_vertex(&imsh, c, (k + 1) % 3);
+      const uint32_t b = imesh_cell_vertex(&imsh, c, (k + 2) % 3);
+      int shared = 0;
+      for (int j = 0; j < 3; j++) {
+        const uint32_t v = imesh_cell_vertex(&imsh, nb, j);
+        shared += v == a || v == b;
+      }
+      suc = shared == 2;
+    }
+  }
+  // indices past 32 bits are refused before the cells are read
+  const Mesh huge = { .cells = NULL, .count = (UINT32_MAX - 1) / 3 + 1 };
+  suc = suc && !IMesh_from_mesh(&imsh, &huge);
+  suc = TEST_SUCCESS_FAILURE(suc);
+
+  IMesh_free(&imsh);
+  Mesh_free(&msh);
+  PList_free(&outline);
+  PList_free(&inner);
+  return suc;
+}
+
+// whole contents of path, NULL if it can not be read
+static char* read_file(const char* path, size_t* len) {
+  FILE* f = fopen(path, "rb");
+  if (f == NULL) return NULL;
+  fseek(f, 0, SEEK_END);
+  *len = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  char* data = malloc(*len + 1);
+  if (data != NULL && fread(data, 1, *len, f) == *len) {
+    data[*len] = '\0';
+  } else {
+    free(data);
+    data = NULL;
+  }
+  fclose(f);
+  return data;
+}
+
+static uint32_t read_u32(const char* data, bool big_endian) {
+  const uint8_t* b = (const uint8_t*)data;
+  return big_endian
+    ? (uint32_t)b[0] << 24 | (uint32_t)b[1] << 16 | (uint32_t)b[2] << 8 | b[3]
+    : (uint32_t)b[3] << 24 | (uint32_t)b[2] << 16 | (uint32_t)b[1] << 8 | b[0];
+}
+
+static float read_f32(const char* data, bool big_endian) {
+  const uint32_t v = read_u32(data, big_endian);
+  float f;
+  memcpy(&f, &v, sizeof(f));
+  return f;
+}
+
+int test_mesh_io(void) {
+  PList points = PList_new(N_POINTS_IO);
+  for (size_t i = 0; i < N_POINTS_IO; i++) {
+    PList_push(&points, rand_float() * 1920 - 960, rand_float() * 1e-3f);
+  }
+  const PList* lists[] = {&points};
+  Mesh msh = Mesh_new(1);
+  IMesh imsh = IMesh_new(0, 0);
+  char path[] = "/tmp/gen_mesh_io_XXXXXX";
+  const int fd = mkstemp(path);
+  int suc = fd >= 0 && mesh_triangulate(&msh, 1, lists) && IMesh_from_mesh(&imsh, &msh);
+  if (fd >= 0) close(fd);
+  const size_t nv = imsh.n_verts, nc = imsh.n_cells;
+  size_t len = 0;
+  char* data = NULL;
+
+  // text reads back to the same floats
+  suc = suc && IMesh_write(&imsh, path, MESH_FMT_TEXT) && (data = read_file(path, &len)) != NULL;
+  if (suc) {
+    char* cur = data;
+    suc = strtoul(cur, &cur, 10) == nv && strtoul(cur, &cur, 10) == nc;
+    for (size_t v = 0; v < nv && suc; v++) {
+      suc = strtof(cur, &cur) == imsh.x[v] && strtof(cur, &cur) == imsh.y[v];
+    }
+    for (size_t i = 0; i < 3 * nc && suc; i++) {
+      suc = strtoul(cur, &cur, 10) == imsh.verts[i];
+    }
+  }
+  free(data);
+  data = NULL;
+
+  suc = suc && IMesh_write(&imsh, path, MESH_FMT_VTK_ASCII) && (data = read_file(path, &len)) != NULL;
+  if (suc) {
+    char* cur = strstr(data, "POINTS ");
+    suc = cur != NULL && strtoul(cur + 7, &cur, 10) == nv;
+    cur = suc ? strchr(cur, '\n') : NULL;
+    for (size_t v = 0; v < nv && cur != NULL && suc; v++) {
+      suc = strtof(cur, &cur) == imsh.x[v] && strtof(cur, &cur) == imsh.y[v] && strtof(cur, &cur) == 0;
+    }
+    cur = suc ? strstr(cur, "CELLS ") : NULL;
+    suc = cur != NULL && strtoul(cur + 6, &cur, 10) == nc && strtoul(cur, &cur, 10) == 4 * nc;
+    for (size_t c = 0; c < nc && suc; c++) {
+      suc = strtoul(cur, &cur, 10) == 3;
+      for (int k = 0; k < 3 && suc; k++) {
+        suc = strtoul(cur, &cur, 10) == imsh.verts[3 * c + k];
+      }
+    }
+    suc = suc && strstr(cur, "CELL_TYPES ") != NULL;
+  }
+  free(data);
+  data = NULL;
+
+  // binary VTK is big endian
+  suc = suc && IMesh_write(&imsh, path, MESH_FMT_VTK_BINARY) && (data = read_file(path, &len)) != NULL;
+  if (suc) {
+    const char* pts = strstr(data, " float\n");
+    suc = strstr(data, "\nBINARY\n") != NULL && pts != NULL;
+    pts = suc ? pts + 7 : NULL;
+    for (size_t v = 0; v < nv && suc; v++) {
+      suc = read_f32(&pts[12 * v], true) == imsh.x[v] && read_f32(&pts[12 * v + 4], true) == imsh.y[v];
+    }
+    const char* cells = suc ? &pts[12 * nv] : NULL;
+    suc = suc && strncmp(cells, "\nCELLS ", 7) == 0;
+    cells = suc ? strchr(cells + 1, '\n') + 1 : NULL;
+    for (size_t c = 0; c < nc && suc; c++) {
+      suc = read_u32(&cells[16 * c], true) == 3
+        && read_u32(&cells[16 * c + 4], true) == imsh.verts[3 * c]
+        && read_u32(&cells[16 * c + 12], true) == imsh.verts[3 * c + 2];
+    }
+    const char* types = suc ? strchr(&cells[16 * nc + 1], '\n') + 1 : NULL;
+    suc = suc && read_u32(types, true) == 5 && (size_t)(types - data) + 4 * nc + 1 == len;
+  }
+  free(data);
+  data = NULL;
+
+  // raw appended arrays, each preceded by its size
+  suc = suc && IMesh_write(&imsh, path, MESH_FMT_VTU) && (data = read_file(path, &len)) != NULL;
+  if (suc) {
+    const char* app = strstr(data, "<AppendedData encoding=\"raw\">");
+    app = app != NULL ? strchr(app, '_') : NULL;
+    suc = app != NULL;
+    uint64_t size = 0;
+    if (suc) memcpy(&size, app + 1, sizeof(size));
+    suc = suc && size == 12 * nv;
+    const float* p = (const float*)(app + 1 + sizeof(size));
+    for (size_t v = 0; v < nv && suc; v++) {
+      float xyz[3];
+      memcpy(xyz, &p[3 * v], sizeof(xyz));
+      suc = xyz[0] == imsh.x[v] && xyz[1] == imsh.y[v] && xyz[2] == 0;
+    }
+    const char* conn = app + 1 + sizeof(size) + 12 * nv;
+    if (suc) memcpy(&size, conn, sizeof(size));
+    suc = suc && size == 12 * nc && memcmp(conn + sizeof(size), imsh.verts, size) == 0;
+    const size_t arrays = 4 * sizeof(uint64_t) + 12 * nv + 12 * nc + 4 * nc + nc;
+    suc = suc && strcmp(app + 1 + arrays, "\n  </AppendedData>\n</VTKFile>\n") == 0;
+  }
+  free(data);
+  data = NULL;
+
+  // counts past the 32 bit fields of VTU and STL are refused before anything is written
+  IMesh huge = imsh;
+  huge.n_cells = INT32_MAX / 3 + 1;
+  suc = suc && !IMesh_write(&huge, path, MESH_FMT_VTU);
+  huge.n_cells = (size_t)UINT32_MAX + 1;
+  suc = suc && !IMesh_write(&huge, path, MESH_FMT_STL);
+
+  // binary STL, little endian, 50 bytes per triangle
+  suc = suc && IMesh_write(&imsh, path, MESH_FMT_STL) && (data = read_file(path, &len)) != NULL;
+  suc = suc && len == 84 + 50 * nc && strncmp(data, "solid", 5) != 0 && read_u32(&data[80], false) == nc;
+  for (size_t c = 0; c < nc && suc; c++) {
+    const char* tri = &data[84 + 50 * c];
+    suc = read_f32(&tri[8], false) == 1;
+    for (int k = 0; k < 3 && suc; k++) {
+      const V2 p = imesh_cell_point(&imsh, c, k);
+      suc = read_f32(&tri[12 + 12 * k], false) == p.x && read_f32(&tri[16 + 12 * k], false) == p.y;
+    }
+  }
+  free(data);
+
+  suc = suc && mesh_format_from_path("a/b.VTU") == MESH_FMT_VTU
+    && mesh_format_from_path("a.b/mesh") == MESH_FMT_TEXT
+    && mesh_format_from_cstr(mesh_format_to_cstr(MESH_FMT_VTK_ASCII)) == MESH_FMT_VTK_ASCII
+    && mesh_format_from_cstr("obj") == MESH_FMT_NUM;
+  suc = TEST_SUCCESS_FAILURE(suc);
+
+  unlink(path);
+  IMesh_free(&imsh);
+  Mesh_free(&msh);
+  PList_free(&points);
+  return suc;
+}
+
+int test_mesh_file(void) {
+  PList outline = PList_new(4);
+  PList points = PList_new(N_POINTS_IO);
+  PList_push(&outline, -1, -1);
+  PList_push(&outline, 1, -1);
+  PList_push(&outline, 1, 1);
+  PList_push(&outline, -1, 1);
+  for (size_t i = 0; i < N_POINTS_IO; i++) {
+    PList_push(&points, rand_float() * 1.8f - 0.9f, rand_float() * 1.8f - 0.9f);
+  }
+  const PList* lists[] = {&outline, &points};
+  Mesh msh = Mesh_new(1);
+  IMesh imsh = IMesh_new(0, 0);
+  LQTree lqtree = lqtree_new(v2(0, 0), 2, 2, 0);
+  MeshFile file = {0};
+  char path[] = "/tmp/gen_mesh_file_XXXXXX";
+  const int fd = mkstemp(path);
+  int suc = fd >= 0 && mesh_triangulate(&msh, 2, lists) && IMesh_from_mesh(&imsh, &msh);
+  if (fd >= 0) close(fd);
+  suc = suc && lqtree_insert_batch(&lqtree, points.points, points.count) == points.count;
+
+  // the mapped arrays are the written ones, aligned and borrowed
+  suc = suc && MeshFile_write(path, &outline, &points, &lqtree, &imsh, true);
+  suc = suc && MeshFile_map(&file, path, true);
+  suc = suc && file.outline.view && file.points.view && file.qtree.view && file.mesh.view;
+  suc = suc && file.outline.count == outline.count && file.points.count == points.count
+    && file.qtree.count == lqtree.count && file.mesh.n_verts == imsh.n_verts
+    && file.mesh.n_cells == imsh.n_cells;
+  suc = suc && memcmp(file.outline.points, outline.points, sizeof(V2) * outline.count) == 0
+    && memcmp(file.points.points, points.points, sizeof(V2) * points.count) == 0
+    && memcmp(file.qtree.keys, lqtree.keys, sizeof(uint64_t) * lqtree.count) == 0
+    && memcmp(file.mesh.x, imsh.x, sizeof(float) * imsh.n_verts) == 0
+    && memcmp(file.mesh.y, imsh.y, sizeof(float) * imsh.n_verts) == 0
+    && memcmp(file.mesh.verts, imsh.verts, sizeof(uint32_t) * 3 * imsh.n_cells) == 0
+    && memcmp(file.mesh.neighbors, imsh.neighbors, sizeof(uint32_t) * 3 * imsh.n_cells) == 0;
+  suc = suc && (uintptr_t)file.points.points % MESH_FILE_ALIGN == 0
+    && (uintptr_t)file.mesh.verts % MESH_FILE_ALIGN == 0;
+  suc = suc && file.min.x == -1 && file.min.y == -1 && file.max.x == 1 && file.max.y == 1;
+  const V2 query = v2(0.1f, 0.2f);
+  suc = suc && lqtree_find_closest(&file.qtree, &query, NULL)
+    == &file.qtree.points[lqtree_find_closest(&lqtree, &query, NULL) - lqtree.points];
+
+  // growing a view copies it, the mapping stays as it is
+  const V2* mapped = file.points.points;
+  suc = suc && PList_push(&file.points, 5, 5) && !file.points.view && file.points.points != mapped;
+  suc = suc && memcmp(file.points.points, mapped, sizeof(V2) * points.count) == 0;
+  suc = suc && lqtree_insert(&file.qtree, v2(0.95f, 0.95f)) && !file.qtree.view;
+  MeshFile_unmap(&file);
+
+  // damage is caught by the checksum, a truncated file by its size
+  FILE* f = suc ? fopen(path, "r+b") : NULL;
+  suc = suc && f != NULL && fseek(f, -1, SEEK_END) == 0 && fputc(1, f) != EOF;
+  if (f != NULL) fclose(f);
+  suc = suc && !MeshFile_map(&file, path, true) && MeshFile_map(&file, path, false);
+  MeshFile_unmap(&file);
+  suc = suc && truncate(path, 100) == 0 && !MeshFile_map(&file, path, false);
+
+  // a file of only a mesh, through the exporters
+  suc = suc && IMesh_write(&imsh, path, MESH_FMT_NATIVE) && MeshFile_map(&file, path, true);
+  suc = suc && file.outline.count == 0 && file.qtree.count == 0 && file.mesh.n_cells == imsh.n_cells;
+  suc = suc && mesh_format_from_path("mesh.gmb") == MESH_FMT_NATIVE;
+  suc = TEST_SUCCESS_FAILURE(suc);
+
+  MeshFile_unmap(&file);
+  unlink(path);
+  lqtree_free(&lqtree);
+  IMesh_free(&imsh);
+  Mesh_free(&msh);
+  PList_free(&points);
+  PList_free(&outline);
+  return suc;
+}
+
+int test_growable_lists(void) {
+  PList points = PList_new(0);
+  EList edges = EList_new(0);
+  Mesh msh = Mesh_new(0);
+  int suc = true;
+  for (size_t i = 0; i < N_GROW && suc; i++) {
+    const V2* old = points.points;
+    suc = PList_push(&points, i, i % 3);
+    if (points.points != old) {
+      EList_rebase(&edges, old, points.count - 1, points.points);
+      Mesh_rebase(&msh, old, points.count - 1, points.points);
+    }
+    if (i >= 2) {
+      V2* p = points.points;
+      int64_t neighbors[3] = {-1, -1, -1};
+      suc = suc && EList_push(&edges, &p[i - 1], &p[i]);
+      suc = suc && Mesh_push(&msh, &p[i - 2], &p[i - 1], &p[i], neighbors);
+    }
+  }
+  suc = suc && points.count == N_GROW && points.cap >= N_GROW && points.cap < 2 * N_GROW;
+  // shrinking may move the points as well
+  const V2* old = points.points;
+  suc = suc && PList_shrink(&points) && points.cap == N_GROW;
+  EList_rebase(&edges, old, points.count, points.points);
+  Mesh_rebase(&msh, old, points.count, points.points);
+  suc = suc && EList_shrink(&edges) && Mesh_shrink(&msh);
+  // everything still points at the right points, and into the list
+  for (size_t i = 2; i < N_GROW && suc; i++) {
+    suc = edges.edges[i - 2].p1 == &points.points[i] && edges.edges[i - 2].p1->x == i;
+    suc = suc && msh.cells[i - 2].points[0] == &points.points[i - 2];
+  }
+  suc = suc && PList_reserve(&points, 4 * N_GROW) && points.cap == 4 * N_GROW;
+  suc = suc && PList_reserve(&points, N_GROW) && points.cap == 4 * N_GROW;
+  suc = TEST_SUCCESS_FAILURE(suc);
+
+  PList_free(&points);
+  EList_free(&edges);
+  Mesh_free(&msh);
+  return suc;
+}
+
+typedef int (test_func)(void);
+bool exec_test(test_func func) {
+  bool suc = func();
+  if (!suc) fprintf(stderr, "==============================================\n");
+  return suc;
+}
+
+int main() {
+  srand(0x69);
+  log_set_level(VERB_ERR);
+  test_func *functions[] = {
+    &test_predicates,
+    &test_predicates_instrument,
+    &test_delaunay_empty_circle,
+    &test_delaunay_grid,
+    &test_delaunay_many,
+    &test_delaunay_degenerate,
+    &test_constrained_comb,
+    &test_constrained_hole,
+    &test_constrained_many,
+    &test_refine_angle,
+    &test_refine_size,
+    &test_refine_points,
+    &test_imesh_from_mesh,
+    &test_mesh_io,
+    &test_mesh_file,
+    &test_growable_lists,
+  };
+
+  size_t n_funcs = sizeof(functions)/(sizeof(functions[0]));
+  for (size_t i = 0; i < n_funcs; i++) {
+    if (!exec_test(functions[i])) break;
+  }
+}
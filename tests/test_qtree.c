@@ -2,10 +2,15 @@
 #include "stdio.h"
 #include "stdlib.h"
 #include "string.h"
+#include "math.h"
+#include "unistd.h"
+#include "pthread.h"
 
-#define VERB_LEVEL VERB_ERR
 #include "logging.h"
+#include "instrument.h"
 #include "qtree.h"
+#include "v2batch.h"
+#include "point_stream.h"
 
 #define AREA_WIDTH 10.0
 #define AREA_HEIGHT 10.0
@@ -22,8 +27,18 @@
 // Some test constants
 #define NODE_LOG_SIZE (12 + 2 + 12 + 1 + 4 + 10 + 1)
 #define N_INSERTIONS 1024
-#define N_POINTS_CLOSEST 128
+#define N_PARALLEL_POINTS (16 * 1024)
+#define N_POINTS_CLOSEST 1024
 #define N_TESTS_CLOSEST 128
+#define N_SETS_CLOSEST 8
+#define N_KNN 8
+#define N_BATCH 1027
+#define N_STREAM_POINTS (128 * 1024) // several chunks of text
+#define STREAM_READ 1000
+#define N_LOG_THREADS 4
+#define N_LOG_MESSAGES (3 * LOG_RING_SLOTS) // more than a ring holds
+#define N_INSTR_THREADS 4
+#define N_INSTR_SCOPES 1000
 
 float rand_float() {
   return (float)rand() / (float)RAND_MAX;
@@ -49,37 +64,96 @@ void qtree_traverse_node_to_buf(char* buf, size_t buf_size, size_t *cur_idx, Nod
   }
 }
 
+// structural equality of two trees, points of a leaf may be in any order
+bool qtree_eq(const Node* a, const Node* b) {
+  if (a->type != b->type || a->w != b->w || a->h != b->h) {
+    return false;
+  }
+  if (a->type == NODE_LEAF) {
+    if (a->count != b->count) return false;
+    for (uint32_t i = 0; i < a->count; i++) {
+      bool found = false;
+      for (uint32_t j = 0; j < b->count && !found; j++) {
+        found = v2_eq(a->points[i], b->points[j]);
+      }
+      if (!found) return false;
+    }
+    return true;
+  }
+  if (!v2_eq(a->pos, b->pos)) {
+    return false;
+  }
+  if (a->type == NODE_BRANCH || a->type == NODE_ROOT) {
+    if ((a->children == NULL) != (b->children == NULL)) return false;
+    if (a->children == NULL) return true;
+    for (size_t rpos = RELPOS_UR; rpos < RELPOS_NUM; rpos++) {
+      if (!qtree_eq(&a->children[rpos], &b->children[rpos])) return false;
+    }
+  }
+  return true;
+}
+
 int test_qtree_insert_number(void) {
   V2 mid = v2(0, 0);
-  Node root = node_new(mid, NODE_ROOT, AREA_WIDTH, AREA_HEIGHT);
+  QTree tree = qtree_new(mid, AREA_WIDTH, AREA_HEIGHT);
 
   for (size_t i = 0; i < N_INSERTIONS; i++) {
     float x = (float)rand() / (float)RAND_MAX * AREA_WIDTH / 2;
     float y = (float)rand() / (float)RAND_MAX * AREA_HEIGHT / 2;
-    qtree_insert(&root, v2(x, y));
+    qtree_insert(&tree, v2(x, y));
   }
 
-  size_t leaves = qtree_count_leaves(&root);
+  size_t leaves = qtree_count_leaves(&tree.root);
   int suc = TEST_SUCCESS_FAILURE(leaves == N_INSERTIONS);
   if (!suc) {
     fprintf(stderr, "-> Expected %ld leaves, got %ld.\n", (long)N_INSERTIONS, leaves);
   }
 
-  qtree_free(&root);
+  qtree_free(&tree);
+  return suc;
+}
+
+int test_qtree_reset(void) {
+  V2 mid = v2(0, 0);
+  QTree tree = qtree_new(mid, AREA_WIDTH, AREA_HEIGHT);
+
+  // fill more than one arena chunk, so reset has to recycle several
+  for (size_t i = 0; i < N_INSERTIONS; i++) {
+    float x = rand_float() * AREA_WIDTH - AREA_WIDTH / 2;
+    float y = rand_float() * AREA_HEIGHT - AREA_HEIGHT / 2;
+    qtree_insert(&tree, v2(x, y));
+  }
+  qtree_reset(&tree);
+  size_t leaves_after_reset = qtree_count_leaves(&tree.root);
+
+  for (size_t i = 0; i < N_INSERTIONS; i++) {
+    float x = rand_float() * AREA_WIDTH - AREA_WIDTH / 2;
+    float y = rand_float() * AREA_HEIGHT - AREA_HEIGHT / 2;
+    qtree_insert(&tree, v2(x, y));
+  }
+  size_t leaves = qtree_count_leaves(&tree.root);
+
+  int suc = TEST_SUCCESS_FAILURE(leaves_after_reset == 0 && leaves == N_INSERTIONS);
+  if (!suc) {
+    fprintf(stderr, "-> Expected 0 and %ld leaves, got %ld and %ld.\n",
+            (long)N_INSERTIONS, leaves_after_reset, leaves);
+  }
+
+  qtree_free(&tree);
   return suc;
 }
 
 // TODO: Add assert statement for verification
 int test_qtree_insert_same(void) {
   V2 mid = v2(0, 0);
-  Node root = node_new(mid, NODE_ROOT, AREA_WIDTH, AREA_HEIGHT);
-  qtree_insert(&root, v2(1, 1));
-  qtree_insert(&root, v2(1, 1));
+  QTree tree = qtree_new(mid, AREA_WIDTH, AREA_HEIGHT);
+  qtree_insert(&tree, v2(1, 1));
+  qtree_insert(&tree, v2(1, 1));
 
   size_t bufsize = NODE_LOG_SIZE * 4 + 1;
   char write_buf[bufsize];
   size_t cur_idx = 0;
-  qtree_traverse_node_to_buf(write_buf, bufsize, &cur_idx, &root, 0);
+  qtree_traverse_node_to_buf(write_buf, bufsize, &cur_idx, &tree.root, 0);
 
   const char* expected =  " UPPER RIGHT:   NODE_EMPTY ( 2.50, -2.50)\n"
                           "  UPPER LEFT:   NODE_EMPTY (-2.50, -2.50)\n"
@@ -91,13 +165,13 @@ int test_qtree_insert_same(void) {
     fprintf(stderr, "-> Actual\n%s", write_buf);
   }
 
-  qtree_free(&root);
+  qtree_free(&tree);
   return suc;
 }
 
 int test_qtree_insert_pos(void) {
   V2 mid = v2(0.0, 0.0);
-  Node root = node_new(mid, NODE_ROOT, AREA_WIDTH, AREA_HEIGHT);
+  QTree tree = qtree_new(mid, AREA_WIDTH, AREA_HEIGHT);
   V2 children[] = {
     [RELPOS_UR] = v2( 2.5, -2.5),
     [RELPOS_UL] = v2(-2.5, -2.5),
@@ -106,14 +180,14 @@ int test_qtree_insert_pos(void) {
   };
 
   for (size_t i = 0; i < 4; i++) {
-    qtree_insert(&root, children[i]);
+    qtree_insert(&tree, children[i]);
   }
 
   // Output Traversal to buffer
   size_t bufsize = 4 * NODE_LOG_SIZE + 1;
   char write_buf[bufsize];
   size_t cur_idx = 0;
-  qtree_traverse_node_to_buf(write_buf, bufsize, &cur_idx, &root, RELPOS_NUM);
+  qtree_traverse_node_to_buf(write_buf, bufsize, &cur_idx, &tree.root, RELPOS_NUM);
 
   const char* expected = " UPPER RIGHT:    NODE_LEAF ( 2.50, -2.50)\n"
                          "  UPPER LEFT:    NODE_LEAF (-2.50, -2.50)\n"
@@ -126,7 +200,7 @@ int test_qtree_insert_pos(void) {
     fprintf(stderr, "-> Actual\n%s", write_buf);
   }
 
-  qtree_free(&root);
+  qtree_free(&tree);
   return suc;
 }
 
@@ -134,34 +208,733 @@ int test_closest_location() {
   float xs[N_POINTS_CLOSEST];
   float ys[N_POINTS_CLOSEST];
 
-  V2 mid = v2(0.0, 0.0);
-  Node root = node_new(mid, NODE_ROOT, 1.0, 1.0);
+  int suc = true;
+  for (size_t set = 0; set < N_SETS_CLOSEST && suc; set++) {
+    V2 mid = v2(0.5, 0.5);
+    QTree tree = qtree_new(mid, 1.0, 1.0);
+
+    // later sets are denser, so the search has to go deeper
+    size_t n_points = N_POINTS_CLOSEST >> (N_SETS_CLOSEST - 1 - set);
+    for (size_t i = 0; i < n_points; i++) {
+      xs[i] = rand_float();
+      ys[i] = rand_float();
+      qtree_insert(&tree, v2(xs[i], ys[i]));
+    }
+
+    for (size_t i = 0; i < N_TESTS_CLOSEST && suc; i++) {
+      // also query from outside of the root
+      V2 c_pt = v2(rand_float() * 1.5 - 0.25, rand_float() * 1.5 - 0.25);
+      float c_dist;
+      const V2* c_pos = qtree_find_closest(&tree.root, &c_pt, &c_dist);
+
+      float brute_dist = INFINITY;
+      for (size_t j = 0; j < n_points; j++) {
+        float cur_dist = v2_dist(c_pt, v2(xs[j], ys[j]));
+        if (cur_dist < brute_dist) brute_dist = cur_dist;
+      }
+
+      if (c_pos == NULL
+          || fabsf(v2_dist(c_pt, *c_pos) - brute_dist) > 1e-6
+          || fabsf(c_dist - brute_dist) > 1e-6) {
+        fprintf(stderr, "-> Query (%.4f, %.4f) in set of %ld: expected distance %f, got %f\n",
+                P_COORDS(c_pt), n_points, brute_dist, c_pos == NULL ? -1.0 : c_dist);
+        suc = false;
+      }
+    }
+
+    qtree_free(&tree);
+  }
+
+  suc = TEST_SUCCESS_FAILURE(suc);
+  return suc;
+}
+
+int float_cmp(const void* a, const void* b) {
+  float fa = *(const float*)a;
+  float fb = *(const float*)b;
+  return (fa > fb) - (fa < fb);
+}
+
+int test_knn_radius(void) {
+  V2 points[N_POINTS_CLOSEST];
+  float brute[N_POINTS_CLOSEST];
+  V2 knn[N_KNN];
+  float knn_dists[N_KNN];
+
+  V2 mid = v2(0.5, 0.5);
+  QTree tree = qtree_new(mid, 1.0, 1.0);
+  for (size_t i = 0; i < N_POINTS_CLOSEST; i++) {
+    points[i] = v2(rand_float(), rand_float());
+    qtree_insert(&tree, points[i]);
+  }
+  PList found = PList_new(N_POINTS_CLOSEST);
+
+  int suc = true;
+  for (size_t i = 0; i < N_TESTS_CLOSEST && suc; i++) {
+    V2 c_pt = v2(rand_float() * 1.5 - 0.25, rand_float() * 1.5 - 0.25);
+    for (size_t j = 0; j < N_POINTS_CLOSEST; j++) {
+      brute[j] = v2_dist(c_pt, points[j]);
+    }
+    qsort(brute, N_POINTS_CLOSEST, sizeof(float), float_cmp);
+
+    size_t n_knn = qtree_knn(&tree.root, &c_pt, N_KNN, knn, knn_dists);
+    suc = n_knn == N_KNN;
+    for (size_t j = 0; j < n_knn && suc; j++) {
+      suc = fabsf(knn_dists[j] - brute[j]) < 1e-6
+         && fabsf(v2_dist(c_pt, knn[j]) - brute[j]) < 1e-6;
+    }
+
+    // radius halfway between two neighbours, so rounding cannot flip the result
+    float r = (brute[N_KNN - 1] + brute[N_KNN]) / 2;
+    found.count = 0;
+    size_t n_radius = qtree_radius(&tree.root, &c_pt, r, &found);
+    suc = suc && n_radius == N_KNN && found.count == N_KNN;
+    for (size_t j = 0; j < found.count && suc; j++) {
+      suc = v2_dist(c_pt, found.points[j]) <= r;
+    }
+    if (!suc) {
+      fprintf(stderr, "-> Query (%.4f, %.4f): got %ld knn and %ld radius results, expected %d\n",
+              P_COORDS(c_pt), n_knn, n_radius, N_KNN);
+    }
+  }
+
+  suc = TEST_SUCCESS_FAILURE(suc);
+  PList_free(&found);
+  qtree_free(&tree);
+  return suc;
+}
+
+typedef struct {
+  V2 min;
+  V2 max;
+  size_t inside;
+  size_t visited;
+} RectCount;
+
+void count_leaves_in_rect(Node* node, void* user) {
+  RectCount* count = user;
+  count->visited++;
+  if (node->type != NODE_LEAF) return;
+  for (uint32_t i = 0; i < node->count; i++) {
+    count->inside += node->points[i].x >= count->min.x && node->points[i].x <= count->max.x
+                  && node->points[i].y >= count->min.y && node->points[i].y <= count->max.y;
+  }
+}
+
+int test_query_rect(void) {
+  V2 points[N_POINTS_CLOSEST];
+  V2 mid = v2(0.5, 0.5);
+  QTree tree = qtree_new(mid, 1.0, 1.0);
+  for (size_t i = 0; i < N_POINTS_CLOSEST; i++) {
+    points[i] = v2(rand_float(), rand_float());
+    qtree_insert(&tree, points[i]);
+  }
+
+  int suc = true;
+  for (size_t i = 0; i < N_TESTS_CLOSEST && suc; i++) {
+    V2 a = v2(rand_float(), rand_float());
+    V2 b = v2(rand_float(), rand_float());
+    RectCount count = {
+      .min = v2(fminf(a.x, b.x), fminf(a.y, b.y)),
+      .max = v2(fmaxf(a.x, b.x), fmaxf(a.y, b.y)),
+    };
+    size_t visited = qtree_query_rect(&tree.root, count.min, count.max, 0,
+                                      count_leaves_in_rect, &count);
+
+    size_t brute = 0;
+    for (size_t j = 0; j < N_POINTS_CLOSEST; j++) {
+      brute += points[j].x >= count.min.x && points[j].x <= count.max.x
+            && points[j].y >= count.min.y && points[j].y <= count.max.y;
+    }
+    suc = count.inside == brute && count.visited == visited;
+    if (!suc) {
+      fprintf(stderr, "-> Expected %ld points in rect, got %ld.\n", brute, count.inside);
+    }
+  }
+
+  // a cut-off above the root size only visits the root
+  RectCount count = {0};
+  size_t visited = qtree_query_rect(&tree.root, v2(0, 0), v2(1, 1), 2.0,
+                                    count_leaves_in_rect, &count);
+  suc = suc && visited == 1;
+
+  suc = TEST_SUCCESS_FAILURE(suc);
+  qtree_free(&tree);
+  return suc;
+}
+
+int test_qtree_build(void) {
+  V2 mid = v2(0, 0);
+  QTree inserted = qtree_new(mid, AREA_WIDTH, AREA_HEIGHT);
+  QTree built = qtree_new(mid, AREA_WIDTH, AREA_HEIGHT);
+  PList a = PList_new(N_INSERTIONS);
+  PList b = PList_new(N_INSERTIONS);
+
+  // some points outside of the root and some duplicates across both lists
+  for (size_t i = 0; i < N_INSERTIONS; i++) {
+    float x = rand_float() * AREA_WIDTH * 1.2 - AREA_WIDTH * 0.6;
+    float y = rand_float() * AREA_HEIGHT * 1.2 - AREA_HEIGHT * 0.6;
+    PList_push(i % 2 ? &a : &b, x, y);
+    if (i % 16 == 0) PList_push(&b, x, y);
+  }
+  const PList* lists[] = {&a, &b};
+  for (size_t i = 0; i < 2; i++) {
+    for (size_t j = 0; j < lists[i]->count; j++) {
+      qtree_insert(&inserted, lists[i]->points[j]);
+    }
+  }
+
+  // build twice, the second build has to replace the first
+  qtree_build(&built, 1, lists);
+  qtree_build(&built, 2, lists);
+
+  int suc = TEST_SUCCESS_FAILURE(qtree_eq(&inserted.root, &built.root)
+                                 && qtree_count_leaves(&built.root) == qtree_count_leaves(&inserted.root));
+  if (!suc) {
+    fprintf(stderr, "-> Expected %ld leaves, got %ld.\n",
+            qtree_count_leaves(&inserted.root), qtree_count_leaves(&built.root));
+  }
+
+  PList_free(&a);
+  PList_free(&b);
+  qtree_free(&inserted);
+  qtree_free(&built);
+  return suc;
+}
+
+int test_qtree_build_parallel(void) {
+  V2 mid = v2(0, 0);
+  QTree inserted = qtree_new(mid, AREA_WIDTH, AREA_HEIGHT);
+  QTree built = qtree_new(mid, AREA_WIDTH, AREA_HEIGHT);
+  PList a = PList_new(N_PARALLEL_POINTS + 2);
+
+  // clustered points, so the subtrees of the threads differ a lot in size
+  for (size_t i = 0; i < N_PARALLEL_POINTS; i++) {
+    float spread = i % 4 ? AREA_WIDTH / 64 : AREA_WIDTH;
+    float x = rand_float() * spread - spread / 2 + (i % 4 ? AREA_WIDTH / 5 : 0);
+    float y = rand_float() * spread - spread / 2;
+    PList_push(&a, x, y);
+    qtree_insert(&inserted, v2(x, y));
+  }
+  // two points that only part in cells far below the split depth of the threads
+  for (size_t i = 1; i <= 2; i++) {
+    PList_push(&a, i * 1e-12f, 1e-12f);
+    qtree_insert(&inserted, v2(i * 1e-12f, 1e-12f));
+  }
+  const PList* lists[] = {&a};
+
+  int suc = true;
+  size_t thread_counts[] = {1, 2, 3, 8, 0};
+  for (size_t i = 0; i < sizeof(thread_counts) / sizeof(thread_counts[0]); i++) {
+    qtree_build_parallel(&built, 1, lists, thread_counts[i]);
+    if (!qtree_eq(&inserted.root, &built.root)) {
+      fprintf(stderr, "-> Tree built with %ld threads differs\n", thread_counts[i]);
+      suc = false;
+    }
+  }
+  suc = TEST_SUCCESS_FAILURE(suc);
+
+  PList_free(&a);
+  qtree_free(&inserted);
+  qtree_free(&built);
+  return suc;
+}
+
+int test_qtree_remove_move(void) {
+  V2 mid = v2(0, 0);
+  QTree edited = qtree_new(mid, AREA_WIDTH, AREA_HEIGHT);
+  QTree built = qtree_new(mid, AREA_WIDTH, AREA_HEIGHT);
+  PList points = PList_new(N_INSERTIONS);
+
+  for (size_t i = 0; i < N_INSERTIONS; i++) {
+    float x = rand_float() * AREA_WIDTH - AREA_WIDTH / 2;
+    float y = rand_float() * AREA_HEIGHT - AREA_HEIGHT / 2;
+    PList_push(&points, x, y);
+    qtree_insert(&edited, v2(x, y));
+  }
+
+  int suc = !qtree_remove(&edited, v2(AREA_WIDTH, AREA_HEIGHT));
+  // remove every third point, move every third point, some only a tiny bit
+  size_t kept = 0;
+  for (size_t i = 0; i < points.count; i++) {
+    V2 p = points.points[i];
+    if (i % 3 == 0) {
+      suc = suc && qtree_remove(&edited, p) && qtree_find(&edited.root, p) == NULL;
+      continue;
+    }
+    if (i % 3 == 1) {
+      V2 to = i % 2 ? v2(rand_float() * AREA_WIDTH - AREA_WIDTH / 2,
+                         rand_float() * AREA_HEIGHT - AREA_HEIGHT / 2)
+                    : v2(p.x + 1e-4, p.y);
+      if (qtree_move(&edited, p, to)) p = to;
+    }
+    points.points[kept++] = p;
+  }
+  points.count = kept;
+
+  const PList* lists[] = {&points};
+  qtree_build(&built, 1, lists);
+  suc = suc && qtree_eq(&built.root, &edited.root);
+
+  // removing everything gives back an empty root
+  for (size_t i = 0; i < points.count; i++) {
+    suc = suc && qtree_remove(&edited, points.points[i]);
+  }
+  suc = TEST_SUCCESS_FAILURE(suc && edited.root.children == NULL && edited.arena.n_blocks == 0);
+
+  PList_free(&points);
+  qtree_free(&edited);
+  qtree_free(&built);
+  return suc;
+}
+
+// a move into a full leaf at the maximum depth fails and keeps the point
+int test_qtree_move_max_depth(void) {
+  V2 mid = v2(0, 0);
+  QTree tree = qtree_new(mid, AREA_WIDTH, AREA_HEIGHT);
+  // a full leaf of points that only part far below QTREE_MAX_DEPTH
+  int suc = true;
+  for (size_t i = 1; i <= QTREE_LEAF_CAP; i++) {
+    suc = qtree_insert(&tree, v2(i * 1e-14f, 1e-14f)) && suc;
+  }
+  const V2 from = v2(AREA_WIDTH / 4, AREA_HEIGHT / 4);
+  const V2 to = v2((QTREE_LEAF_CAP + 1) * 1e-14f, 1e-14f);
+  suc = suc && qtree_insert(&tree, from);
+  const size_t n_points = qtree_count_points(&tree.root);
+  const size_t n_blocks = tree.arena.n_blocks;
+
+  // not even the branches on the way to the maximum depth are left behind
+  suc = suc && !qtree_move(&tree, from, to);
+  suc = suc && qtree_find(&tree.root, from) != NULL && qtree_find(&tree.root, to) == NULL;
+  suc = TEST_SUCCESS_FAILURE(suc && qtree_count_points(&tree.root) == n_points
+                             && tree.arena.n_blocks == n_blocks);
+
+  qtree_free(&tree);
+  return suc;
+}
+
+int test_lqtree_matches_qtree(void) {
+  V2 mid = v2(0, 0);
+  QTree tree = qtree_new(mid, AREA_WIDTH, AREA_HEIGHT);
+  LQTree ltree = lqtree_new(mid, AREA_WIDTH, AREA_HEIGHT, 16);
+
+  V2 points[N_INSERTIONS];
+  for (size_t i = 0; i < N_INSERTIONS; i++) {
+    points[i] = v2(rand_float() * AREA_WIDTH - AREA_WIDTH / 2,
+                   rand_float() * AREA_HEIGHT - AREA_HEIGHT / 2);
+    qtree_insert(&tree, points[i]);
+    if (i % 2 == 0) lqtree_insert(&ltree, points[i]);
+  }
+  // the rest in one go, including points that are already in the tree
+  lqtree_insert_batch(&ltree, points, N_INSERTIONS);
+
+  char *expected = NULL, *actual = NULL;
+  size_t expected_size = 0, actual_size = 0;
+  FILE* f = open_memstream(&expected, &expected_size);
+  _qtree_traverse_node(f, &tree.root);
+  fclose(f);
+  f = open_memstream(&actual, &actual_size);
+  _lqtree_traverse_node(f, &ltree);
+  fclose(f);
+
+  int suc = TEST_SUCCESS_FAILURE(lqtree_count_leaves(&ltree) == qtree_count_leaves(&tree.root)
+                                 && !strcmp(expected, actual));
+  if (!suc) {
+    fprintf(stderr, "-> Expected %ld leaves, got %ld.\n",
+            qtree_count_leaves(&tree.root), lqtree_count_leaves(&ltree));
+  }
+
+  free(expected);
+  free(actual);
+  lqtree_free(&ltree);
+  qtree_free(&tree);
+  return suc;
+}
+
+int test_lqtree_closest(void) {
+  V2 mid = v2(0.5, 0.5);
+  LQTree ltree = lqtree_new(mid, 1.0, 1.0, N_POINTS_CLOSEST);
 
-  // TODO: Assert fails in qtree insertion, why?
+  V2 points[N_POINTS_CLOSEST];
   for (size_t i = 0; i < N_POINTS_CLOSEST; i++) {
-    xs[i] = rand_float();
-    ys[i] = rand_float();
-    qtree_insert(&root, v2(xs[i], ys[i]));
+    points[i] = v2(rand_float(), rand_float());
+    lqtree_insert(&ltree, points[i]);
   }
 
   int suc = true;
   for (size_t i = 0; i < N_TESTS_CLOSEST && suc; i++) {
     V2 c_pt = v2(rand_float(), rand_float());
-    Node* c_node = qtree_find_closest(&root, &c_pt);
-    V2 c_pos = qtree_find_closest(&root, &c_pt)->pos;
-    float closest_dist = v2_dist(c_pt, c_pos);
-    for (size_t i = 0; i < N_POINTS_CLOSEST && suc; i++) {
-      float cur_dist = v2_dist(c_pt, v2(xs[i], ys[i]));
-      if (cur_dist < closest_dist) suc = false;
+    const V2* closest = lqtree_find_closest(&ltree, &c_pt, NULL);
+    float closest_dist = v2_dist(c_pt, *closest);
+    for (size_t j = 0; j < N_POINTS_CLOSEST && suc; j++) {
+      if (v2_dist(c_pt, points[j]) < closest_dist) suc = false;
+    }
+  }
+  suc = TEST_SUCCESS_FAILURE(suc);
+
+  lqtree_free(&ltree);
+  return suc;
+}
+
+// the index of this build, half of the points one by one and half as a batch
+int test_qindex(void) {
+  V2 mid = v2(0.5, 0.5);
+  QIndex index = qindex_new(mid, 1.0, 1.0);
+
+  V2 points[N_POINTS_CLOSEST];
+  for (size_t i = 0; i < N_POINTS_CLOSEST; i++) {
+    points[i] = v2(rand_float(), rand_float());
+  }
+  int suc = true;
+  for (size_t i = 0; i < N_POINTS_CLOSEST / 2; i++) {
+    suc = qindex_insert(&index, points[i]) && suc;
+  }
+  suc = suc && !qindex_insert(&index, points[0]);
+  suc = suc && qindex_insert_batch(&index, &points[N_POINTS_CLOSEST / 2], N_POINTS_CLOSEST / 2)
+    == N_POINTS_CLOSEST / 2;
+  suc = suc && qindex_count_leaves(&index) == N_POINTS_CLOSEST;
+
+  for (size_t i = 0; i < N_TESTS_CLOSEST && suc; i++) {
+    V2 c_pt = v2(rand_float(), rand_float());
+    float closest_dist;
+    const V2* closest = qindex_find_closest(&index, &c_pt, &closest_dist);
+    suc = closest != NULL && v2_dist(c_pt, *closest) == closest_dist;
+    for (size_t j = 0; j < N_POINTS_CLOSEST && suc; j++) {
+      if (v2_dist(c_pt, points[j]) < closest_dist) suc = false;
+    }
+  }
+  suc = TEST_SUCCESS_FAILURE(suc);
+  if (!suc) fprintf(stderr, "-> with the %s index\n", QINDEX_NAME);
+
+  qindex_free(&index);
+  return suc;
+}
+
+// every kernel set the cpu supports has to match the scalar kernels exactly
+int test_v2_batch(void) {
+  V2* pts = malloc(sizeof(V2) * N_BATCH);
+  float* dist2 = malloc(sizeof(float) * N_BATCH);
+  float* dist = malloc(sizeof(float) * N_BATCH);
+  uint8_t* rpos = malloc(N_BATCH);
+  V2 center = v2(0.5, 0.5);
+  for (size_t i = 0; i < N_BATCH; i++) {
+    pts[i] = v2(rand_float(), rand_float());
+    // points on the center lines of both axes
+    if (i % 7 == 0) pts[i].x = center.x;
+    if (i % 11 == 0) pts[i].y = center.y;
+  }
+
+  const V2BatchIsa default_isa = v2_batch_isa();
+  int suc = true;
+  for (V2BatchIsa isa = V2_BATCH_SCALAR; isa < V2_BATCH_NUM; isa++) {
+    if (!v2_batch_set_isa(isa)) continue;
+    // all lengths up to a few full steps, so every tail is covered
+    for (size_t n = 0; n <= 19 && suc; n++) {
+      const V2* p = &pts[N_BATCH - n];
+      v2_dist2_batch(p, n, center, dist2);
+      v2_dist_batch(p, n, center, dist);
+      relative_pos_batch(p, n, center, rpos);
+      V2 min = v2(0, 0), max = v2(0, 0);
+      suc = v2_bounds(p, n, &min, &max) == (n > 0);
+      for (size_t i = 0; i < n && suc; i++) {
+        const V2 d = v2_sub(p[i], center);
+        suc = dist2[i] == d.x * d.x + d.y * d.y
+           && dist[i] == sqrtf(dist2[i])
+           && rpos[i] == relative_pos(&center, &p[i])
+           && min.x <= p[i].x && min.y <= p[i].y && max.x >= p[i].x && max.y >= p[i].y;
+      }
+      if (!suc) fprintf(stderr, "-> %s kernels differ for %ld points\n", v2_batch_isa_to_cstr(isa), n);
+    }
+    V2 min, max;
+    v2_bounds(pts, N_BATCH, &min, &max);
+    relative_pos_batch(pts, N_BATCH, center, rpos);
+    for (size_t i = 0; i < N_BATCH && suc; i++) {
+      suc = rpos[i] == relative_pos(&center, &pts[i]);
     }
+    V2 bmin = pts[0], bmax = pts[0];
+    for (size_t i = 0; i < N_BATCH; i++) {
+      bmin = v2(fminf(bmin.x, pts[i].x), fminf(bmin.y, pts[i].y));
+      bmax = v2(fmaxf(bmax.x, pts[i].x), fmaxf(bmax.y, pts[i].y));
+    }
+    suc = suc && v2_eq(min, bmin) && v2_eq(max, bmax);
+    if (!suc) fprintf(stderr, "-> %s kernels differ\n", v2_batch_isa_to_cstr(isa));
+  }
+  v2_batch_set_isa(default_isa);
+  suc = TEST_SUCCESS_FAILURE(suc);
+
+  free(pts);
+  free(dist2);
+  free(dist);
+  free(rpos);
+  return suc;
+}
+
+// print v with fmt, return what strtof reads back after the separators
+static float print_float(char* buf, size_t size, const char* fmt, float v) {
+  snprintf(buf, size, fmt, v);
+  return strtof(buf + strspn(buf, " \t,;"), NULL);
+}
+
+int test_point_stream(void) {
+  char text_path[] = "/tmp/gen_mesh_stream_XXXXXX";
+  char raw_path[] = "/tmp/gen_mesh_stream_XXXXXX.bin";
+  const int text_fd = mkstemp(text_path);
+  const int raw_fd = mkstemps(raw_path, 4);
+  FILE* text = text_fd >= 0 ? fdopen(text_fd, "w") : NULL;
+  FILE* raw = raw_fd >= 0 ? fdopen(raw_fd, "wb") : NULL;
+  int suc = text != NULL && raw != NULL;
+
+  // the formats of x and y per line, the fast parser has to agree with strtof
+  const char* formats[][2] = {
+    {"%.9g", " %.9g\n"},
+    {"%f", ",%f,1.5\r\n"},
+    {"  %.3e", "\t%.3e # comment\n"},
+    {"%.20f", ";%.2f\n"},
+    {"%+.1f", " %.0f\n"},
+    {"%.16e", " %.17g\n"},
+  };
+  const size_t n_formats = sizeof(formats) / sizeof(formats[0]);
+  PList expected = PList_new(N_STREAM_POINTS);
+  if (suc) fprintf(text, "# x y z\n\n");
+  for (size_t i = 0; i < N_STREAM_POINTS && suc; i++) {
+    char bx[64], by[64];
+    const char** fmt = formats[i % n_formats];
+    const float x = print_float(bx, sizeof(bx), fmt[0], rand_float() * AREA_WIDTH - AREA_WIDTH / 2);
+    const float y = print_float(by, sizeof(by), fmt[1], rand_float() * AREA_HEIGHT - AREA_HEIGHT / 2);
+    // the last line ends without a newline
+    if (i + 1 == N_STREAM_POINTS) by[strcspn(by, "\r\n")] = '\0';
+    fputs(bx, text);
+    fputs(by, text);
+    PList_push(&expected, x, y);
+    fwrite(&expected.points[i], sizeof(V2), 1, raw);
+  }
+  if (text != NULL) fclose(text);
+  if (raw != NULL) fclose(raw);
+
+  PointStream stream;
+  PList got = PList_new(0);
+  suc = suc && point_format_from_path(text_path) == POINTS_TEXT && point_format_from_path(raw_path) == POINTS_RAW;
+  suc = suc && PointStream_open(&stream, text_path, POINTS_TEXT);
+  while (suc && PointStream_read(&stream, &got, STREAM_READ) > 0);
+  suc = suc && stream.ok && got.count == N_STREAM_POINTS
+    && memcmp(got.points, expected.points, sizeof(V2) * N_STREAM_POINTS) == 0;
+
+  // streaming into a tree gives the tree built from all points
+  V2 min, max, emin, emax;
+  QTree streamed = qtree_new(v2(0, 0), AREA_WIDTH, AREA_HEIGHT);
+  QTree built = qtree_new(v2(0, 0), AREA_WIDTH, AREA_HEIGHT);
+  const PList* lists[] = {&expected};
+  suc = suc && PointStream_rewind(&stream) && PointStream_bounds(&stream, &min, &max) && v2_bounds(expected.points, expected.count, &emin, &emax)
+    && v2_eq(min, emin) && v2_eq(max, emax);
+  // duplicates are dropped, so count the leaves
+  suc = suc && qtree_build(&built, 1, lists) == N_STREAM_POINTS;
+  suc = suc && PointStream_insert(&stream, &streamed, STREAM_READ) == qtree_count_leaves(&built.root);
+  suc = suc && stream.ok && qtree_eq(&streamed.root, &built.root);
+  if (suc) PointStream_close(&stream);
+
+  got.count = 0;
+  suc = suc && PointStream_open(&stream, raw_path, POINTS_RAW) && PointStream_read(&stream, &got, 0) == N_STREAM_POINTS;
+  suc = suc && stream.ok && memcmp(got.points, expected.points, sizeof(V2) * N_STREAM_POINTS) == 0;
+  if (suc) PointStream_close(&stream);
+
+  // more digits than a float holds must not be rounded twice
+  text = suc ? fopen(text_path, "w") : NULL;
+  suc = suc && text != NULL && fputs("6.975628280639648e+01 1.0000000596046448\n", text) >= 0 && fclose(text) == 0;
+  got.count = 0;
+  suc = suc && PointStream_open(&stream, text_path, POINTS_TEXT) && PointStream_read(&stream, &got, 0) == 1;
+  suc = suc && got.points[0].x == strtof("6.975628280639648e+01", NULL)
+    && got.points[0].y == strtof("1.0000000596046448", NULL);
+  if (suc) PointStream_close(&stream);
+
+  // lines without a point stop the stream
+  text = suc ? fopen(text_path, "w") : NULL;
+  suc = suc && text != NULL && fputs("1 2\n3 oops\n4 5\n", text) >= 0 && fclose(text) == 0;
+  got.count = 0;
+  suc = suc && PointStream_open(&stream, text_path, POINTS_TEXT) && PointStream_read(&stream, &got, 0) == 1;
+  suc = suc && !stream.ok && stream.line == 2;
+  if (suc) PointStream_close(&stream);
+  suc = TEST_SUCCESS_FAILURE(suc);
+
+  unlink(text_path);
+  unlink(raw_path);
+  qtree_free(&streamed);
+  qtree_free(&built);
+  PList_free(&got);
+  PList_free(&expected);
+  return suc;
+}
+
+#define LOG_FMT "thread %d message %zu %s %5.2f [%*d] %lx %c %%"
+#define LOG_ARGS(t, i) (t), (i), "str", (i) * 0.5, 4, (int)(i) % 1000, (unsigned long)(i), 'a' + (int)(i) % 26
+
+static void* log_worker(void* user) {
+  const int t = *(int*)user;
+  for (size_t i = 0; i < N_LOG_MESSAGES; i++) {
+    log_err(LOG_FMT, LOG_ARGS(t, i));
+  }
+  return NULL;
+}
+
+// last message + 1 per thread, the messages and drops reported in total
+// false if a line does not match what printf gives or a thread is out of order
+static bool read_log(FILE* f, size_t* counts, size_t* lines, size_t* dropped) {
+  char line[1024], expected[1024];
+  rewind(f);
+  while (fgets(line, sizeof(line), f) != NULL) {
+    const char* msg = strstr(line, "]: ");
+    int t;
+    size_t i;
+    if (msg == NULL || sscanf(msg + 3, "thread %d message %zu", &t, &i) != 2) {
+      size_t n;
+      if (sscanf(line, "log: dropped %zu", &n) == 1) *dropped += n;
+      continue;
+    }
+    snprintf(expected, sizeof(expected), LOG_FMT "\n", LOG_ARGS(t, i));
+    if (t < 0 || t >= N_LOG_THREADS || strcmp(msg + 3, expected) != 0 || i < counts[t]) return false;
+    counts[t] = i + 1;
+    (*lines)++;
+  }
+  return true;
+}
+
+int test_log_async(void) {
+  FILE* out = tmpfile();
+  pthread_t threads[N_LOG_THREADS];
+  int ids[N_LOG_THREADS];
+  size_t counts[N_LOG_THREADS] = {0};
+  size_t lines = 0, dropped = 0;
+  int suc = out != NULL && log_async_start(out, LOG_BLOCK);
+
+  // blocking loses nothing, every thread keeps its order
+  for (int t = 0; t < N_LOG_THREADS && suc; t++) {
+    ids[t] = t;
+    suc = pthread_create(&threads[t], NULL, log_worker, &ids[t]) == 0;
+  }
+  // more arguments than a record holds, formatted right away
+  log_err("%d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d", 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17);
+  for (int t = 0; t < N_LOG_THREADS && suc; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  log_flush();
+  suc = suc && read_log(out, counts, &lines, &dropped);
+  suc = suc && lines == N_LOG_THREADS * N_LOG_MESSAGES && dropped == 0 && log_dropped() == 0;
+  for (int t = 0; t < N_LOG_THREADS && suc; t++) {
+    suc = counts[t] == N_LOG_MESSAGES;
+  }
+  log_async_stop();
+
+  // dropping loses messages, but all of them are reported
+  if (out != NULL) fclose(out);
+  out = suc ? tmpfile() : NULL;
+  suc = suc && out != NULL && log_async_start(out, LOG_DROP);
+  ids[0] = 0;
+  if (suc) log_worker(&ids[0]);
+  log_async_stop();
+  lines = dropped = counts[0] = 0;
+  suc = suc && read_log(out, counts, &lines, &dropped);
+  suc = suc && lines + dropped == N_LOG_MESSAGES && dropped == log_dropped();
+  suc = TEST_SUCCESS_FAILURE(suc);
+
+  if (out != NULL) fclose(out);
+  return suc;
+}
+
+static void* instr_worker(void* user) {
+  (void)user;
+  for (size_t i = 0; i < N_INSTR_SCOPES; i++) {
+    INSTR_SCOPE("test_scope");
+    INSTR_COUNT(CTR_NN_VISITED, 1);
   }
+  return NULL;
+}
+
+// lines of f containing str
+static size_t count_lines(FILE* f, const char* str) {
+  char line[1024];
+  size_t n = 0;
+  rewind(f);
+  while (fgets(line, sizeof(line), f) != NULL) {
+    n += strstr(line, str) != NULL;
+  }
+  return n;
+}
 
-  qtree_free(&root);
+int test_instrument(void) {
+  V2 mid = v2(0, 0);
+  QTree tree = qtree_new(mid, AREA_WIDTH, AREA_HEIGHT);
+  PList a = PList_new(N_PARALLEL_POINTS);
+  for (size_t i = 0; i < N_PARALLEL_POINTS; i++) {
+    float spread = i % 4 ? AREA_WIDTH / 64 : AREA_WIDTH;
+    PList_push(&a, rand_float() * spread - spread / 2, rand_float() * spread - spread / 2);
+  }
+  const PList* lists[] = {&a};
+  int suc = true;
+
+  // nothing is recorded while disabled
+  instr_reset();
+  qtree_build(&tree, 1, lists);
+  InstrScopeStats st;
+  suc = suc && !instr_scope_stats("qtree_build", &st) && instr_counter(CTR_SPLITS) == 0;
+
+  // the parallel build splits the same nodes down to the same depth
+  instr_enable(true);
+  qtree_build(&tree, 1, lists);
+  const uint64_t splits = instr_counter(CTR_SPLITS);
+  const uint64_t depth = instr_counter(CTR_MAX_DEPTH);
+  instr_reset();
+  qtree_build_parallel(&tree, 1, lists, 4);
+  suc = suc && instr_counter(CTR_SPLITS) == splits && instr_counter(CTR_MAX_DEPTH) == depth;
+  suc = suc && instr_counter(CTR_NODES) == RELPOS_NUM * splits;
+  suc = suc && (!INSTRUMENT || (splits > 0 && depth > 1));
+
+  // inserts record the same deepest leaf as the build, the one of the tree
+  suc = suc && (!INSTRUMENT || depth == qtree_max_depth(&tree.root));
+  QTree inserted = qtree_new(mid, AREA_WIDTH, AREA_HEIGHT);
+  instr_reset();
+  for (size_t i = 0; i < a.count; i++) {
+    qtree_insert(&inserted, a.points[i]);
+  }
+  suc = suc && (!INSTRUMENT || instr_counter(CTR_MAX_DEPTH) == qtree_max_depth(&inserted.root));
+  suc = suc && qtree_max_depth(&inserted.root) == qtree_max_depth(&tree.root);
+  qtree_free(&inserted);
+
+  // scopes and counters of all threads are merged
+  instr_reset();
+  pthread_t threads[N_INSTR_THREADS];
+  for (int t = 0; t < N_INSTR_THREADS && suc; t++) {
+    suc = pthread_create(&threads[t], NULL, instr_worker, NULL) == 0;
+  }
+  for (int t = 0; t < N_INSTR_THREADS && suc; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  const uint64_t calls = INSTRUMENT ? N_INSTR_THREADS * N_INSTR_SCOPES : 0;
+  suc = suc && instr_scope_stats("test_scope", &st) == (calls > 0);
+  suc = suc && st.calls == calls && instr_counter(CTR_NN_VISITED) == calls;
+  suc = suc && (calls == 0 || (st.min <= st.max && st.max <= st.total));
+
+  // one complete event per scope, one counter event and name per thread
+  char path[] = "/tmp/test_instrument_XXXXXX";
+  const int fd = mkstemp(path);
+  FILE* f = NULL;
+  suc = suc && fd >= 0 && instr_write_trace(path) && (f = fopen(path, "r")) != NULL;
+  suc = suc && count_lines(f, "\"ph\": \"X\"") == calls
+    && count_lines(f, "\"ph\": \"C\"") == count_lines(f, "\"ph\": \"M\"")
+    && count_lines(f, "\"traceEvents\"") == 1;
+  suc = TEST_SUCCESS_FAILURE(suc);
+
+  instr_enable(false);
+  instr_reset();
+  if (f != NULL) fclose(f);
+  if (fd >= 0) {
+    close(fd);
+    unlink(path);
+  }
+  PList_free(&a);
+  qtree_free(&tree);
   return suc;
 }
 
 // TODO: Test insert position location correctness
-// TODO: Test closest point correctness
 
 typedef int (test_func)(void);
 bool exec_test(test_func func) {
@@ -172,11 +945,26 @@ bool exec_test(test_func func) {
 
 int main() {
   srand(0x69);
+  log_set_level(VERB_ERR);
   test_func *functions[] = {
     &test_qtree_insert_number,
     &test_qtree_insert_pos,
     &test_qtree_insert_same,
+    &test_qtree_reset,
+    &test_qtree_build,
+    &test_qtree_build_parallel,
+    &test_qtree_remove_move,
+    &test_qtree_move_max_depth,
+    &test_lqtree_matches_qtree,
+    &test_lqtree_closest,
+    &test_qindex,
     &test_closest_location,
+    &test_knn_radius,
+    &test_query_rect,
+    &test_v2_batch,
+    &test_point_stream,
+    &test_log_async,
+    &test_instrument,
   };
 
   size_t n_funcs = sizeof(functions)/(sizeof(functions[0]));